@@ -193,8 +193,14 @@ static const u8* main_payload_32 =
   "  movl %ecx, %edi\n"
 #endif /* ^!COVERAGE_ONLY */
   "\n"
-#ifdef SKIP_COUNTS
+#if defined(SKIP_COUNTS)
   "  orb  $1, (%edx, %edi, 1)\n"
+#elif defined(NEVER_ZERO_COUNTS)
+  "  addb $1, (%edx, %edi, 1)\n"
+  "  adcb $0, (%edx, %edi, 1)\n"
+#elif defined(SATURATED_COUNTS)
+  "  addb $1, (%edx, %edi, 1)\n"
+  "  sbbb $0, (%edx, %edi, 1)\n"
 #else
   "  incb (%edx, %edi, 1)\n"
 #endif /* ^SKIP_COUNTS */
@@ -421,8 +427,14 @@ static const u8* main_payload_64 =
   "  shrq $1, __afl_prev_loc(%rip)\n"
 #endif /* ^!COVERAGE_ONLY */
   "\n"
-#ifdef SKIP_COUNTS
+#if defined(SKIP_COUNTS)
   "  orb  $1, (%rdx, %rcx, 1)\n"
+#elif defined(NEVER_ZERO_COUNTS)
+  "  addb $1, (%rdx, %rcx, 1)\n"
+  "  adcb $0, (%rdx, %rcx, 1)\n"
+#elif defined(SATURATED_COUNTS)
+  "  addb $1, (%rdx, %rcx, 1)\n"
+  "  sbbb $0, (%rdx, %rcx, 1)\n"
 #else
   "  incb (%rdx, %rcx, 1)\n"
 #endif /* ^SKIP_COUNTS */
@@ -104,6 +104,8 @@ EXP_ST u8 *in_dir,                    /* Input directory with test cases  */
 
 EXP_ST u32 exec_tmout = EXEC_TIMEOUT; /* Configurable exec timeout (ms)   */
 static u32 hang_tmout = EXEC_TIMEOUT; /* Timeout used for hang det (ms)   */
+static u32 cur_tmout  = EXEC_TIMEOUT; /* Timeout for the current entry    */
+static u32 run_tmout  = EXEC_TIMEOUT; /* Timeout of the last run_target() */
 
 EXP_ST u64 mem_limit  = MEM_LIMIT;    /* Memory cap for child (MB)        */
 
@@ -127,6 +129,8 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
            crash_mode,                /* Crash mode! Yeah!                */
            in_place_resume,           /* Attempt in-place resume?         */
            auto_changed,              /* Auto-generated tokens changed?   */
+           no_unstable_mask,          /* Keep chasing unstable edges?     */
+           unstable_changed,          /* Unstable edge counters changed?  */
            no_cpu_meter_red,          /* Feng shui on the status screen   */
            no_arith,                  /* Skip most arithmetic ops         */
            shuffle_queue,             /* Shuffle input queue?             */
@@ -136,7 +140,24 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
            run_over10m,               /* Run time over 10 minutes?        */
            persistent_mode,           /* Running in persistent mode?      */
            deferred_mode,             /* Deferred forkserver mode?        */
-           fast_cal;                  /* Try to calibrate faster?         */
+           prefork_mode,              /* Forkserver forks ahead of time?  */
+           queue_compact,             /* Archive long-redundant entries?  */
+           fast_probes,               /* Turn off saturated probes?       */
+           crash_buckets,             /* Bucket crashes by stack hash?    */
+           dedup_execs,               /* Skip exact repeats of inputs?    */
+           adaptive_det,              /* Skip low-yield det stages?       */
+           weighted_extras,           /* Favor productive dictionary tokens? */
+           struct_fixups,             /* Patch length fields, checksums?  */
+           fast_cal,                  /* Try to calibrate faster?         */
+           weighted_queue,            /* Weighted random queue selection? */
+           entry_tmout,               /* Per-entry adaptive timeouts?     */
+           alias_dirty = 1;           /* Alias table needs a rebuild?     */
+
+static u8* tc_disk;                   /* Test case as last written        */
+static u32 tc_disk_len,               /* Its length, 0 if not tracked     */
+           tc_disk_size,              /* Allocated size of tc_disk        */
+           tc_last_len;               /* Length of the last full write    */
+static struct stat tc_disk_st;        /* File metadata after the write    */
 
 static s32 out_fd,                    /* Persistent fd for out_file       */
            dev_urandom_fd = -1,       /* Persistent fd for /dev/urandom   */
@@ -150,12 +171,27 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
+static u32* stack_hash;               /* Crash stack hash, right after it */
+
+static u32* probe_ctl;                /* Probe control area, after that   */
+
+static u32 probe_gen,                 /* Current probe mask generation    */
+           probes_off;                /* Map bytes with probes turned off */
+
+static u32 *bkt_hash,                 /* Stack hashes seen in crashes     */
+           *bkt_hits,                 /* Crashes seen for each hash       */
+           bkt_size,                  /* Size of the bucket hash table    */
+           bkt_count;                 /* Number of distinct stack hashes  */
+
 EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
            virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
            virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
 
 static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
 
+static u8  unstable_score[MAP_SIZE],  /* Hysteresis counters for var bytes */
+           unstable_mask[MAP_SIZE];   /* Bytes excluded from coverage     */
+
 static s32 shm_id;                    /* ID of the SHM region             */
 
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
@@ -163,6 +199,7 @@ static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    child_timed_out;   /* Traced process timed out?        */
 
 EXP_ST u32 queued_paths,              /* Total number of queued testcases */
+           queued_archived,           /* Testcases moved out of the queue */
            queued_variable,           /* Testcases with variable behavior */
            queued_at_start,           /* Total number of initial inputs   */
            queued_discovered,         /* Items discovered during this run */
@@ -176,6 +213,7 @@ EXP_ST u32 queued_paths,              /* Total number of queued testcases */
            max_depth,                 /* Max path depth                   */
            useless_at_start,          /* Number of useless starting paths */
            var_byte_count,            /* Bitmap bytes with var behavior   */
+           unstable_edges,            /* Bitmap bytes currently masked    */
            current_entry,             /* Current queue entry ID           */
            havoc_div = 1;             /* Cycle count divisor for havoc    */
 
@@ -220,7 +258,17 @@ static u8  stage_val_type;            /* Value type (STAGE_VAL_*)         */
 static u64 stage_finds[32],           /* Patterns found per fuzz stage    */
            stage_cycles[32];          /* Execs per fuzz stage             */
 
-static u32 rand_cnt;                  /* Random number counter            */
+static double det_finds[4][32],       /* Recent finds, by input size class */
+              det_execs[4][32];       /* Recent execs, by input size class */
+
+static u64 det_snap_finds[32],        /* stage_finds[] at fuzz_one() start */
+           det_snap_cycles[32],       /* stage_cycles[] at the same time  */
+           det_skipped;               /* Deterministic stages skipped     */
+
+static u32 rand_cnt,                  /* Random number counter            */
+           rand_state[4];             /* xoshiro128** generator state     */
+
+static u8  fixed_seed;                /* Reproducible run (-s)?           */
 
 static u64 total_cal_us,              /* Total calibration time (us)      */
            total_cal_cycles;          /* Total calibration cycles         */
@@ -238,6 +286,76 @@ static s32 cpu_aff = -1;       	      /* Selected CPU core                */
 
 static FILE* plot_file;               /* Gnuplot output file              */
 
+/* Grammar used by the grammar stage (-g): rules are made of alternatives,
+   which are sequences of literals and references to other rules. */
+
+struct g_elem {
+  u8* lit;                            /* Literal data, NULL for references*/
+  u32 len,                            /* Literal length                   */
+      rule;                           /* Referenced rule                  */
+};
+
+struct g_alt {
+  struct g_elem* el;                  /* Elements, in order               */
+  u32 cnt,                            /* Number of elements               */
+      depth;                          /* Shallowest derivation of children*/
+};
+
+struct g_rule {
+  u8* name;                           /* Rule name, without brackets      */
+  struct g_alt* alt;                  /* Alternatives                     */
+  u32 alt_cnt,                        /* Number of alternatives           */
+      min_depth;                      /* Shallowest derivation            */
+  u8  nullable;                       /* Can derive an empty string?      */
+};
+
+/* Derivation trees are stored in preorder, with one node per rule
+   expansion; literals are implied by the chosen alternative. */
+
+struct g_node {
+  u32 rule,                           /* Expanded rule                    */
+      alt;                            /* Chosen alternative               */
+};
+
+struct g_tree {
+  u32 cnt;                            /* Number of nodes                  */
+  struct g_node n[];                  /* Nodes, in preorder               */
+};
+
+/* Earley parser state. */
+
+struct g_item {
+  u32 rule, alt, dot, origin;
+};
+
+struct g_set {
+  struct g_item* it;                  /* Items in this set                */
+  u32 cnt, size;                      /* Item count, allocated slots      */
+};
+
+struct g_hent {
+  u32 pos, rule, alt, dot, origin,    /* Item and its Earley set          */
+      epoch;                          /* Parse that added it              */
+};
+
+/* Length field or checksum found by infer_structure() */
+
+enum {
+  /* 00 */ FIX_LEN,
+  /* 01 */ FIX_CRC32,
+  /* 02 */ FIX_ADLER32,
+  /* 03 */ FIX_SUM
+};
+
+struct fixup {
+  u32 pos,                            /* Offset of the field              */
+      rs, re,                         /* Region it describes or covers    */
+      size;                           /* Original region size (FIX_LEN)   */
+  u8  width,                          /* Field width (1, 2, or 4)         */
+      big_endian,                     /* Byte order                       */
+      type;                           /* FIX_*                            */
+};
+
 struct queue_entry {
 
   u8* fname;                          /* File name for the test case      */
@@ -250,18 +368,29 @@ struct queue_entry {
       has_new_cov,                    /* Triggers new coverage?           */
       var_behavior,                   /* Variable behavior?               */
       favored,                        /* Currently favored?               */
-      fs_redundant;                   /* Marked as redundant in the fs?   */
+      fs_redundant,                   /* Marked as redundant in the fs?   */
+      g_parsed,                       /* Grammar parse attempted?         */
+      fix_done,                       /* Structure inference done?        */
+      fix_cnt;                        /* Number of entries in fixups      */
 
-  u32 bitmap_size,                    /* Number of bits set in bitmap     */
-      exec_cksum;                     /* Checksum of the execution trace  */
+  u32 id,                             /* Queue entry ID (id:NNNNNN)       */
+      bitmap_size,                    /* Number of bits set in bitmap     */
+      exec_cksum,                     /* Checksum of the execution trace  */
+      fuzz_level,                     /* Number of fuzz_one() rounds      */
+      probe_gen;                      /* Probe mask in use for exec_cksum */
 
   u64 exec_us,                        /* Execution time (us)              */
       handicap,                       /* Number of queue cycles behind    */
-      depth;                          /* Path depth                       */
+      depth,                          /* Path depth                       */
+      redundant_since;                /* Queue cycle it became redundant  */
 
   u8* trace_mini;                     /* Trace bytes, if kept             */
   u32 tc_ref;                         /* Trace bytes ref count            */
 
+  struct g_tree* g_tree;              /* Derivation tree, if parsed       */
+
+  struct fixup* fixups;               /* Length fields and checksums      */
+
   struct queue_entry *next,           /* Next element, if any             */
                      *next_100;       /* 100 elements ahead               */
 
@@ -275,10 +404,30 @@ static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
 static struct queue_entry*
   top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
 
+static struct queue_entry**
+  queue_buf;                          /* Queue entries, indexed by ID     */
+
+static struct queue_entry**
+  splice_pool;                        /* Favored entries, for splicing    */
+
+static u32 splice_pool_cnt,           /* Entries in splice_pool           */
+           splice_pool_size;          /* Allocated size of splice_pool    */
+
+static u8
+  splice_mini[MAP_SIZE >> 3];         /* Trace of the entry, if no mini   */
+
+static u8  splice_mini_ok;            /* splice_mini[] filled in?         */
+
+static u32*    alias_table;           /* Alias table for weighted picks   */
+static double* alias_prob;            /* Acceptance probabilities         */
+static u32     alias_cnt;             /* Entries covered by the table     */
+
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
   u32 len;                            /* Dictionary token length          */
   u32 hit_cnt;                        /* Use count in the corpus          */
+  u32 use_cnt;                        /* Execs that used the token        */
+  u32 find_cnt;                       /* Finds among those execs          */
 };
 
 static struct extra_data* extras;     /* Extra tokens to fuzz with        */
@@ -287,8 +436,77 @@ static u32 extras_cnt;                /* Total number of tokens read      */
 static struct extra_data* a_extras;   /* Automatically selected extras    */
 static u32 a_extras_cnt;              /* Total number of tokens available */
 
+static u32 *extras_cum,               /* Cumulative weights of extras[]   */
+           *a_extras_cum;             /* Cumulative weights of a_extras[] */
+static u8  extras_dirty = 1;          /* Weights need recalculating?      */
+
+static struct extra_data*
+  ex_used[EXTRA_TRACK_MAX];           /* Tokens used in the current exec  */
+static u32 ex_used_cnt;               /* Number of entries in ex_used[]   */
+static u64 ex_hits_before;            /* Finds before the current exec    */
+
 static u8* (*post_handler)(u8* buf, u32* len);
 
+/* Postprocessor v2, see setup_post() */
+
+static u32 (*post_handler_v2)(u8* buf, u32 len);
+static u32 (*post_ranges)(u8* buf, u32 len, u32* ranges, u32 max_ranges);
+
+static u8* post_buf;                  /* Scratch copy for non-owned bufs  */
+static u8  post_in_place;             /* Caller rebuilds buf after exec?  */
+
+static u8* post_ref_buf;              /* Entry known to be post-processed */
+static u32 post_ref_len,              /* Length of that entry             */
+           post_range_cnt,            /* Number of declared ranges        */
+           post_range[POST_MAX_RANGES * 2];  /* Start / end offset pairs  */
+
+static u8* grammar_file;              /* Grammar for the grammar stage    */
+
+static struct g_rule* g_rules;        /* Grammar rules, start rule first  */
+static u32 g_rule_cnt;                /* Number of rules                  */
+
+static struct g_tree** g_trees;       /* All parsed trees, for splicing   */
+static u32 g_tree_cnt;                /* Number of parsed trees           */
+
+static struct g_node* g_work[2];      /* Scratch trees                    */
+static u32 g_build_cnt;               /* Nodes in g_work[0] during parse  */
+static u8* g_out_buf;                 /* Serialized grammar mutations     */
+
+static struct g_set*  g_sets;         /* Earley sets, one per position    */
+static struct g_hent* g_hash;         /* Item lookup table                */
+static u32 g_epoch,                   /* Current parse, for g_hash        */
+           g_item_cnt;                /* Items in the current parse       */
+static u8  g_overflow;                /* Item budget exceeded?            */
+
+static u64 post_calls,                /* Postprocessor invocations        */
+           post_bypassed;             /* Invocations skipped as redundant */
+
+static struct fixup
+  fix_cur[STRUCT_MAX_FIELDS];         /* Fields tracked in the havoc exec */
+static u32 fix_cur_cnt,               /* Number of entries in fix_cur[]   */
+           struct_fields;             /* Fields found in all entries      */
+static u64 fix_applied;               /* Havoc execs with patched fields  */
+
+static u8* dedup_bloom;               /* Bloom filter of executed inputs  */
+static u32 dedup_fill;                /* Bits set in dedup_bloom          */
+static u64 dedup_hits;                /* Execs skipped as exact repeats   */
+static u8  dedup_no_skip;             /* Stage needs trace_bits, run all  */
+
+/* Custom mutator library, see setup_custom_mutator() */
+
+static void* custom_data;             /* State returned by afl_custom_init */
+
+static u32 (*custom_fuzz)(void* data, u8* buf, u32 len, u8** out_bufs,
+                          u32* out_lens, u32 cnt, u32 max_len);
+static u32 (*custom_trim)(void* data, u8* buf, u32 len, u8* out_buf,
+                          u32 step);
+static void (*custom_queue_new_entry)(void* data, u8* fname, u8* buf,
+                                      u32 len);
+static void (*custom_deinit)(void* data);
+
+static u8* custom_bufs[CUSTOM_BATCH]; /* Output buffers, MAX_FILE each    */
+static u32 custom_lens[CUSTOM_BATCH]; /* Lengths of the produced outputs  */
+
 /* Interesting values, as per config.h */
 
 static s8  interesting_8[]  = { INTERESTING_8 };
@@ -314,7 +532,9 @@ enum {
   /* 13 */ STAGE_EXTRAS_UI,
   /* 14 */ STAGE_EXTRAS_AO,
   /* 15 */ STAGE_HAVOC,
-  /* 16 */ STAGE_SPLICE
+  /* 16 */ STAGE_SPLICE,
+  /* 17 */ STAGE_CUSTOM,
+  /* 18 */ STAGE_GRAMMAR
 };
 
 /* Stage value types */
@@ -336,6 +556,21 @@ enum {
   /* 05 */ FAULT_NOBITS
 };
 
+/* Power schedules (-p) */
+
+enum {
+  /* 00 */ SCHED_EXPLOIT,
+  /* 01 */ SCHED_EXPLORE,
+  /* 02 */ SCHED_FAST,
+  /* 03 */ SCHED_COE
+};
+
+static u8* schedule_names[] = { "exploit", "explore", "fast", "coe" };
+
+static u8  schedule = SCHED_EXPLOIT;  /* Power schedule in use            */
+
+static u32* n_fuzz;                   /* Exec count per path checksum     */
+
 
 /* Get unix time in milliseconds */
 
@@ -365,23 +600,85 @@ static u64 get_cur_time_us(void) {
 }
 
 
-/* Generate a random number (from 0 to limit - 1). This may
-   have slight bias. */
+/* Seed the generator, expanding the 64-bit value into the full state with
+   splitmix64, as recommended by the xoshiro authors. */
+
+static void seed_rng(u64 seed) {
+
+  u32 i;
+
+  for (i = 0; i < 2; i++) {
+
+    u64 z = (seed += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    rand_state[i * 2]     = z;
+    rand_state[i * 2 + 1] = z >> 32;
+
+  }
+
+}
+
+
+/* Next 32-bit output of xoshiro128**. */
+
+static inline u32 rand_next(void) {
+
+  u32 res = rand_state[1] * 5, t = rand_state[1] << 9;
+
+  res = ((res << 7) | (res >> 25)) * 9;
+
+  rand_state[2] ^= rand_state[0];
+  rand_state[3] ^= rand_state[1];
+  rand_state[1] ^= rand_state[2];
+  rand_state[0] ^= rand_state[3];
+
+  rand_state[2] ^= t;
+  rand_state[3]  = (rand_state[3] << 11) | (rand_state[3] >> 21);
+
+  return res;
+
+}
+
+
+/* Generate a random number (from 0 to limit - 1), without modulo bias; see
+   Lemire, "Fast Random Integer Generation in an Interval". Unless -s is
+   given, the state is periodically reseeded from /dev/urandom. */
 
 static inline u32 UR(u32 limit) {
 
-  if (unlikely(!rand_cnt--)) {
+  u64 m;
+  u32 l;
 
-    u32 seed[2];
+  if (unlikely(!rand_cnt--) && !fixed_seed) {
+
+    u64 seed;
 
     ck_read(dev_urandom_fd, &seed, sizeof(seed), "/dev/urandom");
 
-    srandom(seed[0]);
-    rand_cnt = (RESEED_RNG / 2) + (seed[1] % RESEED_RNG);
+    seed_rng(seed);
+    rand_cnt = (RESEED_RNG / 2) + (rand_next() % RESEED_RNG);
+
+  }
+
+  m = (u64)rand_next() * limit;
+  l = (u32)m;
+
+  if (unlikely(l < limit)) {
+
+    u32 t = -limit % limit;
+
+    while (l < t) {
+      m = (u64)rand_next() * limit;
+      l = (u32)m;
+    }
 
   }
 
-  return random() % limit;
+  return m >> 32;
 
 }
 
@@ -777,7 +1074,8 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
 
   if (state == q->fs_redundant) return;
 
-  q->fs_redundant = state;
+  q->fs_redundant    = state;
+  q->redundant_since = queue_cycle;
 
   fn = strrchr(q->fname, '/');
   fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
@@ -805,7 +1103,9 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
 
   struct queue_entry* q = ck_alloc(sizeof(struct queue_entry));
 
+  q->id           = queued_paths;
   q->fname        = fname;
+  q->probe_gen    = probe_gen;
   q->len          = len;
   q->depth        = cur_depth + 1;
   q->passed_det   = passed_det;
@@ -825,7 +1125,8 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
   cycles_wo_finds = 0;
 
   /* Set next_100 pointer for every 100th element (index 0, 100, etc) to allow faster iteration. */
-  if ((queued_paths - 1) % 100 == 0 && queued_paths > 1) {
+  if ((queued_paths - queued_archived - 1) % 100 == 0 &&
+      queued_paths - queued_archived > 1) {
 
     q_prev100->next_100 = q;
     q_prev100 = q;
@@ -848,6 +1149,8 @@ EXP_ST void destroy_queue(void) {
     n = q->next;
     ck_free(q->fname);
     ck_free(q->trace_mini);
+    ck_free(q->g_tree);
+    ck_free(q->fixups);
     ck_free(q);
     q = n;
 
@@ -974,6 +1277,30 @@ static inline u8 has_new_bits(u8* virgin_map) {
 }
 
 
+/* Check if the current trace has anything new for a virgin map, without
+   updating the map. With simplify set, the trace is looked at the way
+   simplify_trace() would leave it. Only used for the occasional timeout,
+   so it does not have to be fast. */
+
+static u8 peek_new_bits(u8* virgin_map, u8 simplify) {
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i++) {
+
+    u8 cur = trace_bits[i];
+
+    if (simplify) cur = cur ? 128 : 1;
+
+    if (cur & virgin_map[i]) return 1;
+
+  }
+
+  return 0;
+
+}
+
+
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
 
@@ -1272,7 +1599,7 @@ static void update_bitmap_score(struct queue_entry* q) {
 
   for (i = 0; i < MAP_SIZE; i++)
 
-    if (trace_bits[i]) {
+    if (trace_bits[i] && !unstable_mask[i]) {
 
        if (top_rated[i]) {
 
@@ -1322,6 +1649,7 @@ static void cull_queue(void) {
   if (dumb_mode || !score_changed) return;
 
   score_changed = 0;
+  alias_dirty   = 1;
 
   memset(temp_v, 255, MAP_SIZE >> 3);
 
@@ -1335,6 +1663,8 @@ static void cull_queue(void) {
     q = q->next;
   }
 
+  splice_pool_cnt = 0;
+
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
@@ -1354,6 +1684,17 @@ static void cull_queue(void) {
 
       if (!top_rated[i]->was_fuzzed) pending_favored++;
 
+      /* Between them, favored entries cover every edge seen so far, which
+         makes them the natural pool of splicing partners. */
+
+      if (splice_pool_cnt == splice_pool_size) {
+        splice_pool_size = splice_pool_size ? splice_pool_size * 2 : 64;
+        splice_pool = ck_realloc(splice_pool, splice_pool_size *
+                                 sizeof(struct queue_entry*));
+      }
+
+      splice_pool[splice_pool_cnt++] = top_rated[i];
+
     }
 
   q = queue;
@@ -1366,193 +1707,537 @@ static void cull_queue(void) {
 }
 
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+/* With AFL_FAST_PROBES, tell afl-llvm-rt.o which map bytes are saturated -
+   that is, have seen every hit count class, so that no input can produce
+   new coverage there - and let it turn off the trace-pc-guard probes that
+   feed them. Bytes masked as unstable are left alone: they need to keep
+   getting hit during calibration to be unmasked again. The mask is rebuilt
+   at the start of every queue cycle, which also turns the probes back on
+   for bytes that are no longer saturated.
 
-EXP_ST void setup_shm(void) {
+   Only virgin_bits is looked at, so crashes and hangs that differ from the
+   ones already seen only in the turned-off bytes are no longer told apart
+   by the virgin_crash / virgin_tmout checks. */
 
-  u8* shm_str;
+static void update_probe_mask(void) {
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  static u8 mask[MAP_SIZE >> 3];
+  u8* ctl_mask = (u8*)(probe_ctl + 1);
+  u32 i;
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  memset(mask, 0, sizeof(mask));
+  probes_off = 0;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  for (i = 0; i < MAP_SIZE; i++)
+    if (!virgin_bits[i] && !unstable_mask[i]) {
+      mask[i >> 3] |= 1 << (i & 7);
+      probes_off++;
+    }
 
-  if (shm_id < 0) PFATAL("shmget() failed");
+  if (!memcmp(mask, ctl_mask, sizeof(mask))) return;
 
-  atexit(remove_shm);
+  memcpy(ctl_mask, mask, sizeof(mask));
+  MEM_BARRIER();
 
-  shm_str = alloc_printf("%d", shm_id);
+  *probe_ctl = ++probe_gen;
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
+}
 
-  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
 
-  ck_free(shm_str);
+/* With AFL_QUEUE_COMPACT, move entries that have stayed redundant for a
+   while out of the queue, so that they no longer cost time or memory. Only
+   entries that do not hold any top_rated[] slots qualify; these slots only
+   ever pass on to newly calibrated entries, so cull_queue() will not need
+   the archived ones again. Their file names are appended to the on-disk
+   index in queue/.state/archived, and a resumed session picks the files up
+   like any other. Called between queue cycles, when queue_cur is NULL. */
 
-  trace_bits = shmat(shm_id, NULL, 0);
-  
-  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
+static void compact_queue(void) {
 
-}
+  struct queue_entry *q = queue, *prev = NULL, *n;
+  u32 cnt = 0, i = 0;
+  FILE* f = NULL;
 
+  while (q) {
 
-/* Load postprocessor, if available. */
+    n = q->next;
 
-static void setup_post(void) {
+    if (q->fs_redundant && q->was_fuzzed && !q->favored && !q->tc_ref &&
+        queue_cycle - q->redundant_since >= QUEUE_ARCHIVE_CYCLES &&
+        queued_paths - queued_archived - cnt > 1) {
 
-  void* dh;
-  u8* fn = getenv("AFL_POST_LIBRARY");
-  u32 tlen = 6;
+      if (!f) {
 
-  if (!fn) return;
+        u8* fn = alloc_printf("%s/queue/.state/archived", out_dir);
 
-  ACTF("Loading postprocessor from '%s'...", fn);
+        f = fopen(fn, "a");
+        if (!f) PFATAL("Unable to open '%s'", fn);
 
-  dh = dlopen(fn, RTLD_NOW);
-  if (!dh) FATAL("%s", dlerror());
+        ck_free(fn);
 
-  post_handler = dlsym(dh, "afl_postprocess");
-  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+      }
 
-  /* Do a quick test. It's better to segfault now than later =) */
+      fprintf(f, "%s\n", strrchr(q->fname, '/') + 1);
 
-  post_handler("hello", &tlen);
+      if (prev) prev->next = n; else queue = n;
+      if (q == queue_top) queue_top = prev;
 
-  OKF("Postprocessor installed successfully.");
+      /* The derivation tree, if any, stays in g_trees[] for splicing. */
 
-}
+      ck_free(q->fname);
+      ck_free(q->fixups);
+      ck_free(q);
+      cnt++;
 
+    } else prev = q;
 
-/* Read all testcases from the input directory, then queue them for testing.
-   Called at startup. */
+    q = n;
 
-static void read_testcases(void) {
+  }
 
-  struct dirent **nl;
-  s32 nl_cnt;
-  u32 i;
-  u8* fn;
+  if (!cnt) return;
 
-  /* Auto-detect non-in-place resumption attempts. */
+  fclose(f);
 
-  fn = alloc_printf("%s/queue", in_dir);
-  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+  queued_archived += cnt;
+  alias_dirty      = 1;
 
-  ACTF("Scanning '%s'...", in_dir);
+  /* Rebuild the next_100 markers. */
 
-  /* We use scandir() + alphasort() rather than readdir() because otherwise,
-     the ordering  of test cases would vary somewhat randomly and would be
-     difficult to control. */
+  q_prev100 = queue;
 
-  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  for (q = queue; q; q = q->next, i++) {
 
-  if (nl_cnt < 0) {
+    q->next_100 = NULL;
 
-    if (errno == ENOENT || errno == ENOTDIR)
+    if (i && !(i % 100)) {
+      q_prev100->next_100 = q;
+      q_prev100 = q;
+    }
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
-           "    one or more test case to start with - ideally, a small file under 1 kB\n"
-           "    or so. The cases must be stored as regular files directly in the input\n"
-           "    directory.\n");
+  }
 
-    PFATAL("Unable to open '%s'", in_dir);
+  if (not_on_tty)
+    ACTF("Archived %u redundant queue entries (%u so far).", cnt,
+         queued_archived);
 
-  }
+}
 
-  if (shuffle_queue && nl_cnt > 1) {
 
-    ACTF("Shuffling queue...");
-    shuffle_ptrs((void**)nl, nl_cnt);
+/* Calculate the selection weight of a queue entry for AFL_WEIGHTED_QUEUE.
+   This plays the role of the skip probabilities in fuzz_one(): favored,
+   fast, deep, and not-yet-fuzzed entries get picked more often. */
+
+static double queue_weight(struct queue_entry* q, u64 avg_exec_us) {
+
+  double weight = 1;
+
+  if (q->exec_us) {
+
+    weight = (double)avg_exec_us / q->exec_us;
+
+    if (weight < 0.1) weight = 0.1;
+    if (weight > 3) weight = 3;
 
   }
 
-  for (i = 0; i < nl_cnt; i++) {
+  if (q->favored) weight *= 20;
+  if (!q->was_fuzzed) weight *= 4;
+  if (q->has_new_cov && !q->was_fuzzed) weight *= 2;
 
-    struct stat st;
+  weight *= 1 + q->depth / 8.0;
+  weight /= 1 + q->fuzz_level;
 
-    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
-    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+  return weight;
 
-    u8  passed_det = 0;
+}
 
-    free(nl[i]); /* not tracked */
- 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
 
-    /* This also takes care of . and .. */
+/* Rebuild the alias table used for O(1) weighted queue selection, using
+   Vose's method. Called lazily, when the queue has grown, cull_queue()
+   has changed the favored set, or an entry has just been fuzzed. */
 
-    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt")) {
+static void create_alias_table(void) {
 
-      ck_free(fn);
-      ck_free(dfn);
-      continue;
+  u32 n = queued_paths - queued_archived, i = 0, n_small = 0, n_large = 0;
+  u64 avg_exec_us = total_cal_cycles ? total_cal_us / total_cal_cycles : 0;
+  u32 *small, *large;
+  double *p, sum = 0;
+  struct queue_entry* q = queue;
 
-    }
+  queue_buf   = ck_realloc(queue_buf, n * sizeof(struct queue_entry*));
+  alias_table = ck_realloc(alias_table, n * sizeof(u32));
+  alias_prob  = ck_realloc(alias_prob, n * sizeof(double));
 
-    if (st.st_size > MAX_FILE) 
-      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_FILE));
+  p     = ck_alloc_nozero(n * sizeof(double));
+  small = ck_alloc_nozero(n * sizeof(u32));
+  large = ck_alloc_nozero(n * sizeof(u32));
 
-    /* Check for metadata that indicates that deterministic fuzzing
-       is complete for this entry. We don't want to repeat deterministic
-       fuzzing when resuming aborted scans, because it would be pointless
-       and probably very time-consuming. */
+  while (q) {
 
-    if (!access(dfn, F_OK)) passed_det = 1;
-    ck_free(dfn);
+    queue_buf[i] = q;
+    p[i] = queue_weight(q, avg_exec_us);
+    sum += p[i];
 
-    add_to_queue(fn, st.st_size, passed_det);
+    q = q->next;
+    i++;
 
   }
 
-  free(nl); /* not tracked */
+  /* Scale so that the average probability is 1, then pair up every
+     underfull bucket with an overfull one. */
 
-  if (!queued_paths) {
+  for (i = 0; i < n; i++) {
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
-         "    needs one or more test case to start with - ideally, a small file under\n"
-         "    1 kB or so. The cases must be stored as regular files directly in the\n"
-         "    input directory.\n");
+    p[i] = p[i] * n / sum;
 
-    FATAL("No usable test cases in '%s'", in_dir);
+    if (p[i] < 1) small[n_small++] = i; else large[n_large++] = i;
 
   }
 
-  last_path_time = 0;
-  queued_at_start = queued_paths;
+  while (n_small && n_large) {
 
-}
+    u32 s = small[--n_small], l = large[--n_large];
 
+    alias_prob[s]  = p[s];
+    alias_table[s] = l;
 
-/* Helper function for load_extras. */
+    p[l] = p[l] + p[s] - 1;
 
-static int compare_extras_len(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+    if (p[l] < 1) small[n_small++] = l; else large[n_large++] = l;
 
-  return e1->len - e2->len;
-}
+  }
 
-static int compare_extras_use_d(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+  /* Whatever is left over is 1 up to rounding errors. */
+
+  while (n_large) alias_prob[large[--n_large]] = 1;
+  while (n_small) alias_prob[small[--n_small]] = 1;
+
+  ck_free(p);
+  ck_free(small);
+  ck_free(large);
+
+  alias_cnt   = n;
+  alias_dirty = 0;
 
-  return e2->hit_cnt - e1->hit_cnt;
 }
 
 
-/* Read extras from a file, sort by size. */
+/* Pick the next queue entry to fuzz from the alias table, returning its ID. */
 
-static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
-                             u32 dict_level) {
+static u32 select_next_queue_entry(void) {
+
+  u32 i;
+
+  if (alias_dirty || alias_cnt != queued_paths - queued_archived)
+    create_alias_table();
+
+  i = UR(alias_cnt);
+
+  if ((double)UR(1 << 24) / (1 << 24) < alias_prob[i]) return i;
+
+  return alias_table[i];
+
+}
+
+
+/* Configure shared memory and virgin_bits. This is called at startup. */
+
+EXP_ST void setup_shm(void) {
+
+  u8* shm_str;
+
+  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+
+  memset(virgin_tmout, 255, MAP_SIZE);
+  memset(virgin_crash, 255, MAP_SIZE);
+
+  /* The region has room for a stack hash (see AFL_CRASH_BUCKETS) and the
+     probe control area (AFL_FAST_PROBES) at the end. Plain afl-llvm-rt.o
+     does not touch either unless asked to. */
+
+  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + sizeof(u32) + PROBE_CTL_SIZE,
+                  IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id < 0) PFATAL("shmget() failed");
+
+  atexit(remove_shm);
+
+  shm_str = alloc_printf("%d", shm_id);
+
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
+
+  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  trace_bits = shmat(shm_id, NULL, 0);
+  
+  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
+
+  stack_hash = (u32*)(trace_bits + MAP_SIZE);
+  probe_ctl  = stack_hash + 1;
+
+}
+
+
+/* Load postprocessor, if available. */
+
+static void setup_post(void) {
+
+  void* dh;
+  u8* fn = getenv("AFL_POST_LIBRARY");
+  u32 tlen = 6;
+
+  if (!fn) return;
+
+  ACTF("Loading postprocessor from '%s'...", fn);
+
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh) FATAL("%s", dlerror());
+
+  /* The v2 interface patches the buffer in place instead of returning a new
+     one; afl-fuzz makes a scratch copy only when the buffer can't be touched:
+
+       u32 afl_postprocess_v2(u8* buf, u32 len);
+
+     ...returns 0 to skip the test case. Optionally, the library may also
+     declare which byte ranges of an already post-processed input it cares
+     about, returning the number of start / end pairs written:
+
+       u32 afl_postprocess_ranges(u8* buf, u32 len, u32* ranges, u32 max);
+
+     Mutations that leave these ranges alone then skip the postprocessor
+     altogether. */
+
+  post_handler_v2 = dlsym(dh, "afl_postprocess_v2");
+
+  if (post_handler_v2) {
+
+    u8 tbuf[6];
+
+    post_ranges = dlsym(dh, "afl_postprocess_ranges");
+    post_buf    = ck_alloc_nozero(MAX_FILE);
+
+    memcpy(tbuf, "hello", tlen);
+    post_handler_v2(tbuf, tlen);
+
+    OKF("Postprocessor (v2%s) installed successfully.",
+        post_ranges ? ", with ranges" : "");
+
+    return;
+
+  }
+
+  post_handler = dlsym(dh, "afl_postprocess");
+  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+
+  /* Do a quick test. It's better to segfault now than later =) */
+
+  post_handler("hello", &tlen);
+
+  OKF("Postprocessor installed successfully.");
+
+}
+
+
+/* Load custom mutator, if available. The library must export:
+
+     u32 afl_custom_fuzz(void* data, u8* buf, u32 len, u8** out_bufs,
+                         u32* out_lens, u32 cnt, u32 max_len);
+
+   ...which derives up to cnt new test cases from buf, writing each one to
+   out_bufs[i] (max_len bytes available) and its length to out_lens[i], and
+   returns the number of outputs produced. The following are optional:
+
+     void* afl_custom_init(u32 seed);
+     u32   afl_custom_trim(void* data, u8* buf, u32 len, u8* out_buf, u32 step);
+     void  afl_custom_queue_new_entry(void* data, u8* fname, u8* buf, u32 len);
+     void  afl_custom_deinit(void* data);
+
+   afl_custom_init() returns the state handed over to all other calls.
+   afl_custom_trim() is called with step = 0, 1, 2... and should write a
+   smaller variant of buf to out_buf, returning its length, or 0 when it has
+   nothing more to offer; it replaces the built-in trimmer. The callback
+   sees every test case added to the queue after startup. */
+
+static void setup_custom_mutator(void) {
+
+  void* dh;
+  void* (*custom_init)(u32 seed);
+  u8* fn = getenv("AFL_CUSTOM_MUTATOR_LIBRARY");
+  u32 i;
+
+  if (!fn) return;
+
+  ACTF("Loading custom mutator from '%s'...", fn);
+
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh) FATAL("%s", dlerror());
+
+  custom_fuzz = dlsym(dh, "afl_custom_fuzz");
+  if (!custom_fuzz) FATAL("Symbol 'afl_custom_fuzz' not found.");
+
+  custom_init            = dlsym(dh, "afl_custom_init");
+  custom_trim            = dlsym(dh, "afl_custom_trim");
+  custom_queue_new_entry = dlsym(dh, "afl_custom_queue_new_entry");
+  custom_deinit          = dlsym(dh, "afl_custom_deinit");
+
+  if (custom_init) custom_data = custom_init(UR(0xffffffff));
+
+  for (i = 0; i < CUSTOM_BATCH; i++)
+    custom_bufs[i] = ck_alloc_nozero(MAX_FILE);
+
+  OKF("Custom mutator installed successfully%s.",
+      custom_trim ? " (with trimming)" : "");
+
+}
+
+
+/* Release the custom mutator. */
+
+static void destroy_custom_mutator(void) {
+
+  u32 i;
+
+  if (!custom_fuzz) return;
+
+  if (custom_deinit) custom_deinit(custom_data);
+
+  for (i = 0; i < CUSTOM_BATCH; i++)
+    ck_free(custom_bufs[i]);
+
+}
+
+
+/* Read all testcases from the input directory, then queue them for testing.
+   Called at startup. */
+
+static void read_testcases(void) {
+
+  struct dirent **nl;
+  s32 nl_cnt;
+  u32 i;
+  u8* fn;
+
+  /* Auto-detect non-in-place resumption attempts. */
+
+  fn = alloc_printf("%s/queue", in_dir);
+  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+
+  ACTF("Scanning '%s'...", in_dir);
+
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering  of test cases would vary somewhat randomly and would be
+     difficult to control. */
+
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+
+  if (nl_cnt < 0) {
+
+    if (errno == ENOENT || errno == ENOTDIR)
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
+           "    one or more test case to start with - ideally, a small file under 1 kB\n"
+           "    or so. The cases must be stored as regular files directly in the input\n"
+           "    directory.\n");
+
+    PFATAL("Unable to open '%s'", in_dir);
+
+  }
+
+  if (shuffle_queue && nl_cnt > 1) {
+
+    ACTF("Shuffling queue...");
+    shuffle_ptrs((void**)nl, nl_cnt);
+
+  }
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    struct stat st;
+
+    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+
+    u8  passed_det = 0;
+
+    free(nl[i]); /* not tracked */
+ 
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
+
+    /* This also takes care of . and .. */
+
+    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt")) {
+
+      ck_free(fn);
+      ck_free(dfn);
+      continue;
+
+    }
+
+    if (st.st_size > MAX_FILE) 
+      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_FILE));
+
+    /* Check for metadata that indicates that deterministic fuzzing
+       is complete for this entry. We don't want to repeat deterministic
+       fuzzing when resuming aborted scans, because it would be pointless
+       and probably very time-consuming. */
+
+    if (!access(dfn, F_OK)) passed_det = 1;
+    ck_free(dfn);
+
+    add_to_queue(fn, st.st_size, passed_det);
+
+  }
+
+  free(nl); /* not tracked */
+
+  if (!queued_paths) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
+         "    needs one or more test case to start with - ideally, a small file under\n"
+         "    1 kB or so. The cases must be stored as regular files directly in the\n"
+         "    input directory.\n");
+
+    FATAL("No usable test cases in '%s'", in_dir);
+
+  }
+
+  last_path_time = 0;
+  queued_at_start = queued_paths;
+
+}
+
+
+/* Helper function for load_extras. */
+
+static int compare_extras_len(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
+
+  return e1->len - e2->len;
+}
+
+static int compare_extras_use_d(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
+
+  return e2->hit_cnt - e1->hit_cnt;
+}
+
+
+/* Read extras from a file, sort by size. */
+
+static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
+                             u32 dict_level) {
 
   FILE* f;
   u8  buf[MAX_LINE];
@@ -1872,6 +2557,8 @@ static void maybe_add_auto(u8* mem, u32 len) {
     a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
                                 sizeof(struct extra_data));
 
+    memset(a_extras + a_extras_cnt, 0, sizeof(struct extra_data));
+
     a_extras[a_extras_cnt].data = ck_memdup(mem, len);
     a_extras[a_extras_cnt].len  = len;
     a_extras_cnt++;
@@ -1883,14 +2570,18 @@ static void maybe_add_auto(u8* mem, u32 len) {
 
     ck_free(a_extras[i].data);
 
-    a_extras[i].data    = ck_memdup(mem, len);
-    a_extras[i].len     = len;
-    a_extras[i].hit_cnt = 0;
+    a_extras[i].data     = ck_memdup(mem, len);
+    a_extras[i].len      = len;
+    a_extras[i].hit_cnt  = 0;
+    a_extras[i].use_cnt  = 0;
+    a_extras[i].find_cnt = 0;
 
   }
 
 sort_a_extras:
 
+  extras_dirty = 1;
+
   /* First, sort all auto extras by use count, descending order. */
 
   qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
@@ -1991,2707 +2682,4825 @@ static void destroy_extras(void) {
 
   ck_free(a_extras);
 
+  ck_free(extras_cum);
+  ck_free(a_extras_cum);
+
 }
 
 
-/* Spin up fork server (instrumented mode only). The idea is explained here:
+/* Sampling weight of a dictionary token with AFL_WEIGHTED_EXTRAS. Tokens
+   that have not been tried much yet get EXTRA_WEIGHT_NEW, every find adds as
+   much again (up to EXTRA_WEIGHT_MAX), and tokens that went EXTRA_DEAD_USES
+   execs without a find drop to EXTRA_WEIGHT_DEAD. */
 
-   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
+static u32 extra_weight(struct extra_data* e) {
 
-   In essence, the instrumentation allows us to skip execve(), and just keep
-   cloning a stopped child. So, we just execute once, and then send commands
-   through a pipe. The other part of this logic is in afl-as.h. */
+  if (!e->find_cnt)
+    return e->use_cnt >= EXTRA_DEAD_USES ? EXTRA_WEIGHT_DEAD : EXTRA_WEIGHT_NEW;
 
-EXP_ST void init_forkserver(char** argv) {
+  return MIN(EXTRA_WEIGHT_NEW * (1 + e->find_cnt), EXTRA_WEIGHT_MAX);
 
-  static struct itimerval it;
-  int st_pipe[2], ctl_pipe[2];
-  int status;
-  s32 rlen;
+}
 
-  ACTF("Spinning up the fork server...");
 
-  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+/* Pick a user (is_auto = 0) or auto-detected (is_auto = 1) token for havoc. The
+   weighted pick is a binary search over cumulative weights, which are only
+   recalculated when a weight changes. */
 
-  forksrv_pid = fork();
+static u32 pick_extra(u8 is_auto) {
 
-  if (forksrv_pid < 0) PFATAL("fork() failed");
+  u32 cnt = is_auto ? a_extras_cnt : extras_cnt;
+  u32 *cum, lo = 0, hi = cnt - 1, r, i;
 
-  if (!forksrv_pid) {
+  if (!weighted_extras) return UR(cnt);
 
-    struct rlimit r;
+  if (extras_dirty) {
 
-    /* Umpf. On OpenBSD, the default fd limit for root users is set to
-       soft 128. Let's try to fix that... */
+    u32 sum = 0;
 
-    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+    extras_cum = ck_realloc(extras_cum, (extras_cnt + 1) * sizeof(u32));
 
-      r.rlim_cur = FORKSRV_FD + 2;
-      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+    for (i = 0; i < extras_cnt; i++)
+      extras_cum[i] = sum += extra_weight(&extras[i]);
 
-    }
+    sum = 0;
 
-    if (mem_limit) {
+    a_extras_cum = ck_realloc(a_extras_cum, (a_extras_cnt + 1) * sizeof(u32));
 
-      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+    for (i = 0; i < a_extras_cnt; i++)
+      a_extras_cum[i] = sum += extra_weight(&a_extras[i]);
 
-#ifdef RLIMIT_AS
+    extras_dirty = 0;
 
-      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+  }
 
-#else
+  cum = is_auto ? a_extras_cum : extras_cum;
+  r   = UR(cum[cnt - 1]);
 
-      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
-         according to reliable sources, RLIMIT_DATA covers anonymous
-         maps - so we should be getting good protection against OOM bugs. */
+  while (lo < hi) {
 
-      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+    u32 mid = (lo + hi) / 2;
 
-#endif /* ^RLIMIT_AS */
+    if (cum[mid] > r) hi = mid; else lo = mid + 1;
 
+  }
 
-    }
+  return lo;
 
-    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
-       before the dump is complete. */
+}
 
-    r.rlim_max = r.rlim_cur = 0;
 
-    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+/* Note that a token is about to be used in the next exec. The first one
+   also records the find count, so that credit_extras() can tell whether
+   the exec found something. */
 
-    /* Isolate the process and configure standard descriptors. If out_file is
-       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+static void track_extra(struct extra_data* e) {
 
-    setsid();
+  if (!ex_used_cnt) ex_hits_before = queued_paths + unique_crashes;
 
-    dup2(dev_null_fd, 1);
-    dup2(dev_null_fd, 2);
+  if (++e->use_cnt == EXTRA_DEAD_USES && !e->find_cnt) extras_dirty = 1;
 
-    if (out_file) {
+  if (ex_used_cnt < EXTRA_TRACK_MAX) ex_used[ex_used_cnt++] = e;
 
-      dup2(dev_null_fd, 0);
+}
 
-    } else {
 
-      dup2(out_fd, 0);
-      close(out_fd);
+/* Credit the tokens used in the last exec with a find, if there was one. */
 
-    }
+static void credit_extras(void) {
 
-    /* Set up control and status pipes, close the unneeded original fds. */
+  u32 i;
 
-    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
-    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+  if (!ex_used_cnt) return;
 
-    close(ctl_pipe[0]);
-    close(ctl_pipe[1]);
-    close(st_pipe[0]);
-    close(st_pipe[1]);
+  if (queued_paths + unique_crashes != ex_hits_before) {
 
-    close(out_dir_fd);
-    close(dev_null_fd);
-    close(dev_urandom_fd);
-    close(fileno(plot_file));
+    for (i = 0; i < ex_used_cnt; i++)
+      ex_used[i]->find_cnt++;
 
-    /* This should improve performance a bit, since it stops the linker from
-       doing extra work post-fork(). */
+    extras_dirty = 1;
 
-    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+  }
 
-    /* Set sane defaults for ASAN if nothing else specified. */
+  ex_used_cnt = 0;
 
-    setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                           "detect_leaks=0:"
-                           "symbolize=0:"
-                           "allocator_may_return_null=1", 0);
+}
 
-    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
-       point. So, we do this in a very hacky way. */
 
-    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                           "symbolize=0:"
-                           "abort_on_error=1:"
-                           "allocator_may_return_null=1:"
-                           "msan_track_origins=0", 0);
+/* Write one token, escaped the way the dictionary parser expects. */
 
-    execv(target_path, argv);
+static void write_extra_token(FILE* f, struct extra_data* e) {
 
-    /* Use a distinctive bitmap signature to tell the parent about execv()
-       falling through. */
+  u32 i;
 
-    *(u32*)trace_bits = EXEC_FAIL_SIG;
-    exit(0);
+  fputc('"', f);
 
-  }
+  for (i = 0; i < e->len; i++) {
 
-  /* Close the unneeded endpoints. */
+    u8 c = e->data[i];
 
-  close(ctl_pipe[0]);
-  close(st_pipe[1]);
+    if (c < 32 || c > 126 || c == '"' || c == '\\') fprintf(f, "\\x%02x", c);
+    else fputc(c, f);
 
-  fsrv_ctl_fd = ctl_pipe[1];
-  fsrv_st_fd  = st_pipe[0];
+  }
 
-  /* Wait for the fork server to come up, but don't wait too long. */
+  fputs("\"\n", f);
 
-  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+}
 
-  setitimer(ITIMER_REAL, &it, NULL);
 
-  rlen = read(fsrv_st_fd, &status, 4);
+/* Dump per-token use and find counts to <out_dir>/token_yield at exit. The
+   file is a valid dictionary (-x), with the numbers in comments, so pruning
+   a dictionary is a matter of deleting lines. */
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+static void save_extras_yield(void) {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  u8* fn;
+  FILE* f;
+  s32 fd;
+  u32 i;
 
-  /* If we have a four-byte "hello" message from the server, we're all set.
-     Otherwise, try to figure out what went wrong. */
+  if (!extras_cnt && !a_extras_cnt) return;
 
-  if (rlen == 4) {
-    OKF("All right - fork server is up.");
-    return;
-  }
+  fn = alloc_printf("%s/token_yield", out_dir);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-  if (child_timed_out)
-    FATAL("Timeout while initializing fork server (adjusting -t may help)");
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
 
-  if (waitpid(forksrv_pid, &status, 0) <= 0)
-    PFATAL("waitpid() failed");
+  f = fdopen(fd, "w");
 
-  if (WIFSIGNALED(status)) {
+  if (!f) PFATAL("fdopen() failed");
 
-    if (mem_limit && mem_limit < 500 && uses_asan) {
+  fprintf(f, "# Token yield for this session: finds / execs that used the token.\n"
+             "# Tokens marked 'dead' went %u execs without a find.\n", EXTRA_DEAD_USES);
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
-           "    restrictive memory limit configured, this is expected; please read\n"
-           "    %s/notes_for_asan.txt for help.\n", doc_path);
+  for (i = 0; i < extras_cnt + a_extras_cnt; i++) {
 
-    } else if (!mem_limit) {
+    u8 is_auto = i >= extras_cnt;
+    struct extra_data* e = is_auto ? &a_extras[i - extras_cnt] : &extras[i];
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+    fprintf(f, "\n# %s token %u: %u / %u%s\n%s_%06u=", is_auto ? "auto" : "user",
+            is_auto ? i - extras_cnt : i, e->find_cnt, e->use_cnt,
+            (!e->find_cnt && e->use_cnt >= EXTRA_DEAD_USES) ? " (dead)" : "",
+            is_auto ? "auto" : "user", is_auto ? i - extras_cnt : i);
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+    write_extra_token(f, e);
 
-#ifdef __APPLE__
+  }
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  fclose(f);
+  ck_free(fn);
 
-#endif /* __APPLE__ */
+}
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-    } else {
+/* Marker for rules not known to have a finite derivation (yet). */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+#define GRAMMAR_NO_DEPTH 0xffffffff
 
-           "    - The current memory limit (%s) is too restrictive, causing the\n"
-           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
-           "      the limit with the -m setting in the command line. A simple way confirm\n"
-           "      this diagnosis would be:\n\n"
 
-#ifdef RLIMIT_AS
-           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+/* Look up a grammar rule by name, creating an empty one if not seen yet. */
 
-           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-           "      estimate the required amount of virtual memory for the binary.\n\n"
+static u32 g_rule_id(u8* name, u32 len) {
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+  u32 i;
 
-#ifdef __APPLE__
+  for (i = 0; i < g_rule_cnt; i++)
+    if (strlen(g_rules[i].name) == len && !memcmp(g_rules[i].name, name, len))
+      return i;
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  g_rules = ck_realloc(g_rules, (g_rule_cnt + 1) * sizeof(struct g_rule));
 
-#endif /* __APPLE__ */
+  g_rules[g_rule_cnt].name = ck_alloc(len + 1);
+  memcpy(g_rules[g_rule_cnt].name, name, len);
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-           DMS(mem_limit << 20), mem_limit - 1);
+  return g_rule_cnt++;
 
-    }
+}
 
-    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
 
-  }
+/* Append an element to the last alternative of a rule. Literals are always
+   allocated, even when empty, so that a NULL lit denotes a rule reference. */
 
-  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
-    FATAL("Unable to execute target application ('%s')", argv[0]);
+static void g_add_elem(u32 rule, u8* lit, u32 len, u32 ref) {
 
-  if (mem_limit && mem_limit < 500 && uses_asan) {
+  struct g_alt* a = &g_rules[rule].alt[g_rules[rule].alt_cnt - 1];
 
-    SAYF("\n" cLRD "[-] " cRST
-           "Hmm, looks like the target binary terminated before we could complete a\n"
-           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
-           "    you have a restrictive memory limit configured, this is expected; please\n"
-           "    read %s/notes_for_asan.txt for help.\n", doc_path);
+  a->el = ck_realloc(a->el, (a->cnt + 1) * sizeof(struct g_elem));
 
-  } else if (!mem_limit) {
+  if (lit) {
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
-         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+    a->el[a->cnt].lit = ck_alloc(len + 1);
+    memcpy(a->el[a->cnt].lit, lit, len);
+    a->el[a->cnt].len = len;
 
-  } else {
+  } else a->el[a->cnt].rule = ref;
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. There are %s probable explanations:\n\n"
+  a->cnt++;
 
-         "%s"
-         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
-         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
-         "      simple way to confirm the diagnosis may be:\n\n"
+}
 
-#ifdef RLIMIT_AS
-         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
 
-         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-         "      estimate the required amount of virtual memory for the binary.\n\n"
+/* Start a new, empty alternative for a rule. */
 
-         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-         getenv(DEFER_ENV_VAR) ? "three" : "two",
-         getenv(DEFER_ENV_VAR) ?
-         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
-         "      reached before the program terminates.\n\n" : "",
-         DMS(mem_limit << 20), mem_limit - 1);
+static void g_add_alt(u32 rule) {
 
-  }
+  struct g_rule* r = &g_rules[rule];
 
-  FATAL("Fork server handshake failed");
+  r->alt = ck_realloc(r->alt, (r->alt_cnt + 1) * sizeof(struct g_alt));
+  r->alt_cnt++;
 
 }
 
 
-/* Execute target application, monitoring for timeouts. Return status
-   information. The called program will update trace_bits[]. */
+/* Load the grammar given with -g. The format is a simple take on BNF:
 
-static u8 run_target(char** argv, u32 timeout) {
+     # Comments run until the end of the line.
+     <expr> ::= <term> "+" <expr> | <term>
+     <term> ::= "x" | "(" <expr> ")"
 
-  static struct itimerval it;
-  static u32 prev_timed_out = 0;
-  static u64 exec_ms = 0;
+   The first rule defined is the start symbol. Definitions may span multiple
+   lines, literals support \\, \", \n, \r, \t, and \xNN escapes, and "" can
+   be used for empty alternatives. */
 
-  int status = 0;
-  u32 tb4;
+static void load_grammar(u8* fname) {
 
-  child_timed_out = 0;
+  struct stat st;
+  char* hexdigits = "0123456789abcdef";
+  s32 fd, cur = -1;
+  u8  *data, *p, *end, *lit;
+  u32 line = 1, i, j, k, changed;
 
-  /* After this memset, trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
+  ACTF("Loading grammar from '%s'...", fname);
 
-  memset(trace_bits, 0, MAP_SIZE);
-  MEM_BARRIER();
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  /* If we're running in "dumb" mode, we can't rely on the fork server
-     logic compiled into the target program, so we will just keep calling
-     execve(). There is a bit of code duplication between here and 
-     init_forkserver(), but c'est la vie. */
+  if (fstat(fd, &st) || !st.st_size) FATAL("Empty or unreadable grammar");
 
-  if (dumb_mode == 1 || no_forkserver) {
+  data = ck_alloc_nozero(st.st_size);
+  ck_read(fd, data, st.st_size, fname);
+  close(fd);
 
-    child_pid = fork();
+  lit = ck_alloc_nozero(st.st_size);
 
-    if (child_pid < 0) PFATAL("fork() failed");
+  p   = data;
+  end = data + st.st_size;
 
-    if (!child_pid) {
+  while (1) {
 
-      struct rlimit r;
+    /* Skip whitespace and comments. */
 
-      if (mem_limit) {
+    while (p < end && (isspace(*p) || *p == '#')) {
 
-        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+      if (*p == '#') while (p < end && *p != '\n') p++;
+      else if (*p++ == '\n') line++;
 
-#ifdef RLIMIT_AS
+    }
 
-        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+    if (p >= end) break;
 
-#else
+    if (*p == '<') {
 
-        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+      u8 *name = ++p, *q = p;
 
-#endif /* ^RLIMIT_AS */
+      while (q < end && *q != '>' && *q != '\n') q++;
 
-      }
+      if (q >= end || *q != '>' || q == name)
+        FATAL("Malformed rule name in line %u of the grammar", line);
 
-      r.rlim_max = r.rlim_cur = 0;
+      p = q + 1;
 
-      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+      /* A rule name followed by ::= begins a new definition. */
 
-      /* Isolate the process and configure standard descriptors. If out_file is
-         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+      q = p;
+      while (q < end && (*q == ' ' || *q == '\t')) q++;
 
-      setsid();
+      if (end - q >= 3 && !memcmp(q, "::=", 3)) {
 
-      dup2(dev_null_fd, 1);
-      dup2(dev_null_fd, 2);
+        cur = g_rule_id(name, p - 1 - name);
+        g_add_alt(cur);
+        p = q + 3;
+        continue;
 
-      if (out_file) {
+      }
 
-        dup2(dev_null_fd, 0);
+      if (cur < 0) FATAL("Syntax error in line %u of the grammar", line);
 
-      } else {
+      i = g_rule_id(name, p - 1 - name);
+      g_add_elem(cur, NULL, 0, i);
 
-        dup2(out_fd, 0);
-        close(out_fd);
-
-      }
-
-      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+    } else if (*p == '"') {
 
-      close(dev_null_fd);
-      close(out_dir_fd);
-      close(dev_urandom_fd);
-      close(fileno(plot_file));
+      u32 len = 0;
 
-      /* Set sane defaults for ASAN if nothing else specified. */
+      if (cur < 0) FATAL("Syntax error in line %u of the grammar", line);
 
-      setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                             "detect_leaks=0:"
-                             "symbolize=0:"
-                             "allocator_may_return_null=1", 0);
+      p++;
 
-      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                             "symbolize=0:"
-                             "msan_track_origins=0", 0);
+      while (p < end && *p != '"' && *p != '\n') {
 
-      execv(target_path, argv);
+        if (*p == '\\' && p + 1 < end) {
 
-      /* Use a distinctive bitmap value to tell the parent about execv()
-         falling through. */
+          p++;
 
-      *(u32*)trace_bits = EXEC_FAIL_SIG;
-      exit(0);
+          switch (*p) {
 
-    }
+            case 'n':  lit[len++] = '\n'; break;
+            case 'r':  lit[len++] = '\r'; break;
+            case 't':  lit[len++] = '\t'; break;
+            case '\\': lit[len++] = '\\'; break;
+            case '"':  lit[len++] = '"';  break;
 
-  } else {
+            case 'x':
 
-    s32 res;
+              if (end - p < 3 || !isxdigit(p[1]) || !isxdigit(p[2]))
+                FATAL("Bad \\x escape in line %u of the grammar", line);
 
-    /* In non-dumb mode, we have the fork server up and running, so simply
-       tell it to have at it, and then read back PID. */
+              lit[len++] =
+                ((strchr(hexdigits, tolower(p[1])) - hexdigits) << 4) |
+                (strchr(hexdigits, tolower(p[2])) - hexdigits);
+              p += 2;
+              break;
 
-    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
+            default:
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+              FATAL("Unknown escape in line %u of the grammar", line);
 
-    }
+          }
 
-    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
+          p++;
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+        } else lit[len++] = *p++;
 
-    }
+      }
 
-    if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+      if (p >= end || *p != '"')
+        FATAL("Unterminated literal in line %u of the grammar", line);
 
-  }
+      p++;
 
-  /* Configure timeout, as requested by user, then wait for child to terminate. */
+      g_add_elem(cur, lit, len, 0);
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+    } else if (*p == '|') {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+      if (cur < 0) FATAL("Syntax error in line %u of the grammar", line);
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+      g_add_alt(cur);
+      p++;
 
-  if (dumb_mode == 1 || no_forkserver) {
+    } else FATAL("Syntax error in line %u of the grammar", line);
 
-    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+  }
 
-  } else {
+  ck_free(lit);
+  ck_free(data);
 
-    s32 res;
+  if (!g_rule_cnt) FATAL("No rules found in the grammar");
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+  for (i = 0; i < g_rule_cnt; i++) {
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+    if (!g_rules[i].alt_cnt)
+      FATAL("Rule <%s> is used, but never defined", g_rules[i].name);
 
-    }
+    g_rules[i].min_depth = GRAMMAR_NO_DEPTH;
 
   }
 
-  if (!WIFSTOPPED(status)) child_pid = 0;
+  /* Find out which rules can produce an empty string, and how deep the
+     shallowest derivation of every rule is. The latter is what keeps random
+     generation from going on forever. */
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms = (u64) timeout - (it.it_value.tv_sec * 1000 +
-                             it.it_value.tv_usec / 1000);
+  do {
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+    changed = 0;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    for (i = 0; i < g_rule_cnt; i++)
+      for (j = 0; j < g_rules[i].alt_cnt; j++) {
 
-  total_execs++;
+        struct g_alt* a = &g_rules[i].alt[j];
+        u32 depth = 0;
+        u8  nullable = 1;
 
-  /* Any subsequent operations on trace_bits must not be moved by the
-     compiler below this point. Past this location, trace_bits[] behave
-     very normally and do not have to be treated as volatile. */
+        for (k = 0; k < a->cnt; k++) {
 
-  MEM_BARRIER();
+          if (a->el[k].lit) {
 
-  tb4 = *(u32*)trace_bits;
+            if (a->el[k].len) nullable = 0;
 
-#ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+          } else {
 
-  prev_timed_out = child_timed_out;
+            struct g_rule* c = &g_rules[a->el[k].rule];
 
-  /* Report outcome to caller. */
+            if (!c->nullable) nullable = 0;
+            depth = MAX(depth, c->min_depth);
 
-  if (WIFSIGNALED(status) && !stop_soon) {
+          }
 
-    kill_signal = WTERMSIG(status);
+        }
 
-    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+        a->depth = depth;
 
-    return FAULT_CRASH;
+        if (nullable && !g_rules[i].nullable) {
+          g_rules[i].nullable = 1;
+          changed = 1;
+        }
 
-  }
+        if (depth != GRAMMAR_NO_DEPTH && depth + 1 < g_rules[i].min_depth) {
+          g_rules[i].min_depth = depth + 1;
+          changed = 1;
+        }
 
-  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
-     must use a special exit code. */
+      }
 
-  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
-    kill_signal = 0;
-    return FAULT_CRASH;
-  }
+  } while (changed);
 
-  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
-    return FAULT_ERROR;
+  for (i = 0; i < g_rule_cnt; i++)
+    if (g_rules[i].min_depth == GRAMMAR_NO_DEPTH)
+      FATAL("Rule <%s> can never produce a finite string", g_rules[i].name);
 
-  /* It makes sense to account for the slowest units only if the testcase was run
-  under the user defined timeout. */
-  if (!(timeout > exec_tmout) && (slowest_exec_ms < exec_ms)) {
-    slowest_exec_ms = exec_ms;
-  }
+  g_hash    = ck_alloc(GRAMMAR_MAX_ITEMS * 2 * sizeof(struct g_hent));
+  g_work[0] = ck_alloc_nozero(GRAMMAR_MAX_NODES * sizeof(struct g_node));
+  g_work[1] = ck_alloc_nozero(GRAMMAR_MAX_NODES * sizeof(struct g_node));
+  g_out_buf = ck_alloc_nozero(MAX_FILE);
 
-  return FAULT_NONE;
+  OKF("Loaded %u grammar rules, start symbol is <%s>.", g_rule_cnt,
+      g_rules[0].name);
 
 }
 
 
-/* Write modified data to file for testing. If out_file is set, the old file
-   is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+/* Locate an Earley item in the hash table. Returns the slot, which is either
+   the item itself or the empty slot where it belongs. */
 
-static void write_to_testcase(void* mem, u32 len) {
+static struct g_hent* g_find(u32 pos, u32 rule, u32 alt, u32 dot,
+                             u32 origin) {
 
-  s32 fd = out_fd;
+  u32 h = (pos * 0x9E3779B1) ^ (rule * 0x85EBCA77) ^ (alt * 0xC2B2AE3D) ^
+          (dot * 0x27D4EB2F) ^ (origin * 0x165667B1);
 
-  if (out_file) {
+  while (1) {
 
-    unlink(out_file); /* Ignore errors. */
+    struct g_hent* e;
 
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    h &= GRAMMAR_MAX_ITEMS * 2 - 1;
+    e  = &g_hash[h];
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+    if (e->epoch != g_epoch) return e;
 
-  } else lseek(fd, 0, SEEK_SET);
+    if (e->pos == pos && e->rule == rule && e->alt == alt && e->dot == dot &&
+        e->origin == origin) return e;
 
-  ck_write(fd, mem, len, out_file);
+    h++;
 
-  if (!out_file) {
+  }
 
-    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+}
 
-  } else close(fd);
+
+static inline u8 g_has(u32 pos, u32 rule, u32 alt, u32 dot, u32 origin) {
+
+  return g_find(pos, rule, alt, dot, origin)->epoch == g_epoch;
 
 }
 
 
-/* The same, but with an adjustable gap. Used for trimming. */
+/* Add an item to Earley set pos, unless already there. Sets g_overflow when
+   the item budget is exceeded. */
 
-static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
+static void g_add(u32 pos, u32 rule, u32 alt, u32 dot, u32 origin) {
 
-  s32 fd = out_fd;
-  u32 tail_len = len - skip_at - skip_len;
+  struct g_hent* e = g_find(pos, rule, alt, dot, origin);
+  struct g_set*  s = &g_sets[pos];
 
-  if (out_file) {
+  if (e->epoch == g_epoch) return;
 
-    unlink(out_file); /* Ignore errors. */
+  if (g_item_cnt++ >= GRAMMAR_MAX_ITEMS) {
+    g_overflow = 1;
+    return;
+  }
 
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  e->epoch  = g_epoch;
+  e->pos    = pos;
+  e->rule   = rule;
+  e->alt    = alt;
+  e->dot    = dot;
+  e->origin = origin;
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+  if (s->cnt == s->size) {
+    s->size = s->size ? s->size * 2 : 16;
+    s->it   = ck_realloc(s->it, s->size * sizeof(struct g_item));
+  }
 
-  } else lseek(fd, 0, SEEK_SET);
+  s->it[s->cnt].rule   = rule;
+  s->it[s->cnt].alt    = alt;
+  s->it[s->cnt].dot    = dot;
+  s->it[s->cnt].origin = origin;
+  s->cnt++;
 
-  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+}
 
-  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
 
-  if (!out_file) {
+/* Reconstruct the derivation of buf[from, to) from the given rule, appending
+   nodes to g_work[0]. Works backwards through the elements of a matching
+   alternative, using the Earley sets to tell where each child begins. */
 
-    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+static u8 g_build(u8* buf, u32 rule, u32 from, u32 to, u32 depth) {
 
-  } else close(fd);
+  struct g_alt* a = NULL;
+  u32 alt, k, pos = to;
+  u32* span;
 
-}
+  if (depth > GRAMMAR_MAX_DEPTH || g_build_cnt >= GRAMMAR_MAX_NODES) return 0;
 
+  for (alt = 0; alt < g_rules[rule].alt_cnt; alt++) {
 
-static void show_stats(void);
+    a = &g_rules[rule].alt[alt];
+    if (g_has(to, rule, alt, a->cnt, from)) break;
 
-/* Calibrate a new test case. This is done when processing the input directory
-   to warn about flaky or otherwise problematic test cases early on; and when
-   new paths are discovered to detect variable behavior and so on. */
+  }
 
-static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
-                         u32 handicap, u8 from_queue) {
+  if (alt == g_rules[rule].alt_cnt) return 0;
 
-  static u8 first_trace[MAP_SIZE];
+  span = ck_alloc_nozero((a->cnt + 1) * sizeof(u32));
+  span[a->cnt] = to;
 
-  u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
-      first_run = (q->exec_cksum == 0);
+  for (k = a->cnt; k--; ) {
 
-  u64 start_us, stop_us;
+    struct g_elem* e = &a->el[k];
 
-  s32 old_sc = stage_cur, old_sm = stage_max;
-  u32 use_tmout = exec_tmout;
-  u8* old_sn = stage_name;
+    if (e->lit) {
 
-  /* Be a bit more generous about timeouts when resuming sessions, or when
-     trying to calibrate already-added finds. This helps avoid trouble due
-     to intermittent latency. */
+      if (pos - from < e->len) goto build_fail;
+      pos -= e->len;
 
-  if (!from_queue || resuming_fuzz)
-    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
-                    exec_tmout * CAL_TMOUT_PERC / 100);
+    } else {
 
-  q->cal_failed++;
+      struct g_set* s = &g_sets[pos];
+      u32 i;
 
-  stage_name = "calibration";
-  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+      for (i = 0; i < s->cnt; i++) {
 
-  /* Make sure the forkserver is up before we do anything, and let's not
-     count its spin-up time toward binary calibration. */
+        struct g_item* c = &s->it[i];
 
-  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
-    init_forkserver(argv);
+        if (c->rule != e->rule || c->origin < from ||
+            c->dot != g_rules[c->rule].alt[c->alt].cnt) continue;
 
-  if (q->exec_cksum) {
+        if (g_has(c->origin, rule, alt, k, from)) break;
 
-    memcpy(first_trace, trace_bits, MAP_SIZE);
-    hnb = has_new_bits(virgin_bits);
-    if (hnb > new_bits) new_bits = hnb;
+      }
+
+      if (i == s->cnt) goto build_fail;
+      pos = s->it[i].origin;
+
+    }
+
+    span[k] = pos;
 
   }
 
-  start_us = get_cur_time_us();
+  g_work[0][g_build_cnt].rule = rule;
+  g_work[0][g_build_cnt].alt  = alt;
+  g_build_cnt++;
 
-  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+  for (k = 0; k < a->cnt; k++)
+    if (!a->el[k].lit &&
+        !g_build(buf, a->el[k].rule, span[k], span[k + 1], depth + 1))
+      goto build_fail;
 
-    u32 cksum;
+  ck_free(span);
+  return 1;
 
-    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
+build_fail:
 
-    write_to_testcase(use_mem, q->len);
+  ck_free(span);
+  return 0;
 
-    fault = run_target(argv, use_tmout);
+}
 
-    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
 
-    if (stop_soon || fault != crash_mode) goto abort_calibration;
+/* Parse a test case with the Earley algorithm, returning its derivation tree
+   or NULL if it doesn't match the grammar (or is too expensive to parse).
+   Nullable rules are handled as suggested by Aycock and Horspool. */
 
-    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
-      fault = FAULT_NOINST;
-      goto abort_calibration;
-    }
+static struct g_tree* g_parse(u8* buf, u32 len) {
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  struct g_tree* ret = NULL;
+  u32 i, j, k;
 
-    if (q->exec_cksum != cksum) {
+  if (len > GRAMMAR_MAX_PARSE) return NULL;
 
-      hnb = has_new_bits(virgin_bits);
-      if (hnb > new_bits) new_bits = hnb;
+  g_sets      = ck_alloc((len + 1) * sizeof(struct g_set));
+  g_item_cnt  = 0;
+  g_overflow  = 0;
+  g_build_cnt = 0;
+  g_epoch++;
 
-      if (q->exec_cksum) {
+  for (k = 0; k < g_rules[0].alt_cnt; k++) g_add(0, 0, k, 0, 0);
 
-        u32 i;
+  for (i = 0; i <= len && !g_overflow; i++)
+    for (j = 0; j < g_sets[i].cnt; j++) {
 
-        for (i = 0; i < MAP_SIZE; i++) {
+      struct g_item it = g_sets[i].it[j];
+      struct g_alt* a  = &g_rules[it.rule].alt[it.alt];
 
-          if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
+      if (it.dot == a->cnt) {
 
-            var_bytes[i] = 1;
-            stage_max    = CAL_CYCLES_LONG;
+        /* Completion: advance all the items waiting for this rule. */
 
-          }
+        for (k = 0; k < g_sets[it.origin].cnt; k++) {
+
+          struct g_item p = g_sets[it.origin].it[k];
+          struct g_alt* pa = &g_rules[p.rule].alt[p.alt];
+
+          if (p.dot < pa->cnt && !pa->el[p.dot].lit &&
+              pa->el[p.dot].rule == it.rule)
+            g_add(i, p.rule, p.alt, p.dot + 1, p.origin);
 
         }
 
-        var_detected = 1;
+      } else if (!a->el[it.dot].lit) {
+
+        /* Prediction. */
+
+        u32 r = a->el[it.dot].rule;
+
+        for (k = 0; k < g_rules[r].alt_cnt; k++) g_add(i, r, k, 0, i);
+
+        if (g_rules[r].nullable)
+          g_add(i, it.rule, it.alt, it.dot + 1, it.origin);
 
       } else {
 
-        q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+        /* Scanning. */
+
+        struct g_elem* e = &a->el[it.dot];
+
+        if (len - i >= e->len && !memcmp(buf + i, e->lit, e->len))
+          g_add(i + e->len, it.rule, it.alt, it.dot + 1, it.origin);
 
       }
 
     }
 
-  }
+  if (!g_overflow && g_build(buf, 0, 0, len, 0)) {
 
-  stop_us = get_cur_time_us();
+    ret = ck_alloc_nozero(sizeof(struct g_tree) +
+                          g_build_cnt * sizeof(struct g_node));
+    ret->cnt = g_build_cnt;
+    memcpy(ret->n, g_work[0], g_build_cnt * sizeof(struct g_node));
 
-  total_cal_us     += stop_us - start_us;
-  total_cal_cycles += stage_max;
+  }
 
-  /* OK, let's collect some stats about the performance of this test case.
-     This is used for fuzzing air time calculations in calculate_score(). */
+  for (i = 0; i <= len; i++) ck_free(g_sets[i].it);
+  ck_free(g_sets);
 
-  q->exec_us     = (stop_us - start_us) / stage_max;
-  q->bitmap_size = count_bytes(trace_bits);
-  q->handicap    = handicap;
-  q->cal_failed  = 0;
+  return ret;
 
-  total_bitmap_size += q->bitmap_size;
-  total_bitmap_entries++;
+}
 
-  update_bitmap_score(q);
 
-  /* If this case didn't result in new output from the instrumentation, tell
-     parent. This is a non-critical problem, but something to warn the user
-     about. */
+/* Return the index just past the subtree rooted at node i. */
 
-  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
+static u32 g_skip(struct g_node* n, u32 i) {
 
-abort_calibration:
+  struct g_alt* a = &g_rules[n[i].rule].alt[n[i].alt];
+  u32 k;
 
-  if (new_bits == 2 && !q->has_new_cov) {
-    q->has_new_cov = 1;
-    queued_with_cov++;
-  }
+  i++;
 
-  /* Mark variable paths. */
+  for (k = 0; k < a->cnt; k++)
+    if (!a->el[k].lit) i = g_skip(n, i);
 
-  if (var_detected) {
+  return i;
 
-    var_byte_count = count_bytes(var_bytes);
+}
 
-    if (!q->var_behavior) {
-      mark_as_variable(q);
-      queued_variable++;
-    }
 
-  }
+/* Turn the subtree at node *i back into bytes, appending them to out.
+   Returns 0 if the result would exceed MAX_FILE. */
 
-  stage_name = old_sn;
-  stage_cur  = old_sc;
-  stage_max  = old_sm;
+static u8 g_unparse(struct g_node* n, u32* i, u8* out, u32* len) {
 
-  if (!first_run) show_stats();
+  struct g_alt* a = &g_rules[n[*i].rule].alt[n[*i].alt];
+  u32 k;
 
-  return fault;
+  (*i)++;
 
-}
+  for (k = 0; k < a->cnt; k++) {
 
+    struct g_elem* e = &a->el[k];
 
-/* Examine map coverage. Called once, for first test case. */
+    if (e->lit) {
 
-static void check_map_coverage(void) {
+      if (*len + e->len > MAX_FILE) return 0;
 
-  u32 i;
+      memcpy(out + *len, e->lit, e->len);
+      *len += e->len;
 
-  if (count_bytes(trace_bits) < 100) return;
+    } else if (!g_unparse(n, i, out, len)) return 0;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
-    if (trace_bits[i]) return;
+  }
 
-  WARNF("Recompile binary with newer version of afl to improve coverage!");
+  return 1;
 
 }
 
 
-/* Perform dry run of all test cases to confirm that the app is working as
-   expected. This is done only for the initial inputs, and only once. */
+/* Append a random derivation of a rule to the tree, going at most depth
+   levels deep (or as deep as the rule requires). Returns 0 if the tree
+   grows too large. */
 
-static void perform_dry_run(char** argv) {
+static u8 g_generate(struct g_node* n, u32* cnt, u32 rule, u32 depth) {
 
-  struct queue_entry* q = queue;
-  u32 cal_failures = 0;
-  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
+  struct g_rule* r = &g_rules[rule];
+  struct g_alt*  a;
+  u32 alt, k;
 
-  while (q) {
+  if (*cnt >= GRAMMAR_MAX_NODES) return 0;
 
-    u8* use_mem;
-    u8  res;
-    s32 fd;
+  if (depth < r->min_depth) depth = r->min_depth;
 
-    u8* fn = strrchr(q->fname, '/') + 1;
+  do alt = UR(r->alt_cnt); while (r->alt[alt].depth >= depth);
 
-    ACTF("Attempting dry run with '%s'...", fn);
+  a = &r->alt[alt];
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+  n[*cnt].rule = rule;
+  n[*cnt].alt  = alt;
+  (*cnt)++;
 
-    use_mem = ck_alloc_nozero(q->len);
+  for (k = 0; k < a->cnt; k++)
+    if (!a->el[k].lit && !g_generate(n, cnt, a->el[k].rule, depth - 1))
+      return 0;
 
-    if (read(fd, use_mem, q->len) != q->len)
-      FATAL("Short read from '%s'", q->fname);
+  return 1;
 
-    close(fd);
+}
 
-    res = calibrate_case(argv, q, use_mem, 0, 1);
-    ck_free(use_mem);
 
-    if (stop_soon) return;
+/* Replace a random subtree of src (cnt nodes), writing the result to dst.
+   The replacement is either borrowed from another parsed test case, if one
+   has a subtree for the same rule, or generated from scratch. Returns the
+   new node count, or 0 on failure. */
 
-    if (res == crash_mode || res == FAULT_NOBITS)
-      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
-           q->len, q->bitmap_size, q->exec_us);
+static u32 g_mutate(struct g_node* src, u32 cnt, struct g_node* dst) {
 
-    switch (res) {
+  u32 i = UR(cnt), end = g_skip(src, i), out = i;
 
-      case FAULT_NONE:
+  memcpy(dst, src, i * sizeof(struct g_node));
 
-        if (q == queue) check_map_coverage();
+  if (g_tree_cnt > 1 && UR(2)) {
 
-        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+    struct g_tree* t = g_trees[UR(g_tree_cnt)];
+    u32 start = UR(t->cnt), j;
 
-        break;
+    for (j = 0; j < t->cnt; j++) {
 
-      case FAULT_TMOUT:
+      u32 p = (start + j) % t->cnt, e;
 
-        if (timeout_given) {
+      if (t->n[p].rule != src[i].rule) continue;
 
-          /* The -t nn+ syntax in the command line sets timeout_given to '2' and
-             instructs afl-fuzz to tolerate but skip queue entries that time
-             out. */
+      e = g_skip(t->n, p);
 
-          if (timeout_given > 1) {
-            WARNF("Test case results in a timeout (skipping)");
-            q->cal_failed = CAL_CHANCES;
-            cal_failures++;
-            break;
-          }
+      if (i + (e - p) + (cnt - end) > GRAMMAR_MAX_NODES) return 0;
 
-          SAYF("\n" cLRD "[-] " cRST
-               "The program took more than %u ms to process one of the initial test cases.\n"
-               "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
-               "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
-               "    what you are doing and want to simply skip the unruly test cases, append\n"
-               "    '+' at the end of the value passed to -t ('-t %u+').\n", exec_tmout,
-               exec_tmout);
+      memcpy(dst + out, t->n + p, (e - p) * sizeof(struct g_node));
+      out += e - p;
+      break;
 
-          FATAL("Test case '%s' results in a timeout", fn);
+    }
 
-        } else {
+  }
 
-          SAYF("\n" cLRD "[-] " cRST
-               "The program took more than %u ms to process one of the initial test cases.\n"
-               "    This is bad news; raising the limit with the -t option is possible, but\n"
-               "    will probably make the fuzzing process extremely slow.\n\n"
+  if (out == i && !g_generate(dst, &out, src[i].rule,
+                              1 + UR(GRAMMAR_GEN_DEPTH))) return 0;
 
-               "    If this test case is just a fluke, the other option is to just avoid it\n"
-               "    altogether, and find one that is less of a CPU hog.\n", exec_tmout);
+  if (out + (cnt - end) > GRAMMAR_MAX_NODES) return 0;
 
-          FATAL("Test case '%s' results in a timeout", fn);
+  memcpy(dst + out, src + end, (cnt - end) * sizeof(struct g_node));
 
-        }
+  return out + cnt - end;
 
-      case FAULT_CRASH:  
+}
 
-        if (crash_mode) break;
 
-        if (skip_crashes) {
-          WARNF("Test case results in a crash (skipping)");
-          q->cal_failed = CAL_CHANCES;
-          cal_failures++;
-          break;
-        }
+/* Release the grammar and everything derived from it. Trees are owned by
+   queue entries and are freed in destroy_queue(). */
 
-        if (mem_limit) {
+static void destroy_grammar(void) {
 
-          SAYF("\n" cLRD "[-] " cRST
-               "Oops, the program crashed with one of the test cases provided. There are\n"
-               "    several possible explanations:\n\n"
+  u32 i, j, k;
 
-               "    - The test case causes known crashes under normal working conditions. If\n"
-               "      so, please remove it. The fuzzer should be seeded with interesting\n"
-               "      inputs - but not ones that cause an outright crash.\n\n"
+  for (i = 0; i < g_rule_cnt; i++) {
 
-               "    - The current memory limit (%s) is too low for this program, causing\n"
-               "      it to die due to OOM when parsing valid files. To fix this, try\n"
-               "      bumping it up with the -m setting in the command line. If in doubt,\n"
-               "      try something along the lines of:\n\n"
+    for (j = 0; j < g_rules[i].alt_cnt; j++) {
 
-#ifdef RLIMIT_AS
-               "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#else
-               "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#endif /* ^RLIMIT_AS */
+      for (k = 0; k < g_rules[i].alt[j].cnt; k++)
+        ck_free(g_rules[i].alt[j].el[k].lit);
 
-               "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-               "      estimate the required amount of virtual memory for the binary. Also,\n"
-               "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+      ck_free(g_rules[i].alt[j].el);
 
-#ifdef __APPLE__
-  
-               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-               "      break afl-fuzz performance optimizations when running platform-specific\n"
-               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+    }
 
-#endif /* __APPLE__ */
+    ck_free(g_rules[i].alt);
+    ck_free(g_rules[i].name);
 
-               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-               DMS(mem_limit << 20), mem_limit - 1, doc_path);
+  }
 
-        } else {
+  ck_free(g_rules);
+  ck_free(g_trees);
+  ck_free(g_hash);
+  ck_free(g_work[0]);
+  ck_free(g_work[1]);
+  ck_free(g_out_buf);
 
-          SAYF("\n" cLRD "[-] " cRST
-               "Oops, the program crashed with one of the test cases provided. There are\n"
-               "    several possible explanations:\n\n"
+}
 
-               "    - The test case causes known crashes under normal working conditions. If\n"
-               "      so, please remove it. The fuzzer should be seeded with interesting\n"
-               "      inputs - but not ones that cause an outright crash.\n\n"
 
-#ifdef __APPLE__
-  
-               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-               "      break afl-fuzz performance optimizations when running platform-specific\n"
-               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+/* Spin up fork server (instrumented mode only). The idea is explained here:
 
-#endif /* __APPLE__ */
+   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
 
-               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+   In essence, the instrumentation allows us to skip execve(), and just keep
+   cloning a stopped child. So, we just execute once, and then send commands
+   through a pipe. The other part of this logic is in afl-as.h. */
 
-        }
+EXP_ST void init_forkserver(char** argv) {
 
-        FATAL("Test case '%s' results in a crash", fn);
+  static struct itimerval it;
+  int st_pipe[2], ctl_pipe[2];
+  int status;
+  s32 rlen;
 
-      case FAULT_ERROR:
+  ACTF("Spinning up the fork server...");
 
-        FATAL("Unable to execute target application ('%s')", argv[0]);
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
 
-      case FAULT_NOINST:
+  forksrv_pid = fork();
 
-        FATAL("No instrumentation detected");
+  if (forksrv_pid < 0) PFATAL("fork() failed");
 
-      case FAULT_NOBITS: 
+  if (!forksrv_pid) {
 
-        useless_at_start++;
+    struct rlimit r;
 
-        if (!in_bitmap && !shuffle_queue)
-          WARNF("No new instrumentation output, test case may be useless.");
+    /* Umpf. On OpenBSD, the default fd limit for root users is set to
+       soft 128. Let's try to fix that... */
 
-        break;
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
 
     }
 
-    if (q->var_behavior) WARNF("Instrumentation output varies across runs.");
+    if (mem_limit) {
 
-    q = q->next;
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
 
-  }
+#ifdef RLIMIT_AS
 
-  if (cal_failures) {
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
 
-    if (cal_failures == queued_paths)
-      FATAL("All test cases time out%s, giving up!",
-            skip_crashes ? " or crash" : "");
+#else
 
-    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
-          ((double)cal_failures) * 100 / queued_paths,
-          skip_crashes ? " or crashes" : "");
+      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
+         according to reliable sources, RLIMIT_DATA covers anonymous
+         maps - so we should be getting good protection against OOM bugs. */
 
-    if (cal_failures * 5 > queued_paths)
-      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
 
-  }
+#endif /* ^RLIMIT_AS */
 
-  OKF("All test cases processed.");
 
-}
+    }
 
+    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
+       before the dump is complete. */
 
-/* Helper function: link() if possible, copy otherwise. */
+    r.rlim_max = r.rlim_cur = 0;
 
-static void link_or_copy(u8* old_path, u8* new_path) {
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
 
-  s32 i = link(old_path, new_path);
-  s32 sfd, dfd;
-  u8* tmp;
+    /* Isolate the process and configure standard descriptors. If out_file is
+       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
 
-  if (!i) return;
+    setsid();
 
-  sfd = open(old_path, O_RDONLY);
-  if (sfd < 0) PFATAL("Unable to open '%s'", old_path);
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
 
-  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (dfd < 0) PFATAL("Unable to create '%s'", new_path);
+    if (out_file) {
 
-  tmp = ck_alloc(64 * 1024);
+      dup2(dev_null_fd, 0);
 
-  while ((i = read(sfd, tmp, 64 * 1024)) > 0) 
-    ck_write(dfd, tmp, i, new_path);
+    } else {
 
-  if (i < 0) PFATAL("read() failed");
+      dup2(out_fd, 0);
+      close(out_fd);
 
-  ck_free(tmp);
-  close(sfd);
-  close(dfd);
+    }
 
-}
+    /* Set up control and status pipes, close the unneeded original fds. */
 
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
 
-static void nuke_resume_dir(void);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
 
-/* Create hard links for input test cases in the output directory, choosing
-   good names and pivoting accordingly. */
+    close(out_dir_fd);
+    close(dev_null_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
 
-static void pivot_inputs(void) {
+    /* This should improve performance a bit, since it stops the linker from
+       doing extra work post-fork(). */
 
-  struct queue_entry* q = queue;
-  u32 id = 0;
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
 
-  ACTF("Creating hard links for all input files...");
+    /* Set sane defaults for ASAN if nothing else specified. */
 
-  while (q) {
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1", 0);
 
-    u8  *nfn, *rsl = strrchr(q->fname, '/');
-    u32 orig_id;
+    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
+       point. So, we do this in a very hacky way. */
 
-    if (!rsl) rsl = q->fname; else rsl++;
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                           "symbolize=0:"
+                           "abort_on_error=1:"
+                           "allocator_may_return_null=1:"
+                           "msan_track_origins=0", 0);
 
-    /* If the original file name conforms to the syntax and the recorded
-       ID matches the one we'd assign, just use the original file name.
-       This is valuable for resuming fuzzing runs. */
+    execv(target_path, argv);
 
-#ifndef SIMPLE_FILES
-#  define CASE_PREFIX "id:"
-#else
-#  define CASE_PREFIX "id_"
-#endif /* ^!SIMPLE_FILES */
+    /* Use a distinctive bitmap signature to tell the parent about execv()
+       falling through. */
 
-    if (!strncmp(rsl, CASE_PREFIX, 3) &&
-        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id) {
+    *(u32*)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
 
-      u8* src_str;
-      u32 src_id;
+  }
 
-      resuming_fuzz = 1;
-      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
+  /* Close the unneeded endpoints. */
 
-      /* Since we're at it, let's also try to find parent and figure out the
-         appropriate depth for this entry. */
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
 
-      src_str = strchr(rsl + 3, ':');
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd  = st_pipe[0];
 
-      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1) {
+  /* Wait for the fork server to come up, but don't wait too long. */
 
-        struct queue_entry* s = queue;
-        while (src_id-- && s) s = s->next;
-        if (s) q->depth = s->depth + 1;
+  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
+  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
 
-        if (max_depth < q->depth) max_depth = q->depth;
+  setitimer(ITIMER_REAL, &it, NULL);
 
-      }
+  rlen = read(fsrv_st_fd, &status, 4);
 
-    } else {
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
 
-      /* No dice - invent a new name, capturing the original one as a
-         substring. */
+  setitimer(ITIMER_REAL, &it, NULL);
 
-#ifndef SIMPLE_FILES
+  /* If we have a four-byte "hello" message from the server, we're all set.
+     Otherwise, try to figure out what went wrong. */
 
-      u8* use_name = strstr(rsl, ",orig:");
+  if (rlen == 4) {
+    OKF("All right - fork server is up.");
+    return;
+  }
 
-      if (use_name) use_name += 6; else use_name = rsl;
-      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
+  if (child_timed_out)
+    FATAL("Timeout while initializing fork server (adjusting -t may help)");
 
-#else
+  if (waitpid(forksrv_pid, &status, 0) <= 0)
+    PFATAL("waitpid() failed");
 
-      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
+  if (WIFSIGNALED(status)) {
 
-#endif /* ^!SIMPLE_FILES */
+    if (mem_limit && mem_limit < 500 && uses_asan) {
 
-    }
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
+           "    restrictive memory limit configured, this is expected; please read\n"
+           "    %s/notes_for_asan.txt for help.\n", doc_path);
 
-    /* Pivot to the new queue entry. */
+    } else if (!mem_limit) {
 
-    link_or_copy(q->fname, nfn);
-    ck_free(q->fname);
-    q->fname = nfn;
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
 
-    /* Make sure that the passed_det value carries over, too. */
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
 
-    if (q->passed_det) mark_as_det_done(q);
+#ifdef __APPLE__
 
-    q = q->next;
-    id++;
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-  }
+#endif /* __APPLE__ */
 
-  if (in_place_resume) nuke_resume_dir();
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-}
+    } else {
 
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
 
-#ifndef SIMPLE_FILES
+           "    - The current memory limit (%s) is too restrictive, causing the\n"
+           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
+           "      the limit with the -m setting in the command line. A simple way confirm\n"
+           "      this diagnosis would be:\n\n"
 
-/* Construct a file name for a new test case, capturing the operation
-   that led to its discovery. Uses a static buffer. */
+#ifdef RLIMIT_AS
+           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
 
-static u8* describe_op(u8 hnb) {
+           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+           "      estimate the required amount of virtual memory for the binary.\n\n"
 
-  static u8 ret[256];
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
 
-  if (syncing_party) {
+#ifdef __APPLE__
 
-    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
 
-  } else {
+#endif /* __APPLE__ */
 
-    sprintf(ret, "src:%06u", current_entry);
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+           DMS(mem_limit << 20), mem_limit - 1);
 
-    if (splicing_with >= 0)
-      sprintf(ret + strlen(ret), "+%06u", splicing_with);
+    }
 
-    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
 
-    if (stage_cur_byte >= 0) {
+  }
 
-      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", argv[0]);
 
-      if (stage_val_type != STAGE_VAL_NONE)
-        sprintf(ret + strlen(ret), ",val:%s%+d", 
-                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
-                stage_cur_val);
+  if (mem_limit && mem_limit < 500 && uses_asan) {
 
-    } else sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+    SAYF("\n" cLRD "[-] " cRST
+           "Hmm, looks like the target binary terminated before we could complete a\n"
+           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
+           "    you have a restrictive memory limit configured, this is expected; please\n"
+           "    read %s/notes_for_asan.txt for help.\n", doc_path);
 
-  }
+  } else if (!mem_limit) {
 
-  if (hnb == 2) strcat(ret, ",+cov");
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
+         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
 
-  return ret;
+  } else {
 
-}
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. There are %s probable explanations:\n\n"
 
-#endif /* !SIMPLE_FILES */
+         "%s"
+         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
+         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
+         "      simple way to confirm the diagnosis may be:\n\n"
 
+#ifdef RLIMIT_AS
+         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
 
-/* Write a message accompanying the crash directory :-) */
+         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+         "      estimate the required amount of virtual memory for the binary.\n\n"
 
-static void write_crash_readme(void) {
+         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+         getenv(DEFER_ENV_VAR) ? "three" : "two",
+         getenv(DEFER_ENV_VAR) ?
+         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
+         "      reached before the program terminates.\n\n" : "",
+         DMS(mem_limit << 20), mem_limit - 1);
 
-  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
-  s32 fd;
-  FILE* f;
+  }
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  ck_free(fn);
+  FATAL("Fork server handshake failed");
 
-  /* Do not die on errors here - that would be impolite. */
+}
 
-  if (fd < 0) return;
 
-  f = fdopen(fd, "w");
+/* Execute target application, monitoring for timeouts. Return status
+   information. The called program will update trace_bits[]. */
 
-  if (!f) {
-    close(fd);
-    return;
-  }
+static u8 run_target(char** argv, u32 timeout) {
 
-  fprintf(f, "Command line used to find this crash:\n\n"
+  static struct itimerval it;
+  static u32 prev_timed_out = 0;
+  static u64 exec_ms = 0;
 
-             "%s\n\n"
+  int status = 0;
+  u32 tb4;
 
-             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
-             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+  child_timed_out = 0;
+  run_tmout = timeout;
 
-             "Need a tool to minimize test cases before investigating the crashes or sending\n"
-             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+  /* After this memset, trace_bits[] are effectively volatile, so we
+     must prevent any earlier operations from venturing into that
+     territory. */
 
-             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
-             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
-             "add your finds to the gallery at:\n\n"
+  memset(trace_bits, 0, MAP_SIZE);
+  if (crash_buckets) *stack_hash = 0;
+  MEM_BARRIER();
 
-             "  http://lcamtuf.coredump.cx/afl/\n\n"
+  /* If we're running in "dumb" mode, we can't rely on the fork server
+     logic compiled into the target program, so we will just keep calling
+     execve(). There is a bit of code duplication between here and 
+     init_forkserver(), but c'est la vie. */
 
-             "Thanks :-)\n",
+  if (dumb_mode == 1 || no_forkserver) {
 
-             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+    child_pid = fork();
 
-  fclose(f);
+    if (child_pid < 0) PFATAL("fork() failed");
 
-}
+    if (!child_pid) {
 
+      struct rlimit r;
 
-/* Check if the result of an execve() during routine fuzzing is interesting,
-   save or queue the input test case for further analysis if so. Returns 1 if
-   entry is saved, 0 otherwise. */
+      if (mem_limit) {
 
-static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
+        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
 
-  u8  *fn = "";
-  u8  hnb;
-  s32 fd;
-  u8  keeping = 0, res;
+#ifdef RLIMIT_AS
 
-  if (fault == crash_mode) {
+        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
 
-    /* Keep only if there are new bits in the map, add to queue for
-       future fuzzing, etc. */
+#else
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
-      if (crash_mode) total_crashes++;
-      return 0;
-    }    
+        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
 
-#ifndef SIMPLE_FILES
+#endif /* ^RLIMIT_AS */
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
+      }
 
-#else
+      r.rlim_max = r.rlim_cur = 0;
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
 
-#endif /* ^!SIMPLE_FILES */
+      /* Isolate the process and configure standard descriptors. If out_file is
+         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
 
-    add_to_queue(fn, len, 0);
+      setsid();
 
-    if (hnb == 2) {
-      queue_top->has_new_cov = 1;
-      queued_with_cov++;
-    }
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      if (out_file) {
 
-    /* Try to calibrate inline; this also calls update_bitmap_score() when
-       successful. */
+        dup2(dev_null_fd, 0);
 
-    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+      } else {
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+        dup2(out_fd, 0);
+        close(out_fd);
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+      }
 
-    keeping = 1;
+      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
 
-  }
+      close(dev_null_fd);
+      close(out_dir_fd);
+      close(dev_urandom_fd);
+      close(fileno(plot_file));
 
-  switch (fault) {
+      /* Set sane defaults for ASAN if nothing else specified. */
 
-    case FAULT_TMOUT:
+      setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                             "detect_leaks=0:"
+                             "symbolize=0:"
+                             "allocator_may_return_null=1", 0);
 
-      /* Timeouts are not very interesting, but we're still obliged to keep
-         a handful of samples. We use the presence of new bits in the
-         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
-         just keep everything. */
+      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                             "symbolize=0:"
+                             "msan_track_origins=0", 0);
 
-      total_tmouts++;
+      execv(target_path, argv);
 
-      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+      /* Use a distinctive bitmap value to tell the parent about execv()
+         falling through. */
 
-      if (!dumb_mode) {
+      *(u32*)trace_bits = EXEC_FAIL_SIG;
+      exit(0);
 
-#ifdef WORD_SIZE_64
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+    }
 
-        if (!has_new_bits(virgin_tmout)) return keeping;
+  } else {
 
-      }
+    s32 res;
 
-      unique_tmouts++;
+    /* In non-dumb mode, we have the fork server up and running, so simply
+       tell it to have at it, and then read back PID. */
 
-      /* Before saving, we make sure that it's a genuine hang by re-running
-         the target with a more generous timeout (unless the default timeout
-         is already generous). */
+    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
 
-      if (exec_tmout < hang_tmout) {
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
-        u8 new_fault;
-        write_to_testcase(mem, len);
-        new_fault = run_target(argv, hang_tmout);
+    }
 
-        /* A corner case that one user reported bumping into: increasing the
-           timeout actually uncovers a crash. Make sure we don't discard it if
-           so. */
+    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
 
-        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
-        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+    }
 
-      }
+    if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
 
-#ifndef SIMPLE_FILES
+  }
 
-      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+  /* Configure timeout, as requested by user, then wait for child to terminate. */
 
-#else
+  it.it_value.tv_sec = (timeout / 1000);
+  it.it_value.tv_usec = (timeout % 1000) * 1000;
 
-      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+  setitimer(ITIMER_REAL, &it, NULL);
 
-#endif /* ^!SIMPLE_FILES */
+  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
 
-      unique_hangs++;
+  if (dumb_mode == 1 || no_forkserver) {
 
-      last_hang_time = get_cur_time();
+    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
 
-      break;
+  } else {
 
-    case FAULT_CRASH:
+    s32 res;
 
-keep_as_crash:
+    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
 
-      /* This is handled in a manner roughly similar to timeouts,
-         except for slightly different limits and no need to re-run test
-         cases. */
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
 
-      total_crashes++;
+    }
 
-      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+  }
 
-      if (!dumb_mode) {
+  if (!WIFSTOPPED(status)) child_pid = 0;
 
-#ifdef WORD_SIZE_64
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  getitimer(ITIMER_REAL, &it);
+  exec_ms = (u64) timeout - (it.it_value.tv_sec * 1000 +
+                             it.it_value.tv_usec / 1000);
 
-        if (!has_new_bits(virgin_crash)) return keeping;
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
 
-      }
+  setitimer(ITIMER_REAL, &it, NULL);
 
-      if (!unique_crashes) write_crash_readme();
+  total_execs++;
 
-#ifndef SIMPLE_FILES
+  /* Any subsequent operations on trace_bits must not be moved by the
+     compiler below this point. Past this location, trace_bits[] behave
+     very normally and do not have to be treated as volatile. */
 
-      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+  MEM_BARRIER();
 
-#else
+  tb4 = *(u32*)trace_bits;
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                        kill_signal);
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
 
-#endif /* ^!SIMPLE_FILES */
+  prev_timed_out = child_timed_out;
 
-      unique_crashes++;
+  /* Report outcome to caller. */
 
-      last_crash_time = get_cur_time();
-      last_crash_execs = total_execs;
+  if (WIFSIGNALED(status) && !stop_soon) {
 
-      break;
+    kill_signal = WTERMSIG(status);
 
-    case FAULT_ERROR: FATAL("Unable to execute target application");
+    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
 
-    default: return keeping;
+    return FAULT_CRASH;
 
   }
 
-  /* If we're here, we apparently want to save the crash or hang
-     test case, too. */
+  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
+     must use a special exit code. */
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  ck_write(fd, mem, len, fn);
-  close(fd);
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
 
-  ck_free(fn);
+  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
+    return FAULT_ERROR;
 
-  return keeping;
+  /* It makes sense to account for the slowest units only if the testcase was run
+  under the user defined timeout. */
+  if (!(timeout > exec_tmout) && (slowest_exec_ms < exec_ms)) {
+    slowest_exec_ms = exec_ms;
+  }
+
+  return FAULT_NONE;
 
 }
 
 
-/* When resuming, try to find the queue position to start from. This makes sense
-   only when resuming, and when we can find the original fuzzer_stats. */
+/* Find the span in which mem differs from tc_disk, comparing in chunks
+   from both ends. Returns 0 if there is no difference. */
 
-static u32 find_start_position(void) {
+static u8 find_tc_diff(u8* mem, u32 len, u32* lo, u32* hi) {
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  u32 l = 0, h = len;
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  while (l < len) {
 
-  if (!resuming_fuzz) return 0;
+    u32 n = MIN(len - l, 4096);
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+    if (memcmp(mem + l, tc_disk + l, n)) break;
+    l += n;
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+  }
 
-  if (fd < 0) return 0;
+  if (l == len) return 0;
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
+  while (mem[l] == tc_disk[l]) l++;
 
-  off = strstr(tmp, "cur_path          : ");
-  if (!off) return 0;
+  while (h > l) {
 
-  ret = atoi(off + 20);
-  if (ret >= queued_paths) ret = 0;
-  return ret;
+    u32 n = MIN(h - l, 4096);
 
-}
+    if (memcmp(mem + h - n, tc_disk + h - n, n)) break;
+    h -= n;
 
+  }
 
-/* The same, but for timeouts. The idea is that when resuming sessions without
-   -t given, we don't want to keep auto-scaling the timeout over and over
-   again to prevent it from growing due to random flukes. */
+  while (mem[h - 1] == tc_disk[h - 1]) h--;
 
-static void find_timeout(void) {
+  *lo = l;
+  *hi = h;
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  return 1;
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+}
 
-  if (!resuming_fuzz) return;
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+/* Check whether a file still has the timestamps it had after our last
+   write, at the best granularity the OS gives us; a target that rewrites
+   its input in place within the same second would slip past st_mtime. */
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+static u8 same_tc_times(struct stat* a, struct stat* b) {
 
-  if (fd < 0) return;
+#ifdef __APPLE__
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
+  return a->st_mtimespec.tv_sec  == b->st_mtimespec.tv_sec  &&
+         a->st_mtimespec.tv_nsec == b->st_mtimespec.tv_nsec &&
+         a->st_ctimespec.tv_sec  == b->st_ctimespec.tv_sec  &&
+         a->st_ctimespec.tv_nsec == b->st_ctimespec.tv_nsec;
 
-  off = strstr(tmp, "exec_timeout      : ");
-  if (!off) return;
+#else
 
-  ret = atoi(off + 20);
-  if (ret <= 4) return;
+  return a->st_mtim.tv_sec  == b->st_mtim.tv_sec  &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+         a->st_ctim.tv_sec  == b->st_ctim.tv_sec  &&
+         a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
 
-  exec_tmout = ret;
-  timeout_given = 3;
+#endif /* ^__APPLE__ */
 
 }
 
 
-/* Update stats file for unattended monitoring. */
+/* Rewrite only the changed part of a large test case. This requires the
+   length to be the same, and the file on disk to look like we left it; the
+   target could have modified or replaced it. Returns 0 if a full write is
+   needed instead. */
 
-static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+static u8 write_tc_diff(u8* mem, u32 len) {
 
-  static double last_bcvg, last_stab, last_eps;
-  static struct rusage usage;
+  struct stat st;
+  s32 fd = out_fd;
+  u32 lo, hi;
 
-  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  s32 fd;
-  FILE* f;
+  if (len != tc_disk_len) return 0;
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out_file ? stat(out_file, &st) : fstat(out_fd, &st)) return 0;
 
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  if (st.st_ino != tc_disk_st.st_ino || st.st_size != len ||
+      !same_tc_times(&st, &tc_disk_st)) return 0;
 
-  ck_free(fn);
+  if (find_tc_diff(mem, len, &lo, &hi)) {
 
-  f = fdopen(fd, "w");
+    if (out_file) {
 
-  if (!f) PFATAL("fdopen() failed");
+      fd = open(out_file, O_WRONLY);
+      if (fd < 0) return 0;
 
-  /* Keep last values in case we're called from another context
-     where exec/sec stats and such are not readily available. */
+    }
+
+    if (pwrite(fd, mem + lo, hi - lo, lo) != hi - lo)
+      PFATAL("Short write to %s", out_file ? out_file : (u8*)".cur_input");
+
+    memcpy(tc_disk + lo, mem + lo, hi - lo);
+
+    if (fstat(fd, &tc_disk_st)) PFATAL("fstat() failed");
+
+    if (out_file) close(fd);
 
-  if (!bitmap_cvg && !stability && !eps) {
-    bitmap_cvg = last_bcvg;
-    stability  = last_stab;
-    eps        = last_eps;
-  } else {
-    last_bcvg = bitmap_cvg;
-    last_stab = stability;
-    last_eps  = eps;
   }
 
-  fprintf(f, "start_time        : %llu\n"
-             "last_update       : %llu\n"
-             "fuzzer_pid        : %u\n"
-             "cycles_done       : %llu\n"
-             "execs_done        : %llu\n"
-             "execs_per_sec     : %0.02f\n"
-             "paths_total       : %u\n"
-             "paths_favored     : %u\n"
-             "paths_found       : %u\n"
-             "paths_imported    : %u\n"
-             "max_depth         : %u\n"
-             "cur_path          : %u\n" /* Must match find_start_position() */
-             "pending_favs      : %u\n"
-             "pending_total     : %u\n"
-             "variable_paths    : %u\n"
-             "stability         : %0.02f%%\n"
-             "bitmap_cvg        : %0.02f%%\n"
-             "unique_crashes    : %llu\n"
-             "unique_hangs      : %llu\n"
-             "last_path         : %llu\n"
-             "last_crash        : %llu\n"
-             "last_hang         : %llu\n"
-             "execs_since_crash : %llu\n"
-             "exec_timeout      : %u\n" /* Must match find_timeout() */
-             "afl_banner        : %s\n"
-             "afl_version       : " VERSION "\n"
-             "target_mode       : %s%s%s%s%s%s%s\n"
-             "command_line      : %s\n"
-             "slowest_exec_ms   : %llu\n",
-             start_time / 1000, get_cur_time() / 1000, getpid(),
-             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
-             queued_paths, queued_favored, queued_discovered, queued_imported,
-             max_depth, current_entry, pending_favored, pending_not_fuzzed,
-             queued_variable, stability, bitmap_cvg, unique_crashes,
-             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
-             last_hang_time / 1000, total_execs - last_crash_execs,
-             exec_tmout, use_banner,
-             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
-             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
-             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
-             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
-              persistent_mode || deferred_mode) ? "" : "default",
-             orig_cmdline, slowest_exec_ms);
-             /* ignore errors */
+  if (!out_file) lseek(fd, 0, SEEK_SET);
+
+  return 1;
+
+}
+
+
+/* Remember what was just written in full to fd, if it's large enough for
+   diff writes to pay off. Havoc changes the length all the time, so we wait
+   for two full writes of the same length before making a copy. */
+
+static void save_tc_disk(s32 fd, u8* mem, u32 len) {
+
+  u32 last_len = tc_last_len;
+
+  tc_disk_len = 0;
+  tc_last_len = len;
+
+  if (len < DIFF_WRITE_MIN || len != last_len || fstat(fd, &tc_disk_st))
+    return;
+
+  if (len > tc_disk_size) {
+    tc_disk = ck_realloc(tc_disk, len);
+    tc_disk_size = len;
+  }
+
+  memcpy(tc_disk, mem, len);
+  tc_disk_len = len;
+
+}
+
+
+/* Write modified data to file for testing. If out_file is set, the old file
+   is unlinked and a new one is created. Otherwise, out_fd is rewound and
+   truncated. Large test cases of unchanged length are patched in place
+   instead, see write_tc_diff(). */
+
+static void write_to_testcase(void* mem, u32 len) {
+
+  s32 fd = out_fd;
+
+  if (len >= DIFF_WRITE_MIN && write_tc_diff(mem, len)) return;
+
+  if (out_file) {
+
+    unlink(out_file); /* Ignore errors. */
+
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  } else lseek(fd, 0, SEEK_SET);
+
+  ck_write(fd, mem, len, out_file);
+
+  if (!out_file) {
+
+    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
+
+  }
+
+  save_tc_disk(fd, mem, len);
+
+  if (out_file) close(fd);
+
+}
+
+
+/* The same, but with an adjustable gap. Used for trimming. */
+
+static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
+
+  s32 fd = out_fd;
+  u32 tail_len = len - skip_at - skip_len;
+
+  if (out_file) {
+
+    unlink(out_file); /* Ignore errors. */
+
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  } else lseek(fd, 0, SEEK_SET);
+
+  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+
+  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
+
+  tc_disk_len = 0;
+
+  if (!out_file) {
+
+    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
+
+  } else close(fd);
+
+}
+
+
+/* Mask or unmask a bitmap byte that has proven unstable. Masked bytes are
+   cleared in the virgin maps, so has_new_bits() no longer reports them, and
+   give up their top_rated[] entries. Unmasked bytes start from scratch. */
+
+static void set_unstable_mask(u32 i, u8 on) {
+
+  unstable_mask[i] = on;
+
+  if (on) {
+
+    unstable_edges++;
+
+    virgin_bits[i] = virgin_tmout[i] = virgin_crash[i] = 0;
+
+    if (top_rated[i]) {
+
+      if (!--top_rated[i]->tc_ref) {
+        ck_free(top_rated[i]->trace_mini);
+        top_rated[i]->trace_mini = 0;
+      }
+
+      top_rated[i]  = NULL;
+      score_changed = 1;
+
+    }
 
-  /* Get rss value from the children
-     We must have killed the forkserver process and called waitpid
-     before calling getrusage */
-  if (getrusage(RUSAGE_CHILDREN, &usage)) {
-      WARNF("getrusage failed");
-  } else if (usage.ru_maxrss == 0) {
-    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
   } else {
-#ifdef __APPLE__
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
-#else
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
-#endif /* ^__APPLE__ */
+
+    unstable_edges--;
+
+    virgin_bits[i] = virgin_tmout[i] = virgin_crash[i] = 255;
+
   }
 
-  fclose(f);
+  bitmap_changed = 1;
 
 }
 
 
-/* Update the plot file if there is a reason to. */
+/* Update the unstable byte counters after a complete calibration. Bytes that
+   varied move UNSTABLE_VAR_PTS closer to being masked, bytes that were hit
+   but stayed put move one step back; masking happens at UNSTABLE_MASK_ON,
+   unmasking only when the counter drops back to zero. This way, an edge
+   that flips only occasionally is not toggled back and forth. */
 
-static void maybe_update_plot_file(double bitmap_cvg, double eps) {
+static void update_unstable(u8* hit, u8* var) {
 
-  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
-  static u64 prev_qc, prev_uc, prev_uh;
+  u32 i;
 
-  if (prev_qp == queued_paths && prev_pf == pending_favored && 
-      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
-      prev_qc == queue_cycle && prev_uc == unique_crashes &&
-      prev_uh == unique_hangs && prev_md == max_depth) return;
+  for (i = 0; i < MAP_SIZE; i++) {
 
-  prev_qp  = queued_paths;
-  prev_pf  = pending_favored;
-  prev_pnf = pending_not_fuzzed;
-  prev_ce  = current_entry;
-  prev_qc  = queue_cycle;
-  prev_uc  = unique_crashes;
-  prev_uh  = unique_hangs;
-  prev_md  = max_depth;
+    if (var[i]) {
+
+      unstable_score[i] = MIN(255, unstable_score[i] + UNSTABLE_VAR_PTS);
+
+      if (!unstable_mask[i] && unstable_score[i] >= UNSTABLE_MASK_ON)
+        set_unstable_mask(i, 1);
+
+      unstable_changed = 1;
+
+    } else if (hit[i] && unstable_score[i]) {
+
+      if (!--unstable_score[i] && unstable_mask[i])
+        set_unstable_mask(i, 0);
+
+      unstable_changed = 1;
+
+    }
+
+  }
+
+}
+
+
+/* Save the unstable byte counters and mask, so that resumed sessions do not
+   have to learn them all over again. */
+
+static void save_unstable(void) {
+
+  u8* fn;
+  s32 fd;
+
+  if (!unstable_changed) return;
+  unstable_changed = 0;
+
+  fn = alloc_printf("%s/queue/.state/unstable_edges", out_dir);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  ck_write(fd, unstable_score, MAP_SIZE, fn);
+  ck_write(fd, unstable_mask, MAP_SIZE, fn);
+
+  close(fd);
+  ck_free(fn);
+
+}
+
+
+/* Load the unstable byte state left behind by a previous session. */
+
+static void load_unstable(void) {
+
+  u8* fn = alloc_printf("%s/.state/unstable_edges", in_dir);
+  s32 fd;
+  u32 i;
+
+  if (no_unstable_mask) { ck_free(fn); return; }
+
+  fd = open(fn, O_RDONLY);
+
+  if (fd < 0) {
+
+    if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
+    ck_free(fn);
+    return;
+
+  }
+
+  ck_read(fd, unstable_score, MAP_SIZE, fn);
+  ck_read(fd, unstable_mask, MAP_SIZE, fn);
+
+  close(fd);
+  ck_free(fn);
+
+  for (i = 0; i < MAP_SIZE; i++)
+    if (unstable_mask[i]) {
+      unstable_mask[i] = 0;
+      set_unstable_mask(i, 1);
+    }
+
+  unstable_changed = 1;
+
+  if (unstable_edges)
+    OKF("Loaded %u unstable bitmap bytes from the previous session.",
+        unstable_edges);
+
+}
+
+
+static void show_stats(void);
+
+/* Calibrate a new test case. This is done when processing the input directory
+   to warn about flaky or otherwise problematic test cases early on; and when
+   new paths are discovered to detect variable behavior and so on. */
+
+static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
+                         u32 handicap, u8 from_queue) {
+
+  static u8 first_trace[MAP_SIZE], cal_var[MAP_SIZE];
+
+  u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
+      first_run = (q->exec_cksum == 0);
+
+  u64 start_us, stop_us;
+
+  s32 old_sc = stage_cur, old_sm = stage_max;
+  u32 use_tmout = exec_tmout;
+  u8* old_sn = stage_name;
+
+  /* Be a bit more generous about timeouts when resuming sessions, or when
+     trying to calibrate already-added finds. This helps avoid trouble due
+     to intermittent latency. */
+
+  if (!from_queue || resuming_fuzz)
+    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
+                    exec_tmout * CAL_TMOUT_PERC / 100);
+
+  q->cal_failed++;
+
+  stage_name = "calibration";
+  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+
+  /* Make sure the forkserver is up before we do anything, and let's not
+     count its spin-up time toward binary calibration. */
+
+  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+    init_forkserver(argv);
+
+  if (q->exec_cksum) {
+
+    memcpy(first_trace, trace_bits, MAP_SIZE);
+    hnb = has_new_bits(virgin_bits);
+    if (hnb > new_bits) new_bits = hnb;
+
+  }
+
+  if (!no_unstable_mask) memset(cal_var, 0, MAP_SIZE);
+
+  start_us = get_cur_time_us();
+
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+
+    u32 cksum;
+
+    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
+
+    write_to_testcase(use_mem, q->len);
+
+    fault = run_target(argv, use_tmout);
+
+    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
+
+    if (stop_soon || fault != crash_mode) goto abort_calibration;
+
+    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
+      fault = FAULT_NOINST;
+      goto abort_calibration;
+    }
+
+    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    if (q->exec_cksum != cksum) {
+
+      hnb = has_new_bits(virgin_bits);
+      if (hnb > new_bits) new_bits = hnb;
+
+      if (q->exec_cksum) {
+
+        u32 i;
+
+        for (i = 0; i < MAP_SIZE; i++) {
+
+          if (first_trace[i] != trace_bits[i]) {
+
+            cal_var[i] = 1;
+
+            if (!var_bytes[i]) {
+              var_bytes[i] = 1;
+              stage_max    = CAL_CYCLES_LONG;
+            }
+
+          }
+
+        }
+
+        var_detected = 1;
+
+      } else {
+
+        q->exec_cksum = cksum;
+        q->probe_gen  = probe_gen;
+        memcpy(first_trace, trace_bits, MAP_SIZE);
+
+      }
+
+    }
+
+  }
+
+  stop_us = get_cur_time_us();
+
+  total_cal_us     += stop_us - start_us;
+  total_cal_cycles += stage_max;
+
+  if (!no_unstable_mask && !dumb_mode) update_unstable(first_trace, cal_var);
+
+  /* OK, let's collect some stats about the performance of this test case.
+     This is used for fuzzing air time calculations in calculate_score(). */
+
+  q->exec_us     = (stop_us - start_us) / stage_max;
+  q->bitmap_size = count_bytes(trace_bits);
+  q->handicap    = handicap;
+  q->cal_failed  = 0;
+
+  total_bitmap_size += q->bitmap_size;
+  total_bitmap_entries++;
+
+  update_bitmap_score(q);
+
+  /* If this case didn't result in new output from the instrumentation, tell
+     parent. This is a non-critical problem, but something to warn the user
+     about. */
+
+  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
+
+abort_calibration:
+
+  if (new_bits == 2 && !q->has_new_cov) {
+    q->has_new_cov = 1;
+    queued_with_cov++;
+  }
+
+  /* Mark variable paths. */
+
+  if (var_detected) {
+
+    var_byte_count = count_bytes(var_bytes);
+
+    if (!q->var_behavior) {
+      mark_as_variable(q);
+      queued_variable++;
+    }
+
+  }
+
+  stage_name = old_sn;
+  stage_cur  = old_sc;
+  stage_max  = old_sm;
+
+  if (!first_run) show_stats();
+
+  return fault;
+
+}
+
+
+/* Examine map coverage. Called once, for first test case. */
+
+static void check_map_coverage(void) {
+
+  u32 i;
+
+  if (count_bytes(trace_bits) < 100) return;
+
+  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
+    if (trace_bits[i]) return;
+
+  WARNF("Recompile binary with newer version of afl to improve coverage!");
+
+}
+
+
+/* Perform dry run of all test cases to confirm that the app is working as
+   expected. This is done only for the initial inputs, and only once. */
+
+static void perform_dry_run(char** argv) {
+
+  struct queue_entry* q = queue;
+  u32 cal_failures = 0;
+  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
+
+  while (q) {
+
+    u8* use_mem;
+    u8  res;
+    s32 fd;
+
+    u8* fn = strrchr(q->fname, '/') + 1;
+
+    ACTF("Attempting dry run with '%s'...", fn);
+
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+    use_mem = ck_alloc_nozero(q->len);
+
+    if (read(fd, use_mem, q->len) != q->len)
+      FATAL("Short read from '%s'", q->fname);
+
+    close(fd);
+
+    res = calibrate_case(argv, q, use_mem, 0, 1);
+    ck_free(use_mem);
+
+    if (stop_soon) return;
+
+    if (res == crash_mode || res == FAULT_NOBITS)
+      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
+           q->len, q->bitmap_size, q->exec_us);
+
+    switch (res) {
+
+      case FAULT_NONE:
+
+        if (q == queue) check_map_coverage();
+
+        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+
+        break;
+
+      case FAULT_TMOUT:
+
+        if (timeout_given) {
+
+          /* The -t nn+ syntax in the command line sets timeout_given to '2' and
+             instructs afl-fuzz to tolerate but skip queue entries that time
+             out. */
+
+          if (timeout_given > 1) {
+            WARNF("Test case results in a timeout (skipping)");
+            q->cal_failed = CAL_CHANCES;
+            cal_failures++;
+            break;
+          }
+
+          SAYF("\n" cLRD "[-] " cRST
+               "The program took more than %u ms to process one of the initial test cases.\n"
+               "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
+               "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
+               "    what you are doing and want to simply skip the unruly test cases, append\n"
+               "    '+' at the end of the value passed to -t ('-t %u+').\n", exec_tmout,
+               exec_tmout);
+
+          FATAL("Test case '%s' results in a timeout", fn);
+
+        } else {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "The program took more than %u ms to process one of the initial test cases.\n"
+               "    This is bad news; raising the limit with the -t option is possible, but\n"
+               "    will probably make the fuzzing process extremely slow.\n\n"
+
+               "    If this test case is just a fluke, the other option is to just avoid it\n"
+               "    altogether, and find one that is less of a CPU hog.\n", exec_tmout);
+
+          FATAL("Test case '%s' results in a timeout", fn);
+
+        }
+
+      case FAULT_CRASH:  
+
+        if (crash_mode) break;
+
+        if (skip_crashes) {
+          WARNF("Test case results in a crash (skipping)");
+          q->cal_failed = CAL_CHANCES;
+          cal_failures++;
+          break;
+        }
+
+        if (mem_limit) {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "Oops, the program crashed with one of the test cases provided. There are\n"
+               "    several possible explanations:\n\n"
+
+               "    - The test case causes known crashes under normal working conditions. If\n"
+               "      so, please remove it. The fuzzer should be seeded with interesting\n"
+               "      inputs - but not ones that cause an outright crash.\n\n"
+
+               "    - The current memory limit (%s) is too low for this program, causing\n"
+               "      it to die due to OOM when parsing valid files. To fix this, try\n"
+               "      bumping it up with the -m setting in the command line. If in doubt,\n"
+               "      try something along the lines of:\n\n"
+
+#ifdef RLIMIT_AS
+               "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#else
+               "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#endif /* ^RLIMIT_AS */
+
+               "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+               "      estimate the required amount of virtual memory for the binary. Also,\n"
+               "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+
+#ifdef __APPLE__
+  
+               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+               "      break afl-fuzz performance optimizations when running platform-specific\n"
+               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+               DMS(mem_limit << 20), mem_limit - 1, doc_path);
+
+        } else {
+
+          SAYF("\n" cLRD "[-] " cRST
+               "Oops, the program crashed with one of the test cases provided. There are\n"
+               "    several possible explanations:\n\n"
+
+               "    - The test case causes known crashes under normal working conditions. If\n"
+               "      so, please remove it. The fuzzer should be seeded with interesting\n"
+               "      inputs - but not ones that cause an outright crash.\n\n"
+
+#ifdef __APPLE__
+  
+               "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+               "      break afl-fuzz performance optimizations when running platform-specific\n"
+               "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+               "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+               "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+
+        }
+
+        FATAL("Test case '%s' results in a crash", fn);
+
+      case FAULT_ERROR:
+
+        FATAL("Unable to execute target application ('%s')", argv[0]);
+
+      case FAULT_NOINST:
+
+        FATAL("No instrumentation detected");
+
+      case FAULT_NOBITS: 
+
+        useless_at_start++;
+
+        if (!in_bitmap && !shuffle_queue)
+          WARNF("No new instrumentation output, test case may be useless.");
+
+        break;
+
+    }
+
+    if (q->var_behavior) WARNF("Instrumentation output varies across runs.");
+
+    q = q->next;
+
+  }
+
+  if (cal_failures) {
+
+    if (cal_failures == queued_paths)
+      FATAL("All test cases time out%s, giving up!",
+            skip_crashes ? " or crash" : "");
+
+    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
+          ((double)cal_failures) * 100 / queued_paths,
+          skip_crashes ? " or crashes" : "");
+
+    if (cal_failures * 5 > queued_paths)
+      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+
+  }
+
+  OKF("All test cases processed.");
+
+}
+
+
+/* Helper function: link() if possible, copy otherwise. */
+
+static void link_or_copy(u8* old_path, u8* new_path) {
+
+  s32 i = link(old_path, new_path);
+  s32 sfd, dfd;
+  u8* tmp;
+
+  if (!i) return;
+
+  sfd = open(old_path, O_RDONLY);
+  if (sfd < 0) PFATAL("Unable to open '%s'", old_path);
+
+  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (dfd < 0) PFATAL("Unable to create '%s'", new_path);
+
+  tmp = ck_alloc(64 * 1024);
+
+  while ((i = read(sfd, tmp, 64 * 1024)) > 0) 
+    ck_write(dfd, tmp, i, new_path);
+
+  if (i < 0) PFATAL("read() failed");
+
+  ck_free(tmp);
+  close(sfd);
+  close(dfd);
+
+}
+
+
+static void nuke_resume_dir(void);
+
+/* Create hard links for input test cases in the output directory, choosing
+   good names and pivoting accordingly. */
+
+static void pivot_inputs(void) {
+
+  struct queue_entry* q = queue;
+  u32 id = 0;
+
+  ACTF("Creating hard links for all input files...");
+
+  while (q) {
+
+    u8  *nfn, *rsl = strrchr(q->fname, '/');
+    u32 orig_id;
+
+    if (!rsl) rsl = q->fname; else rsl++;
+
+    /* If the original file name conforms to the syntax and the recorded
+       ID matches the one we'd assign, just use the original file name.
+       This is valuable for resuming fuzzing runs. */
+
+#ifndef SIMPLE_FILES
+#  define CASE_PREFIX "id:"
+#else
+#  define CASE_PREFIX "id_"
+#endif /* ^!SIMPLE_FILES */
+
+    if (!strncmp(rsl, CASE_PREFIX, 3) &&
+        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id) {
+
+      u8* src_str;
+      u32 src_id;
+
+      resuming_fuzz = 1;
+      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
+
+      /* Since we're at it, let's also try to find parent and figure out the
+         appropriate depth for this entry. */
+
+      src_str = strchr(rsl + 3, ':');
+
+      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1) {
+
+        struct queue_entry* s = queue;
+        while (src_id-- && s) s = s->next;
+        if (s) q->depth = s->depth + 1;
+
+        if (max_depth < q->depth) max_depth = q->depth;
+
+      }
+
+    } else {
+
+      /* No dice - invent a new name, capturing the original one as a
+         substring. */
+
+#ifndef SIMPLE_FILES
+
+      u8* use_name = strstr(rsl, ",orig:");
+
+      if (use_name) use_name += 6; else use_name = rsl;
+      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
+
+#else
+
+      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
+
+#endif /* ^!SIMPLE_FILES */
+
+    }
+
+    /* Pivot to the new queue entry. */
+
+    link_or_copy(q->fname, nfn);
+    ck_free(q->fname);
+    q->fname = nfn;
+
+    /* Make sure that the passed_det value carries over, too. */
+
+    if (q->passed_det) mark_as_det_done(q);
+
+    q = q->next;
+    id++;
+
+  }
+
+  if (in_place_resume) nuke_resume_dir();
+
+}
+
+
+#ifndef SIMPLE_FILES
+
+/* Construct a file name for a new test case, capturing the operation
+   that led to its discovery. Uses a static buffer. */
+
+static u8* describe_op(u8 hnb) {
+
+  static u8 ret[256];
+
+  if (syncing_party) {
+
+    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+
+  } else {
+
+    sprintf(ret, "src:%06u", queue_cur->id);
+
+    if (splicing_with >= 0)
+      sprintf(ret + strlen(ret), "+%06u", splicing_with);
+
+    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+
+    if (stage_cur_byte >= 0) {
+
+      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+
+      if (stage_val_type != STAGE_VAL_NONE)
+        sprintf(ret + strlen(ret), ",val:%s%+d", 
+                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
+                stage_cur_val);
+
+    } else sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+
+  }
+
+  if (hnb == 2) strcat(ret, ",+cov");
+
+  return ret;
+
+}
+
+#endif /* !SIMPLE_FILES */
+
+
+/* Count a crash against the bucket for its stack hash, creating the bucket
+   if needed. Returns the number of crashes seen with that hash so far. */
+
+static u32 bump_crash_bucket(u32 hash) {
+
+  u32 i;
+
+  if ((bkt_count + 1) * 2 > bkt_size) {
+
+    u32 *old_hash = bkt_hash, *old_hits = bkt_hits, old_size = bkt_size;
+
+    bkt_size = bkt_size ? bkt_size * 2 : 256;
+    bkt_hash = ck_alloc(bkt_size * sizeof(u32));
+    bkt_hits = ck_alloc(bkt_size * sizeof(u32));
+
+    for (i = 0; i < old_size; i++) {
+
+      u32 j;
+
+      if (!old_hash[i]) continue;
+
+      j = old_hash[i] & (bkt_size - 1);
+      while (bkt_hash[j]) j = (j + 1) & (bkt_size - 1);
+
+      bkt_hash[j] = old_hash[i];
+      bkt_hits[j] = old_hits[i];
+
+    }
+
+    ck_free(old_hash);
+    ck_free(old_hits);
+
+  }
+
+  i = hash & (bkt_size - 1);
+  while (bkt_hash[i] && bkt_hash[i] != hash) i = (i + 1) & (bkt_size - 1);
+
+  if (!bkt_hash[i]) {
+    bkt_hash[i] = hash;
+    bkt_count++;
+  }
+
+  return ++bkt_hits[i];
+
+}
+
+
+/* Write a message accompanying the crash directory :-) */
+
+static void write_crash_readme(void) {
+
+  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
+  s32 fd;
+  FILE* f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  ck_free(fn);
+
+  /* Do not die on errors here - that would be impolite. */
+
+  if (fd < 0) return;
+
+  f = fdopen(fd, "w");
+
+  if (!f) {
+    close(fd);
+    return;
+  }
+
+  fprintf(f, "Command line used to find this crash:\n\n"
+
+             "%s\n\n"
+
+             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
+             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+
+             "Need a tool to minimize test cases before investigating the crashes or sending\n"
+             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+
+             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
+             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
+             "add your finds to the gallery at:\n\n"
+
+             "  http://lcamtuf.coredump.cx/afl/\n\n"
+
+             "Thanks :-)\n",
+
+             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+
+  fclose(f);
+
+}
+
+
+/* With per-entry timeouts, an input that timed out may merely be slower
+   than its parent. Re-run it with the generous timeout, but only if the
+   partial trace already shows something that save_if_interesting() would
+   look at - new coverage, or a new hang - so that the usual hang costs no
+   more than cur_tmout. Returns the fault to go by. */
+
+static u8 recheck_tmout(char** argv, void* mem, u32 len) {
+
+  if (!dumb_mode && !peek_new_bits(virgin_bits, 0) &&
+      (unique_hangs >= KEEP_UNIQUE_HANG || !peek_new_bits(virgin_tmout, 1)))
+    return FAULT_TMOUT;
+
+  write_to_testcase(mem, len);
+
+  return run_target(argv, MAX(exec_tmout, hang_tmout));
+
+}
+
+
+/* Check if the result of an execve() during routine fuzzing is interesting,
+   save or queue the input test case for further analysis if so. Returns 1 if
+   entry is saved, 0 otherwise. */
+
+static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
+
+  u8  *fn = "";
+  u8  hnb;
+  s32 fd;
+  u8  keeping = 0, res;
+  u32 cksum = 0, hash;
+
+  /* Power schedules need to know how often each path gets exercised. */
+
+  if (n_fuzz) {
+
+    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    n_fuzz[cksum & ((1 << N_FUZZ_SIZE_POW2) - 1)]++;
+
+  }
+
+  if (fault == crash_mode) {
+
+    /* Keep only if there are new bits in the map, add to queue for
+       future fuzzing, etc. */
+
+    if (!(hnb = has_new_bits(virgin_bits))) {
+      if (crash_mode) total_crashes++;
+      return 0;
+    }    
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                      describe_op(hnb));
+
+#else
+
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+
+#endif /* ^!SIMPLE_FILES */
+
+    add_to_queue(fn, len, 0);
+
+    if (hnb == 2) {
+      queue_top->has_new_cov = 1;
+      queued_with_cov++;
+    }
+
+    queue_top->exec_cksum = n_fuzz ? cksum :
+                            hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    /* Try to calibrate inline; this also calls update_bitmap_score() when
+       successful. */
+
+    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
+
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    ck_write(fd, mem, len, fn);
+    close(fd);
+
+    if (custom_queue_new_entry)
+      custom_queue_new_entry(custom_data, fn, mem, len);
+
+    keeping = 1;
+
+  }
+
+  switch (fault) {
+
+    case FAULT_TMOUT:
+
+      /* Timeouts are not very interesting, but we're still obliged to keep
+         a handful of samples. We use the presence of new bits in the
+         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
+         just keep everything. */
+
+      total_tmouts++;
+
+      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+
+      if (!dumb_mode) {
+
+#ifdef WORD_SIZE_64
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+        if (!has_new_bits(virgin_tmout)) return keeping;
+
+      }
+
+      unique_tmouts++;
+
+      /* Before saving, we make sure that it's a genuine hang by re-running
+         the target with a more generous timeout (unless the default timeout
+         is already generous). */
+
+      if (run_tmout < MAX(exec_tmout, hang_tmout)) {
+
+        u8 new_fault;
+        write_to_testcase(mem, len);
+        new_fault = run_target(argv, MAX(exec_tmout, hang_tmout));
+
+        /* A corner case that one user reported bumping into: increasing the
+           timeout actually uncovers a crash. Make sure we don't discard it if
+           so. */
+
+        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+
+        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+
+      }
+
+#ifndef SIMPLE_FILES
+
+      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
+                        unique_hangs, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
+                        unique_hangs);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_hangs++;
+
+      last_hang_time = get_cur_time();
+
+      break;
+
+    case FAULT_CRASH:
+
+keep_as_crash:
+
+      /* This is handled in a manner roughly similar to timeouts,
+         except for slightly different limits and no need to re-run test
+         cases. */
+
+      total_crashes++;
+
+      /* With a stack hash from the runtime, the first few crashes in every
+         bucket are kept and the rest discarded, no matter which paths led
+         there. Crashes without one fall back to the usual bitmap check. */
+
+      hash = crash_buckets ? *stack_hash : 0;
+
+      if (hash && bump_crash_bucket(hash) > CRASH_BUCKET_KEEP) return keeping;
+
+      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+
+      if (!dumb_mode && !hash) {
+
+#ifdef WORD_SIZE_64
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+        if (!has_new_bits(virgin_crash)) return keeping;
+
+      }
+
+      if (!unique_crashes) write_crash_readme();
+
+#ifndef SIMPLE_FILES
+
+      if (hash)
+        fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,stk:%08x,%s", out_dir,
+                          unique_crashes, kill_signal, hash, describe_op(0));
+      else
+        fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
+                          unique_crashes, kill_signal, describe_op(0));
+
+#else
+
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+                        kill_signal);
+
+#endif /* ^!SIMPLE_FILES */
+
+      unique_crashes++;
+
+      last_crash_time = get_cur_time();
+      last_crash_execs = total_execs;
+
+      break;
+
+    case FAULT_ERROR: FATAL("Unable to execute target application");
+
+    default: return keeping;
+
+  }
+
+  /* If we're here, we apparently want to save the crash or hang
+     test case, too. */
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);
+
+  ck_free(fn);
+
+  return keeping;
+
+}
+
+
+/* When resuming, try to find the queue position to start from. This makes sense
+   only when resuming, and when we can find the original fuzzer_stats. */
+
+static u32 find_start_position(void) {
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return 0;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return 0;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "cur_path          : ");
+  if (!off) return 0;
+
+  ret = atoi(off + 20);
+  if (ret >= queued_paths) ret = 0;
+  return ret;
+
+}
+
+
+/* The same, but for timeouts. The idea is that when resuming sessions without
+   -t given, we don't want to keep auto-scaling the timeout over and over
+   again to prevent it from growing due to random flukes. */
+
+static void find_timeout(void) {
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "exec_timeout      : ");
+  if (!off) return;
+
+  ret = atoi(off + 20);
+  if (ret <= 4) return;
+
+  exec_tmout = ret;
+  timeout_given = 3;
+
+}
+
+
+/* Input size class for AFL_ADAPTIVE_DET: under 64 bytes, under 1 kB, under
+   16 kB, and anything larger. */
+
+static u32 det_size_class(u32 len) {
+
+  if (len < 64)    return 0;
+  if (len < 1024)  return 1;
+  if (len < 16384) return 2;
+  return 3;
+
+}
+
+
+/* Fold the finds and execs of the last fuzz_one() into the per-stage yield
+   counters of the matching size class. Havoc and splice go together into the
+   STAGE_HAVOC slot. Counters are halved once they cover DET_YIELD_WINDOW
+   execs, so that the yield reflects the recent past. */
+
+static void update_det_yield(u32 len) {
+
+  u32 c = det_size_class(len), i;
+
+  for (i = 0; i <= STAGE_HAVOC; i++) {
+
+    if (i > STAGE_EXTRAS_AO && i != STAGE_HAVOC) continue;
+
+    det_finds[c][i] += stage_finds[i] - det_snap_finds[i];
+    det_execs[c][i] += stage_cycles[i] - det_snap_cycles[i];
+
+    if (i == STAGE_HAVOC) {
+      det_finds[c][i] += stage_finds[STAGE_SPLICE] - det_snap_finds[STAGE_SPLICE];
+      det_execs[c][i] += stage_cycles[STAGE_SPLICE] -
+                         det_snap_cycles[STAGE_SPLICE];
+    }
+
+    if (det_execs[c][i] > DET_YIELD_WINDOW) {
+      det_finds[c][i] /= 2;
+      det_execs[c][i] /= 2;
+    }
+
+  }
+
+}
+
+
+/* Check whether a deterministic stage finds less per exec than havoc does,
+   for inputs of a given size class. Needs enough execs on both sides. */
+
+static u8 det_low_yield(u32 c, u32 stage) {
+
+  double s_execs = det_execs[c][stage], h_execs = det_execs[c][STAGE_HAVOC];
+
+  if (s_execs < DET_YIELD_MIN_EXECS || h_execs < DET_YIELD_MIN_EXECS) return 0;
+
+  return det_finds[c][stage] * h_execs < det_finds[c][STAGE_HAVOC] * s_execs;
+
+}
+
+
+/* Decide whether to skip a deterministic stage for the current entry. Low-
+   yield stages still run for one entry in DET_YIELD_SAMPLE, so that their
+   yield estimate keeps getting updated and they can come back. */
+
+static u8 det_skip(u32 stage, u32 len) {
+
+  if (!adaptive_det || !det_low_yield(det_size_class(len), stage)) return 0;
+
+  if (!UR(DET_YIELD_SAMPLE)) return 0;
+
+  det_skipped++;
+  return 1;
+
+}
+
+
+/* Describe the low-yield stages for fuzzer_stats, e.g.
+   "<1k:flip2,flip4 16k+:arith8", or "none". */
+
+static u8* det_low_yield_str(void) {
+
+  static u8 ret[1024];
+  static const u8* class_names[] = { "<64", "<1k", "<16k", "16k+" };
+  static const u8* stage_names[] = {
+    "flip1", "flip2", "flip4", "flip8", "flip16", "flip32", "arith8",
+    "arith16", "arith32", "int8", "int16", "int32", "ext_UO", "ext_UI",
+    "ext_AO"
+  };
+
+  u32 c, i;
+
+  ret[0] = 0;
+
+  for (c = 0; c < 4; c++) {
+
+    u8 first = 1;
+
+    for (i = 0; i <= STAGE_EXTRAS_AO; i++) {
+
+      if (!det_low_yield(c, i)) continue;
+
+      if (first)
+        sprintf(ret + strlen(ret), "%s%s:", ret[0] ? " " : "", class_names[c]);
+      else
+        strcat(ret, ",");
+
+      strcat(ret, stage_names[i]);
+      first = 0;
+
+    }
+
+  }
+
+  return ret[0] ? ret : (u8*)"none";
+
+}
+
+
+/* Update stats file for unattended monitoring. */
+
+static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+
+  static double last_bcvg, last_stab, last_eps;
+  static struct rusage usage;
+
+  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  s32 fd;
+  FILE* f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  ck_free(fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f) PFATAL("fdopen() failed");
+
+  /* Keep last values in case we're called from another context
+     where exec/sec stats and such are not readily available. */
+
+  if (!bitmap_cvg && !stability && !eps) {
+    bitmap_cvg = last_bcvg;
+    stability  = last_stab;
+    eps        = last_eps;
+  } else {
+    last_bcvg = bitmap_cvg;
+    last_stab = stability;
+    last_eps  = eps;
+  }
+
+  fprintf(f, "start_time        : %llu\n"
+             "last_update       : %llu\n"
+             "fuzzer_pid        : %u\n"
+             "cycles_done       : %llu\n"
+             "execs_done        : %llu\n"
+             "execs_per_sec     : %0.02f\n"
+             "paths_total       : %u\n"
+             "paths_favored     : %u\n"
+             "paths_found       : %u\n"
+             "paths_imported    : %u\n"
+             "max_depth         : %u\n"
+             "cur_path          : %u\n" /* Must match find_start_position() */
+             "pending_favs      : %u\n"
+             "pending_total     : %u\n"
+             "variable_paths    : %u\n"
+             "stability         : %0.02f%%\n"
+             "bitmap_cvg        : %0.02f%%\n"
+             "unique_crashes    : %llu\n"
+             "unique_hangs      : %llu\n"
+             "last_path         : %llu\n"
+             "last_crash        : %llu\n"
+             "last_hang         : %llu\n"
+             "execs_since_crash : %llu\n"
+             "exec_timeout      : %u\n" /* Must match find_timeout() */
+             "afl_banner        : %s\n"
+             "afl_version       : " VERSION "\n"
+             "target_mode       : %s%s%s%s%s%s%s%s\n"
+             "command_line      : %s\n"
+             "slowest_exec_ms   : %llu\n"
+             "power_schedule    : %s\n",
+             start_time / 1000, get_cur_time() / 1000, getpid(),
+             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
+             queued_paths, queued_favored, queued_discovered, queued_imported,
+             max_depth, current_entry, pending_favored, pending_not_fuzzed,
+             queued_variable, stability, bitmap_cvg, unique_crashes,
+             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
+             last_hang_time / 1000, total_execs - last_crash_execs,
+             exec_tmout, use_banner,
+             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
+             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
+             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
+             prefork_mode ? "prefork " : "",
+             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
+              persistent_mode || deferred_mode || prefork_mode) ? "" : "default",
+             orig_cmdline, slowest_exec_ms, schedule_names[schedule]);
+             /* ignore errors */
+
+  if (crash_buckets)
+    fprintf(f, "crash_buckets     : %u\n", bkt_count);
+
+  if (queue_compact)
+    fprintf(f, "paths_archived    : %u\n", queued_archived);
+
+  if (fast_probes)
+    fprintf(f, "probes_off        : %u\n", probes_off);
+
+  if (!no_unstable_mask)
+    fprintf(f, "unstable_edges    : %u\n", unstable_edges);
+
+  if (dedup_execs)
+    fprintf(f, "execs_deduped     : %llu\n", dedup_hits);
+
+  if (struct_fixups)
+    fprintf(f, "struct_fields     : %u\n"
+               "struct_fixups     : %llu\n", struct_fields, fix_applied);
+
+  if (adaptive_det)
+    fprintf(f, "det_skipped       : %llu\n"
+               "det_low_yield     : %s\n", det_skipped, det_low_yield_str());
+
+  if (post_handler_v2)
+    fprintf(f, "post_calls        : %llu\n"
+               "post_bypassed     : %llu\n", post_calls, post_bypassed);
+
+  /* Get rss value from the children
+     We must have killed the forkserver process and called waitpid
+     before calling getrusage */
+  if (getrusage(RUSAGE_CHILDREN, &usage)) {
+      WARNF("getrusage failed");
+  } else if (usage.ru_maxrss == 0) {
+    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
+  } else {
+#ifdef __APPLE__
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
+#else
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
+#endif /* ^__APPLE__ */
+  }
+
+  fclose(f);
+
+}
+
+
+/* Update the plot file if there is a reason to. */
+
+static void maybe_update_plot_file(double bitmap_cvg, double eps) {
+
+  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
+  static u64 prev_qc, prev_uc, prev_uh;
+
+  if (prev_qp == queued_paths && prev_pf == pending_favored && 
+      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
+      prev_qc == queue_cycle && prev_uc == unique_crashes &&
+      prev_uh == unique_hangs && prev_md == max_depth) return;
+
+  prev_qp  = queued_paths;
+  prev_pf  = pending_favored;
+  prev_pnf = pending_not_fuzzed;
+  prev_ce  = current_entry;
+  prev_qc  = queue_cycle;
+  prev_uc  = unique_crashes;
+  prev_uh  = unique_hangs;
+  prev_md  = max_depth;
+
+  /* Fields in the file:
+
+     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
+     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
+     execs_per_sec */
+
+  fprintf(plot_file, 
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
+          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
+          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
+          unique_hangs, max_depth, eps); /* ignore errors */
+
+  fflush(plot_file);
+
+}
+
+
+
+/* A helper function for maybe_delete_out_dir(), deleting all prefixed
+   files in a directory. */
+
+static u8 delete_files(u8* path, u8* prefix) {
+
+  DIR* d;
+  struct dirent* d_ent;
+
+  d = opendir(path);
+
+  if (!d) return 0;
+
+  while ((d_ent = readdir(d))) {
+
+    if (d_ent->d_name[0] != '.' && (!prefix ||
+        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+
+      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
+      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
+      ck_free(fname);
+
+    }
+
+  }
+
+  closedir(d);
+
+  return !!rmdir(path);
+
+}
+
+
+/* Get the number of runnable processes, with some simple smoothing. */
+
+static double get_runnable_processes(void) {
+
+  static double res;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+
+  /* I don't see any portable sysctl or so that would quickly give us the
+     number of runnable processes; the 1-minute load average can be a
+     semi-decent approximation, though. */
+
+  if (getloadavg(&res, 1) != 1) return 0;
+
+#else
+
+  /* On Linux, /proc/stat is probably the best way; load averages are
+     computed in funny ways and sometimes don't reflect extremely short-lived
+     processes well. */
+
+  FILE* f = fopen("/proc/stat", "r");
+  u8 tmp[1024];
+  u32 val = 0;
+
+  if (!f) return 0;
+
+  while (fgets(tmp, sizeof(tmp), f)) {
+
+    if (!strncmp(tmp, "procs_running ", 14) ||
+        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+
+  }
+ 
+  fclose(f);
+
+  if (!res) {
+
+    res = val;
+
+  } else {
+
+    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
+          ((double)val) * (1.0 / AVG_SMOOTHING);
+
+  }
+
+#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+
+  return res;
+
+}
+
+
+/* Delete the temporary directory used for in-place session resume. */
+
+static void nuke_resume_dir(void) {
+
+  u8* fn;
+
+  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/unstable_edges", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/archived", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  return;
+
+dir_cleanup_failed:
+
+  FATAL("_resume directory cleanup failed");
+
+}
+
+
+/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
+   is not currently running, and if the last run time isn't too great. */
+
+static void maybe_delete_out_dir(void) {
+
+  FILE* f;
+  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+
+  /* See if the output directory is locked. If yes, bail out. If not,
+     create a lock that will persist for the lifetime of the process
+     (this requires leaving the descriptor open).*/
+
+  out_dir_fd = open(out_dir, O_RDONLY);
+  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+
+#ifndef __sun
+
+  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like the job output directory is being actively used by another\n"
+         "    instance of afl-fuzz. You will need to choose a different %s\n"
+         "    or stop the other process first.\n",
+         sync_id ? "fuzzer ID" : "output location");
+
+    FATAL("Directory '%s' is in use", out_dir);
+
+  }
+
+#endif /* !__sun */
+
+  f = fopen(fn, "r");
+
+  if (f) {
+
+    u64 start_time, last_update;
+
+    if (fscanf(f, "start_time     : %llu\n"
+                  "last_update    : %llu\n", &start_time, &last_update) != 2)
+      FATAL("Malformed data in '%s'", fn);
+
+    fclose(f);
+
+    /* Let's see how much work is at stake. */
+
+    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The job output directory already exists and contains the results of more\n"
+           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
+           "    automatically delete this data for you.\n\n"
+
+           "    If you wish to start a new session, remove or rename the directory manually,\n"
+           "    or specify a different output location for this job. To resume the old\n"
+           "    session, put '-' as the input directory in the command line ('-i -') and\n"
+           "    try again.\n", OUTPUT_GRACE);
+
+       FATAL("At-risk data found in '%s'", out_dir);
+
+    }
+
+  }
+
+  ck_free(fn);
+
+  /* The idea for in-place resume is pretty simple: we temporarily move the old
+     queue/ to a new location that gets deleted once import to the new queue/
+     is finished. If _resume/ already exists, the current queue/ may be
+     incomplete due to an earlier abort, so we want to use the old _resume/
+     dir instead, and we let rename() fail silently. */
+
+  if (in_place_resume) {
+
+    u8* orig_q = alloc_printf("%s/queue", out_dir);
+
+    in_dir = alloc_printf("%s/_resume", out_dir);
+
+    rename(orig_q, in_dir); /* Ignore errors */
+
+    OKF("Output directory exists, will attempt session resume.");
+
+    ck_free(orig_q);
+
+  } else {
+
+    OKF("Output directory exists but deemed OK to reuse.");
+
+  }
+
+  ACTF("Deleting old session data...");
+
+  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
+     in <out_dir>/.synced/.../id:*, if any are present. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/.synced", out_dir);
+    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
+    ck_free(fn);
+
+  }
+
+  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+
+  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/unstable_edges", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/archived", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* Then, get rid of the .state subdirectory itself (should be empty by now)
+     and everything matching <out_dir>/queue/id:*. */
+
+  fn = alloc_printf("%s/queue/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/crashes/README.txt", out_dir);
+    unlink(fn); /* Ignore errors */
+    ck_free(fn);
+
+  }
+
+  fn = alloc_printf("%s/crashes", out_dir);
+
+  /* Make backup of the crashes directory if it's not empty and if we're
+     doing in-place resume. */
+
+  if (in_place_resume && rmdir(fn)) {
+
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
+
+#ifndef SIMPLE_FILES
+
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#else
+
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#endif /* ^!SIMPLE_FILES */
+
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+
+  }
+
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/hangs", out_dir);
+
+  /* Backup hangs, too. */
+
+  if (in_place_resume && rmdir(fn)) {
+
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
+
+#ifndef SIMPLE_FILES
+
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#else
+
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#endif /* ^!SIMPLE_FILES */
+
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+
+  }
+
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* And now, for some finishing touches. */
+
+  fn = alloc_printf("%s/.cur_input", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  if (!in_place_resume) {
+    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
+  }
+
+  fn = alloc_printf("%s/plot_data", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/token_yield", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  OKF("Output dir cleanup successful.");
+
+  /* Wow... is that all? If yes, celebrate! */
+
+  return;
+
+dir_cleanup_failed:
+
+  SAYF("\n" cLRD "[-] " cRST
+       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
+       "    some files that shouldn't be there or that couldn't be removed - so it\n"
+       "    decided to abort! This happened while processing this path:\n\n"
+
+       "    %s\n\n"
+       "    Please examine and manually delete the files, or specify a different\n"
+       "    output location for the tool.\n", fn);
+
+  FATAL("Output directory cleanup failed");
+
+}
+
+
+static void check_term_size(void);
+
+
+/* A spiffy retro stats screen! This is called every stats_update_freq
+   execve() calls, plus in several other circumstances. */
+
+static void show_stats(void) {
+
+  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
+  static double avg_exec;
+  double t_byte_ratio, stab_ratio;
+
+  u64 cur_ms;
+  u32 t_bytes, t_bits;
+
+  u32 banner_len, banner_pad;
+  u8  tmp[256];
+
+  cur_ms = get_cur_time();
+
+  /* If not enough time has passed since last UI update, bail out. */
+
+  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+
+  /* Check if we're past the 10 minute mark. */
+
+  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+
+  /* Calculate smoothed exec speed stats. */
+
+  if (!last_execs) {
+  
+    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+
+  } else {
+
+    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
+                     (cur_ms - last_ms);
+
+    /* If there is a dramatic (5x+) jump in speed, reset the indicator
+       more quickly. */
+
+    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
+      avg_exec = cur_avg;
+
+    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
+               cur_avg * (1.0 / AVG_SMOOTHING);
+
+  }
+
+  last_ms = cur_ms;
+  last_execs = total_execs;
+
+  /* Tell the callers when to contact us (as measured in execs). */
+
+  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
+  if (!stats_update_freq) stats_update_freq = 1;
+
+  /* Do some bitmap stats. */
+
+  t_bytes = count_non_255_bytes(virgin_bits);
+  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+
+  if (t_bytes) 
+    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
+  else
+    stab_ratio = 100;
+
+  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+
+  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+
+    last_stats_ms = cur_ms;
+    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
+    save_auto();
+    save_unstable();
+    write_bitmap();
+
+  }
+
+  /* Every now and then, write plot data. */
+
+  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+
+    last_plot_ms = cur_ms;
+    maybe_update_plot_file(t_byte_ratio, avg_exec);
+ 
+  }
+
+  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+
+  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
+      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+
+  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+
+  /* If we're not on TTY, bail out. */
+
+  if (not_on_tty) return;
+
+  /* Compute some mildly useful bitmap stats. */
+
+  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+
+  /* Now, for the visuals... */
+
+  if (clear_screen) {
+
+    SAYF(TERM_CLEAR CURSOR_HIDE);
+    clear_screen = 0;
+
+    check_term_size();
+
+  }
+
+  SAYF(TERM_HOME);
+
+  if (term_too_small) {
+
+    SAYF(cBRI "Your terminal is too small to display the UI.\n"
+         "Please resize terminal window to at least 80x%u.\n" cRST,
+         25 + (custom_fuzz || g_rules));
+
+    return;
+
+  }
+
+  /* Let's start by drawing a centered banner. */
+
+  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
+  banner_pad = (80 - banner_len) / 2;
+  memset(tmp, ' ', banner_pad);
+
+  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN
+          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
+          cYEL "american fuzzy lop", use_banner);
+
+  SAYF("\n%s\n\n", tmp);
+
+  /* "Handy" shortcuts for drawing boxes... */
+
+#define bSTG    bSTART cGRA
+#define bH2     bH bH
+#define bH5     bH2 bH2 bH
+#define bH10    bH5 bH5
+#define bH20    bH10 bH10
+#define bH30    bH20 bH10
+#define SP5     "     "
+#define SP10    SP5 SP5
+#define SP20    SP10 SP10
+
+  /* Lord, forgive me this. */
+
+  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
+       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+
+  if (dumb_mode) {
+
+    strcpy(tmp, cRST);
+
+  } else {
+
+    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+
+    /* First queue cycle: don't stop now! */
+    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
+
+    /* Subsequent cycles, but we're still making finds. */
+    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
+
+    /* No finds for a long time and no test cases to try. */
+    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
+      strcpy(tmp, cLGN);
+
+    /* Default: cautiously OK to stop? */
+    else strcpy(tmp, cLBL);
+
+  }
+
+  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
+       "  cycles done : %s%-5s  " bSTG bV "\n",
+       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+
+  /* We want to warn people about not seeing new paths after a full cycle,
+     except when resuming fuzzing or running in non-instrumented mode. */
+
+  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
+      in_bitmap || crash_mode)) {
+
+    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
+         DTD(cur_ms, last_path_time));
+
+  } else {
+
+    if (dumb_mode)
+
+      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
+           " (non-instrumented mode)        ");
+
+     else
+
+      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
+           "(odd, check syntax!)      ");
+
+  }
+
+  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
+       DI(queued_paths));
+
+  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
+     limit with a '+' appended to the count. */
+
+  sprintf(tmp, "%s%s", DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+
+  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
+       " uniq crashes : %s%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
+       tmp);
+
+  sprintf(tmp, "%s%s", DI(unique_hangs),
+         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+
+  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
+       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_hang_time), tmp);
+
+  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
+       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+
+  /* This gets funny because we want to print several variable-length variables
+     together, but then cram them into a fixed-width field - so we need to
+     put them in a temporary buffer first. */
+
+  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
+          queue_cur->favored ? "" : "*",
+          ((double)current_entry * 100) / (queued_paths - queued_archived));
+
+  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+
+  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
+          100 / MAP_SIZE, t_byte_ratio);
+
+  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
+       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
+          ((double)cur_skipped_paths * 100) / (queued_paths - queued_archived));
+
+  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+
+  sprintf(tmp, "%0.02f bits/tuple",
+          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+
+  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+
+  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
+       " findings in depth " bSTG bH20 bVL "\n");
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
+          ((double)queued_favored) * 100 / queued_paths);
+
+  /* Yeah... it's still going on... halp? */
+
+  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
+       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
+
+  if (!stage_max) {
+
+    sprintf(tmp, "%s/-", DI(stage_cur));
+
+  } else {
+
+    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
+            ((double)stage_cur) * 100 / stage_max);
+
+  }
+
+  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
+          ((double)queued_with_cov) * 100 / queued_paths);
+
+  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
+
+  if (crash_buckets)
+    sprintf(tmp, "%s (%s stacks)", DI(total_crashes), DI(bkt_count));
+  else
+    sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
+            (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+
+  if (crash_mode) {
+
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+
+  } else {
+
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+
+  }
+
+  /* Show a warning about slow execution. */
+
+  if (avg_exec < 100) {
+
+    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
+            "zzzz..." : "slow!");
+
+    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+
+  } else {
+
+    sprintf(tmp, "%s/sec", DF(avg_exec));
+    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+
+  }
+
+  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
+          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+
+  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+
+  /* Aaaalmost there... hold on! */
+
+  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
+       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
+
+  if (skip_deterministic) {
+
+    strcpy(tmp, "n/a, n/a, n/a");
+
+  } else {
+
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
+            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
+            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
+
+  }
+
+  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
+            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
+            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+
+  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
+            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
+            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+
+  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
+            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
+            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
+
+  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
+            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
+            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
+
+  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
+       "  imported : " cRST "%-10s " bSTG bV "\n", tmp,
+       sync_id ? DI(queued_imported) : (u8*)"n/a");
+
+  sprintf(tmp, "%s/%s, %s/%s",
+          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
+          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
 
-  /* Fields in the file:
+  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
 
-     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
-     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec */
+  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
+    else strcpy(tmp, "n/a");
 
-  fprintf(plot_file, 
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
-          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
-          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps); /* ignore errors */
+  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
+       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
+       ? cMGN : cRST), tmp);
 
-  fflush(plot_file);
+  /* The custom mutator and grammar stages get a line of their own; four
+     pairs of counters would not fit on the one above. */
 
-}
+  if (custom_fuzz || g_rules) {
 
+    tmp[0] = 0;
 
+    if (custom_fuzz)
+      sprintf(tmp, "%s/%s",
+              DI(stage_finds[STAGE_CUSTOM]), DI(stage_cycles[STAGE_CUSTOM]));
 
-/* A helper function for maybe_delete_out_dir(), deleting all prefixed
-   files in a directory. */
+    if (g_rules)
+      sprintf(tmp + strlen(tmp), "%s%s/%s", custom_fuzz ? ", " : "",
+              DI(stage_finds[STAGE_GRAMMAR]), DI(stage_cycles[STAGE_GRAMMAR]));
 
-static u8 delete_files(u8* path, u8* prefix) {
+    SAYF(bV bSTOP "%s : " cRST "%-37s " bSTG bV "%24s" bV "\n",
+         custom_fuzz ? (g_rules ? " custom/gram" : "      custom")
+                     : "     grammar", tmp, "");
 
-  DIR* d;
-  struct dirent* d_ent;
+  }
 
-  d = opendir(path);
+  if (!bytes_trim_out) {
 
-  if (!d) return 0;
+    sprintf(tmp, "n/a, ");
 
-  while ((d_ent = readdir(d))) {
+  } else {
 
-    if (d_ent->d_name[0] != '.' && (!prefix ||
-        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+    sprintf(tmp, "%0.02f%%/%s, ",
+            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
+            DI(trim_execs));
 
-      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
-      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
-      ck_free(fname);
+  }
 
-    }
+  if (!blocks_eff_total) {
 
-  }
+    u8 tmp2[128];
 
-  closedir(d);
+    sprintf(tmp2, "n/a");
+    strcat(tmp, tmp2);
 
-  return !!rmdir(path);
+  } else {
 
-}
+    u8 tmp2[128];
 
+    sprintf(tmp2, "%0.02f%%",
+            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
+            blocks_eff_total);
 
-/* Get the number of runnable processes, with some simple smoothing. */
+    strcat(tmp, tmp2);
 
-static double get_runnable_processes(void) {
+  }
 
-  static double res;
+  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
+       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+  /* Provide some CPU utilization stats. */
 
-  /* I don't see any portable sysctl or so that would quickly give us the
-     number of runnable processes; the 1-minute load average can be a
-     semi-decent approximation, though. */
+  if (cpu_core_count) {
 
-  if (getloadavg(&res, 1) != 1) return 0;
+    double cur_runnable = get_runnable_processes();
+    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
 
-#else
+    u8* cpu_color = cCYA;
 
-  /* On Linux, /proc/stat is probably the best way; load averages are
-     computed in funny ways and sometimes don't reflect extremely short-lived
-     processes well. */
+    /* If we could still run one or more processes, use green. */
 
-  FILE* f = fopen("/proc/stat", "r");
-  u8 tmp[1024];
-  u32 val = 0;
+    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
+      cpu_color = cLGN;
 
-  if (!f) return 0;
+    /* If we're clearly oversubscribed, use red. */
 
-  while (fgets(tmp, sizeof(tmp), f)) {
+    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
 
-    if (!strncmp(tmp, "procs_running ", 14) ||
-        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+#ifdef HAVE_AFFINITY
 
-  }
- 
-  fclose(f);
+    if (cpu_aff >= 0) {
 
-  if (!res) {
+      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
+           MIN(cpu_aff, 999), cpu_color,
+           MIN(cur_utilization, 999));
 
-    res = val;
+    } else {
 
-  } else {
+      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+           cpu_color, MIN(cur_utilization, 999));
+ 
+   }
 
-    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
-          ((double)val) * (1.0 / AVG_SMOOTHING);
+#else
 
-  }
+    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+         cpu_color, MIN(cur_utilization, 999));
 
-#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+#endif /* ^HAVE_AFFINITY */
 
-  return res;
+  } else SAYF("\r");
+
+  /* Hallelujah! */
+
+  fflush(0);
 
 }
 
 
-/* Delete the temporary directory used for in-place session resume. */
+/* Display quick statistics at the end of processing the input directory,
+   plus a bunch of warnings. Some calibration stuff also ended up here,
+   along with several hardcoded constants. Maybe clean up eventually. */
 
-static void nuke_resume_dir(void) {
+static void show_init_stats(void) {
 
-  u8* fn;
+  struct queue_entry* q = queue;
+  u32 min_bits = 0, max_bits = 0;
+  u64 min_us = 0, max_us = 0;
+  u64 avg_us = 0;
+  u32 max_len = 0;
 
-  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
 
-  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+  while (q) {
 
-  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (!min_us || q->exec_us < min_us) min_us = q->exec_us;
+    if (q->exec_us > max_us) max_us = q->exec_us;
 
-  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (!min_bits || q->bitmap_size < min_bits) min_bits = q->bitmap_size;
+    if (q->bitmap_size > max_bits) max_bits = q->bitmap_size;
 
-  fn = alloc_printf("%s/_resume/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (q->len > max_len) max_len = q->len;
 
-  fn = alloc_printf("%s/_resume", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    q = q->next;
 
-  return;
+  }
 
-dir_cleanup_failed:
+  SAYF("\n");
 
-  FATAL("_resume directory cleanup failed");
+  if (avg_us > (qemu_mode ? 50000 : 10000)) 
+    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
+          doc_path);
 
-}
+  /* Let's keep things moving with slow binaries. */
 
+  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
+  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
+  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
 
-/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
-   is not currently running, and if the last run time isn't too great. */
+  if (!resuming_fuzz) {
 
-static void maybe_delete_out_dir(void) {
+    if (max_len > 50 * 1024)
+      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
+            DMS(max_len), doc_path);
+    else if (max_len > 10 * 1024)
+      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
+            DMS(max_len), doc_path);
 
-  FILE* f;
-  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+    if (useless_at_start && !in_bitmap)
+      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
 
-  /* See if the output directory is locked. If yes, bail out. If not,
-     create a lock that will persist for the lifetime of the process
-     (this requires leaving the descriptor open).*/
+    if (queued_paths > 100)
+      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
+    else if (queued_paths > 20)
+      WARNF("You have lots of input files; try starting small.");
 
-  out_dir_fd = open(out_dir, O_RDONLY);
-  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+  }
 
-#ifndef __sun
+  OKF("Here are some useful stats:\n\n"
 
-  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
+      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
+      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
+      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
+      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
+      DI(min_us), DI(max_us), DI(avg_us));
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like the job output directory is being actively used by another\n"
-         "    instance of afl-fuzz. You will need to choose a different %s\n"
-         "    or stop the other process first.\n",
-         sync_id ? "fuzzer ID" : "output location");
+  if (!timeout_given) {
 
-    FATAL("Directory '%s' is in use", out_dir);
+    /* Figure out the appropriate timeout. The basic idea is: 5x average or
+       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
 
-  }
+       If the program is slow, the multiplier is lowered to 2x or 3x, because
+       random scheduler jitter is less likely to have any impact, and because
+       our patience is wearing thin =) */
 
-#endif /* !__sun */
+    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
+    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
+    else exec_tmout = avg_us * 5 / 1000;
 
-  f = fopen(fn, "r");
+    exec_tmout = MAX(exec_tmout, max_us / 1000);
+    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
 
-  if (f) {
+    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
 
-    u64 start_time, last_update;
+    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
+         exec_tmout);
 
-    if (fscanf(f, "start_time     : %llu\n"
-                  "last_update    : %llu\n", &start_time, &last_update) != 2)
-      FATAL("Malformed data in '%s'", fn);
+    timeout_given = 1;
 
-    fclose(f);
+  } else if (timeout_given == 3) {
 
-    /* Let's see how much work is at stake. */
+    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
 
-    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+  }
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The job output directory already exists and contains the results of more\n"
-           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
-           "    automatically delete this data for you.\n\n"
+  /* In dumb mode, re-running every timing out test case with a generous time
+     limit is very expensive, so let's select a more conservative default. */
 
-           "    If you wish to start a new session, remove or rename the directory manually,\n"
-           "    or specify a different output location for this job. To resume the old\n"
-           "    session, put '-' as the input directory in the command line ('-i -') and\n"
-           "    try again.\n", OUTPUT_GRACE);
+  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
+    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
 
-       FATAL("At-risk data found in '%s'", out_dir);
+  cur_tmout = exec_tmout;
 
-    }
+  OKF("All set and ready to roll!");
 
-  }
+}
+
+
+/* Find first power of two greater or equal to val (assuming val under
+   2^31). */
 
-  ck_free(fn);
+static u32 next_p2(u32 val) {
 
-  /* The idea for in-place resume is pretty simple: we temporarily move the old
-     queue/ to a new location that gets deleted once import to the new queue/
-     is finished. If _resume/ already exists, the current queue/ may be
-     incomplete due to an earlier abort, so we want to use the old _resume/
-     dir instead, and we let rename() fail silently. */
+  u32 ret = 1;
+  while (val > ret) ret <<= 1;
+  return ret;
 
-  if (in_place_resume) {
+} 
 
-    u8* orig_q = alloc_printf("%s/queue", out_dir);
 
-    in_dir = alloc_printf("%s/_resume", out_dir);
+/* Trim all new test cases to save cycles when doing deterministic checks. The
+   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
+   file size, to keep the stage short and sweet. */
 
-    rename(orig_q, in_dir); /* Ignore errors */
+static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
-    OKF("Output directory exists, will attempt session resume.");
+  static u8 tmp[64];
+  static u8 clean_trace[MAP_SIZE];
 
-    ck_free(orig_q);
+  u8  needs_write = 0, fault = 0;
+  u32 trim_exec = 0;
+  u32 remove_len;
+  u32 len_p2;
 
-  } else {
+  /* Although the trimmer will be less useful when variable behavior is
+     detected, it will still work to some extent, so we don't check for
+     this. */
 
-    OKF("Output directory exists but deemed OK to reuse.");
+  if (q->len < 5) return 0;
 
-  }
+  stage_name = tmp;
+  bytes_trim_in += q->len;
 
-  ACTF("Deleting old session data...");
+  /* Select initial chunk len, starting with large steps. */
 
-  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
-     in <out_dir>/.synced/.../id:*, if any are present. */
+  len_p2 = next_p2(q->len);
 
-  if (!in_place_resume) {
+  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
 
-    fn = alloc_printf("%s/.synced", out_dir);
-    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
-    ck_free(fn);
+  /* If the custom mutator knows how to trim, let it propose smaller variants
+     instead; they are kept under the same condition as below. */
 
-  }
+  if (custom_trim) {
 
-  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+    u32 step = 0;
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    strcpy(tmp, "custom trim");
 
-  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+    stage_cur = 0;
+    stage_max = CUSTOM_TRIM_MAX;
 
-  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    while (step < CUSTOM_TRIM_MAX) {
 
-  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+      u32 new_len = custom_trim(custom_data, in_buf, q->len, custom_bufs[0],
+                                step++);
+      u32 cksum;
 
-  /* Then, get rid of the .state subdirectory itself (should be empty by now)
-     and everything matching <out_dir>/queue/id:*. */
+      if (!new_len || new_len >= q->len) break;
 
-  fn = alloc_printf("%s/queue/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+      write_to_testcase(custom_bufs[0], new_len);
 
-  fn = alloc_printf("%s/queue", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+      fault = run_target(argv, exec_tmout);
+      trim_execs++;
 
-  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
 
-  if (!in_place_resume) {
+      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
 
-    fn = alloc_printf("%s/crashes/README.txt", out_dir);
-    unlink(fn); /* Ignore errors */
-    ck_free(fn);
+      if (cksum == q->exec_cksum) {
 
-  }
+        q->len = new_len;
+        memcpy(in_buf, custom_bufs[0], new_len);
 
-  fn = alloc_printf("%s/crashes", out_dir);
+        if (!needs_write) {
 
-  /* Make backup of the crashes directory if it's not empty and if we're
-     doing in-place resume. */
+          needs_write = 1;
+          memcpy(clean_trace, trace_bits, MAP_SIZE);
 
-  if (in_place_resume && rmdir(fn)) {
+        }
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+      }
 
-#ifndef SIMPLE_FILES
+      if (!(trim_exec++ % stats_update_freq)) show_stats();
+      stage_cur++;
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+    }
 
-#else
+    goto write_trimmed;
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+  }
 
-#endif /* ^!SIMPLE_FILES */
+  /* Continue until the number of steps gets too high or the stepover
+     gets too small. */
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
 
-  }
+    u32 remove_pos = remove_len;
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
 
-  fn = alloc_printf("%s/hangs", out_dir);
+    stage_cur = 0;
+    stage_max = q->len / remove_len;
 
-  /* Backup hangs, too. */
+    while (remove_pos < q->len) {
 
-  if (in_place_resume && rmdir(fn)) {
+      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
+      u32 cksum;
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
 
-#ifndef SIMPLE_FILES
+      fault = run_target(argv, exec_tmout);
+      trim_execs++;
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
 
-#else
+      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
 
-#endif /* ^!SIMPLE_FILES */
+      /* If the deletion had no impact on the trace, make it permanent. This
+         isn't perfect for variable-path inputs, but we're just making a
+         best-effort pass, so it's not a big deal if we end up with false
+         negatives every now and then. */
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+      if (cksum == q->exec_cksum) {
 
-  }
+        u32 move_tail = q->len - remove_pos - trim_avail;
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+        q->len -= trim_avail;
+        len_p2  = next_p2(q->len);
 
-  /* And now, for some finishing touches. */
+        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
+                move_tail);
 
-  fn = alloc_printf("%s/.cur_input", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+        /* Let's save a clean trace, which will be needed by
+           update_bitmap_score once we're done with the trimming stuff. */
 
-  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+        if (!needs_write) {
 
-  if (!in_place_resume) {
-    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
-    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-    ck_free(fn);
-  }
+          needs_write = 1;
+          memcpy(clean_trace, trace_bits, MAP_SIZE);
 
-  fn = alloc_printf("%s/plot_data", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+        }
 
-  OKF("Output dir cleanup successful.");
+      } else remove_pos += remove_len;
 
-  /* Wow... is that all? If yes, celebrate! */
+      /* Since this can be slow, update the screen every now and then. */
 
-  return;
+      if (!(trim_exec++ % stats_update_freq)) show_stats();
+      stage_cur++;
 
-dir_cleanup_failed:
+    }
 
-  SAYF("\n" cLRD "[-] " cRST
-       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
-       "    some files that shouldn't be there or that couldn't be removed - so it\n"
-       "    decided to abort! This happened while processing this path:\n\n"
+    remove_len >>= 1;
 
-       "    %s\n\n"
-       "    Please examine and manually delete the files, or specify a different\n"
-       "    output location for the tool.\n", fn);
+  }
 
-  FATAL("Output directory cleanup failed");
+write_trimmed:
 
-}
+  /* If we have made changes to in_buf, we also need to update the on-disk
+     version of the test case. */
 
+  if (needs_write) {
 
-static void check_term_size(void);
+    s32 fd;
 
+    unlink(q->fname); /* ignore errors */
 
-/* A spiffy retro stats screen! This is called every stats_update_freq
-   execve() calls, plus in several other circumstances. */
+    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
 
-static void show_stats(void) {
+    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
 
-  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
-  static double avg_exec;
-  double t_byte_ratio, stab_ratio;
+    ck_write(fd, in_buf, q->len, q->fname);
+    close(fd);
 
-  u64 cur_ms;
-  u32 t_bytes, t_bits;
+    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    update_bitmap_score(q);
 
-  u32 banner_len, banner_pad;
-  u8  tmp[256];
+  }
 
-  cur_ms = get_cur_time();
+abort_trimming:
 
-  /* If not enough time has passed since last UI update, bail out. */
+  bytes_trim_out += q->len;
+  return fault;
 
-  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+}
 
-  /* Check if we're past the 10 minute mark. */
 
-  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+/* Tell the v2 postprocessor machinery about the input that the current
+   stage mutates. If the library declares ranges and the input is a fixed
+   point of the postprocessor (true for anything it saved to the queue, but
+   not necessarily for trimmed or spliced data), mutations that leave those
+   ranges alone don't need postprocessing. Called with NULL to disable. */
 
-  /* Calculate smoothed exec speed stats. */
+static void post_set_reference(u8* buf, u32 len) {
 
-  if (!last_execs) {
-  
-    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+  post_ref_buf = NULL;
 
-  } else {
+  if (!post_ranges || !buf) return;
 
-    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
-                     (cur_ms - last_ms);
+  memcpy(post_buf, buf, len);
+  post_handler_v2(post_buf, len);
 
-    /* If there is a dramatic (5x+) jump in speed, reset the indicator
-       more quickly. */
+  if (memcmp(post_buf, buf, len)) return;
 
-    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
-      avg_exec = cur_avg;
+  post_range_cnt = post_ranges(buf, len, post_range, POST_MAX_RANGES);
+  if (post_range_cnt > POST_MAX_RANGES) return;
 
-    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
-               cur_avg * (1.0 / AVG_SMOOTHING);
+  post_ref_buf = buf;
+  post_ref_len = len;
 
-  }
+}
 
-  last_ms = cur_ms;
-  last_execs = total_execs;
 
-  /* Tell the callers when to contact us (as measured in execs). */
+/* Check if a mutated buffer differs from the reference input only outside
+   of the declared ranges. */
 
-  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
-  if (!stats_update_freq) stats_update_freq = 1;
+static u8 post_can_bypass(u8* buf, u32 len) {
 
-  /* Do some bitmap stats. */
+  u32 i;
 
-  t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  if (!post_ref_buf || len != post_ref_len) return 0;
 
-  if (t_bytes) 
-    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
-  else
-    stab_ratio = 100;
+  for (i = 0; i < post_range_cnt; i++) {
 
-  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+    u32 start = post_range[i * 2], end = post_range[i * 2 + 1];
 
-  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+    if (end > len) end = len;
+    if (start >= end) continue;
 
-    last_stats_ms = cur_ms;
-    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
-    save_auto();
-    write_bitmap();
+    if (memcmp(buf + start, post_ref_buf + start, end - start)) return 0;
 
   }
 
-  /* Every now and then, write plot data. */
+  return 1;
 
-  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+}
 
-    last_plot_ms = cur_ms;
-    maybe_update_plot_file(t_byte_ratio, avg_exec);
- 
-  }
 
-  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+/* Record the input in the AFL_DEDUP_EXECS Bloom filter. Returns 1 if it
+   was (probably) there already. hash32() ignores the trailing len % 8 bytes,
+   so these are folded in separately. Once the filter gets too full for the
+   false positive rate to stay negligible, it is simply cleared. */
 
-  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
-      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+static u8 dedup_check(u8* buf, u32 len) {
 
-  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+  u64 tail = 0;
+  u32 h1, h2, i;
+  u8  seen = 1;
 
-  /* If we're not on TTY, bail out. */
+  if (!dedup_bloom) dedup_bloom = ck_alloc(DEDUP_BLOOM_SIZE >> 3);
 
-  if (not_on_tty) return;
+  memcpy(&tail, buf + (len & ~7), len & 7);
 
-  /* Compute some mildly useful bitmap stats. */
+  h1 = hash32(&tail, sizeof(tail), hash32(buf, len, HASH_CONST));
+  h2 = hash32(&tail, sizeof(tail), hash32(buf, len, ~HASH_CONST)) | 1;
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  for (i = 0; i < DEDUP_BLOOM_HASHES; i++) {
 
-  /* Now, for the visuals... */
+    u32 bit = (h1 + i * h2) & (DEDUP_BLOOM_SIZE - 1);
 
-  if (clear_screen) {
+    if (!(dedup_bloom[bit >> 3] & (1 << (bit & 7)))) {
 
-    SAYF(TERM_CLEAR CURSOR_HIDE);
-    clear_screen = 0;
+      dedup_bloom[bit >> 3] |= 1 << (bit & 7);
+      dedup_fill++;
+      seen = 0;
 
-    check_term_size();
+    }
 
   }
 
-  SAYF(TERM_HOME);
+  if (dedup_fill > DEDUP_BLOOM_SIZE / DEDUP_BLOOM_FILL) {
 
-  if (term_too_small) {
+    memset(dedup_bloom, 0, DEDUP_BLOOM_SIZE >> 3);
+    dedup_fill = 0;
 
-    SAYF(cBRI "Your terminal is too small to display the UI.\n"
-         "Please resize terminal window to at least 80x25.\n" cRST);
+  }
 
-    return;
+  return seen;
 
-  }
+}
 
-  /* Let's start by drawing a centered banner. */
 
-  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
-  banner_pad = (80 - banner_len) / 2;
-  memset(tmp, ' ', banner_pad);
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
 
-  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN
-          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
-          cYEL "american fuzzy lop", use_banner);
+EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
-  SAYF("\n%s\n\n", tmp);
+  u8 fault;
 
-  /* "Handy" shortcuts for drawing boxes... */
+  if (post_handler) {
 
-#define bSTG    bSTART cGRA
-#define bH2     bH bH
-#define bH5     bH2 bH2 bH
-#define bH10    bH5 bH5
-#define bH20    bH10 bH10
-#define bH30    bH20 bH10
-#define SP5     "     "
-#define SP10    SP5 SP5
-#define SP20    SP10 SP10
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len) return 0;
 
-  /* Lord, forgive me this. */
+  }
 
-  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
-       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+  if (post_handler_v2) {
 
-  if (dumb_mode) {
+    post_calls++;
 
-    strcpy(tmp, cRST);
+    if (post_can_bypass(out_buf, len)) {
 
-  } else {
+      post_bypassed++;
 
-    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+    } else {
 
-    /* First queue cycle: don't stop now! */
-    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
+      /* The stages before the custom mutator - the deterministic ones and
+         the dictionary insertions - expect out_buf back unchanged, since
+         they undo their own changes, so these need a copy. Custom mutator,
+         grammar, havoc, and splice outputs are rebuilt from scratch after
+         every exec. (Inputs imported from other fuzzers never get here;
+         sync_fuzzers() runs them as they are.) */
 
-    /* Subsequent cycles, but we're still making finds. */
-    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
+      if (!post_in_place) {
+        memcpy(post_buf, out_buf, len);
+        out_buf = post_buf;
+      }
 
-    /* No finds for a long time and no test cases to try. */
-    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
-      strcpy(tmp, cLGN);
+      if (!post_handler_v2(out_buf, len)) return 0;
 
-    /* Default: cautiously OK to stop? */
-    else strcpy(tmp, cLBL);
+    }
 
   }
 
-  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
-       "  cycles done : %s%-5s  " bSTG bV "\n",
-       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
-
-  /* We want to warn people about not seeing new paths after a full cycle,
-     except when resuming fuzzing or running in non-instrumented mode. */
+  if (dedup_execs && dedup_check(out_buf, len) && !dedup_no_skip) {
 
-  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
-      in_bitmap || crash_mode)) {
+    dedup_hits++;
+    return 0;
 
-    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
-         DTD(cur_ms, last_path_time));
+  }
 
-  } else {
+  write_to_testcase(out_buf, len);
 
-    if (dumb_mode)
+  fault = run_target(argv, cur_tmout);
 
-      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
-           " (non-instrumented mode)        ");
+  if (stop_soon) return 1;
 
-     else
+  if (fault == FAULT_TMOUT && cur_tmout < exec_tmout) {
 
-      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
-           "(odd, check syntax!)      ");
+    fault = recheck_tmout(argv, out_buf, len);
+    if (stop_soon) return 1;
 
   }
 
-  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
-       DI(queued_paths));
+  if (fault == FAULT_TMOUT) {
 
-  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
-     limit with a '+' appended to the count. */
+    if (subseq_tmouts++ > TMOUT_LIMIT) {
+      cur_skipped_paths++;
+      return 1;
+    }
 
-  sprintf(tmp, "%s%s", DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+  } else subseq_tmouts = 0;
 
-  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
-       " uniq crashes : %s%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
-       tmp);
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
 
-  sprintf(tmp, "%s%s", DI(unique_hangs),
-         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  if (skip_requested) {
 
-  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
-       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_hang_time), tmp);
+     skip_requested = 0;
+     cur_skipped_paths++;
+     return 1;
 
-  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
-       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+  }
 
-  /* This gets funny because we want to print several variable-length variables
-     together, but then cram them into a fixed-width field - so we need to
-     put them in a temporary buffer first. */
+  /* This handles FAULT_ERROR for us: */
 
-  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
-          queue_cur->favored ? "" : "*",
-          ((double)current_entry * 100) / queued_paths);
+  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
 
-  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
 
-  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+  return 0;
 
-  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
-       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+}
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
-          ((double)cur_skipped_paths * 100) / queued_paths);
 
-  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+/* Structure inference for AFL_STRUCT_FIXUPS. Fields are read and written in
+   either byte order, 1, 2 or 4 bytes wide. */
 
-  sprintf(tmp, "%0.02f bits/tuple",
-          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+static u32 fix_read(u8* buf, u32 pos, u8 width, u8 big_endian) {
 
-  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+  u32 ret = 0, i;
 
-  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
-       " findings in depth " bSTG bH20 bVL "\n");
+  for (i = 0; i < width; i++) {
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
-          ((double)queued_favored) * 100 / queued_paths);
+    u32 b = big_endian ? i : width - 1 - i;
+    ret = (ret << 8) | buf[pos + b];
 
-  /* Yeah... it's still going on... halp? */
+  }
 
-  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
-       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
+  return ret;
 
-  if (!stage_max) {
+}
 
-    sprintf(tmp, "%s/-", DI(stage_cur));
 
-  } else {
+static void fix_write(u8* buf, u32 pos, u8 width, u8 big_endian, u32 val) {
 
-    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
-            ((double)stage_cur) * 100 / stage_max);
+  u32 i;
 
-  }
+  for (i = 0; i < width; i++) {
 
-  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
+    u32 b = big_endian ? width - 1 - i : i;
+    buf[pos + b] = val >> (i * 8);
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
-          ((double)queued_with_cov) * 100 / queued_paths);
+  }
 
-  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
+}
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
 
-  if (crash_mode) {
+/* Feed more data to a running CRC32 (start with 0xffffffff, invert at the
+   end). */
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+static u32 crc32_update(u32 crc, u8* buf, u32 len) {
 
-  } else {
+  static u32 crc_table[256];
+  u32 i;
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+  if (!crc_table[1])
+    for (i = 0; i < 256; i++) {
 
-  }
+      u32 c = i, k;
 
-  /* Show a warning about slow execution. */
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
 
-  if (avg_exec < 100) {
+      crc_table[i] = c;
 
-    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
-            "zzzz..." : "slow!");
+    }
 
-    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+  for (i = 0; i < len; i++)
+    crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
 
-  } else {
+  return crc;
 
-    sprintf(tmp, "%s/sec", DF(avg_exec));
-    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+}
 
-  }
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
-          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+/* Compute a checksum of a given type over a buffer, truncated to the width
+   of the field it is stored in. */
 
-  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+static u32 fix_checksum(u8 type, u8 width, u8* buf, u32 len) {
 
-  /* Aaaalmost there... hold on! */
+  u32 i, ret;
 
-  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
-       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
+  switch (type) {
 
-  if (skip_deterministic) {
+    case FIX_CRC32:
 
-    strcpy(tmp, "n/a, n/a, n/a");
+      return ~crc32_update(0xffffffff, buf, len);
 
-  } else {
+    case FIX_ADLER32: {
 
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
-            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
-            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
+        u32 a = 1, b = 0;
 
-  }
+        for (i = 0; i < len; i++) {
+          a = (a + buf[i]) % 65521;
+          b = (b + a) % 65521;
+        }
 
-  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+        return (b << 16) | a;
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
-            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
-            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+      }
 
-  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
+    default:
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
-            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
-            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+      for (ret = i = 0; i < len; i++) ret += buf[i];
 
-  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+      return width == 4 ? ret : ret & ((1 << (width * 8)) - 1);
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
-            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
-            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
+  }
 
-  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
+}
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
-            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
-            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
 
-  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
-       "  imported : " cRST "%-10s " bSTG bV "\n", tmp,
-       sync_id ? DI(queued_imported) : (u8*)"n/a");
+/* Check whether the target actually looks at a candidate field: bump its
+   value by one and see if the execution path changes. */
 
-  sprintf(tmp, "%s/%s, %s/%s",
-          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
-          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
+static u8 struct_check(char** argv, u8* buf, u8* tmp, u32 len,
+                       struct fixup* f) {
 
-  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
+  u8 fault;
 
-  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
-    else strcpy(tmp, "n/a");
+  memcpy(tmp, buf, len);
 
-  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
-       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
-       ? cMGN : cRST), tmp);
+  fix_write(tmp, f->pos, f->width, f->big_endian,
+            fix_read(buf, f->pos, f->width, f->big_endian) + 1);
 
-  if (!bytes_trim_out) {
+  write_to_testcase(tmp, len);
 
-    sprintf(tmp, "n/a, ");
+  fault = run_target(argv, exec_tmout);
 
-  } else {
+  if (stop_soon) return 0;
 
-    sprintf(tmp, "%0.02f%%/%s, ",
-            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
-            DI(trim_execs));
+  return fault != crash_mode ||
+         hash32(trace_bits, MAP_SIZE, HASH_CONST) != queue_cur->exec_cksum;
 
-  }
+}
 
-  if (!blocks_eff_total) {
 
-    u8 tmp2[128];
+/* Does a candidate overlap a field we already have? */
 
-    sprintf(tmp2, "n/a");
-    strcat(tmp, tmp2);
+static u8 struct_overlap(struct fixup* found, u32 cnt, u32 pos, u8 width) {
 
-  } else {
+  u32 i;
 
-    u8 tmp2[128];
+  for (i = 0; i < cnt; i++)
+    if (pos < found[i].pos + found[i].width && found[i].pos < pos + width)
+      return 1;
 
-    sprintf(tmp2, "%0.02f%%",
-            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
-            blocks_eff_total);
+  return 0;
 
-    strcat(tmp, tmp2);
+}
 
-  }
 
-  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
-       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
+/* Try to add a candidate, spending one exec to confirm it. Returns 0 once
+   the budget is gone or there is no room left. */
 
-  /* Provide some CPU utilization stats. */
+static u8 struct_try(char** argv, u8* buf, u8* tmp, u32 len,
+                     struct fixup* found, u32* cnt, u32* budget,
+                     struct fixup* f) {
 
-  if (cpu_core_count) {
+  if (!*budget || *cnt == STRUCT_MAX_FIELDS || stop_soon) return 0;
 
-    double cur_runnable = get_runnable_processes();
-    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
+  if (struct_overlap(found, *cnt, f->pos, f->width)) return 1;
 
-    u8* cpu_color = cCYA;
+  (*budget)--;
 
-    /* If we could still run one or more processes, use green. */
+  if (struct_check(argv, buf, tmp, len, f)) found[(*cnt)++] = *f;
 
-    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
-      cpu_color = cLGN;
+  return 1;
 
-    /* If we're clearly oversubscribed, use red. */
+}
 
-    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
 
-#ifdef HAVE_AFFINITY
+/* Look for length fields and checksums in the current entry, using at most
+   STRUCT_INFER_EXECS execs. Length fields are values that match the size of
+   the rest of the input, of the whole input, or of a region that follows
+   them (possibly after a 4-byte type tag). Checksums are CRC32, Adler-32 or
+   plain byte sums that match the bytes before or after them, or the region
+   described by a length field right in front of them. Candidates are kept
+   only if changing them changes the execution path. */
 
-    if (cpu_aff >= 0) {
+static void infer_structure(char** argv, u8* buf, u32 len) {
 
-      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
-           MIN(cpu_aff, 999), cpu_color,
-           MIN(cur_utilization, 999));
+  static const u8 widths[] = { 4, 2, 1 };
+  static const u8 types[]  = { FIX_CRC32, FIX_ADLER32, FIX_SUM, FIX_SUM };
+  static const u8 twidth[] = { 4, 4, 4, 2 };
 
-    } else {
+  struct fixup found[STRUCT_MAX_FIELDS], f;
+  u32 cnt = 0, budget = STRUCT_INFER_EXECS, orig_cnt, pass, p, i, j;
+  u64 *ps, *pis;
+  u32 crc_run = 0xffffffff, crc_pos = 0;
+  u8* tmp;
 
-      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-           cpu_color, MIN(cur_utilization, 999));
- 
-   }
+  queue_cur->fix_done = 1;
 
-#else
+  if (len < 8 || len > STRUCT_MAX_LEN || queue_cur->var_behavior) return;
 
-    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-         cpu_color, MIN(cur_utilization, 999));
+  tmp = ck_alloc_nozero(len);
 
-#endif /* ^HAVE_AFFINITY */
+  stage_name  = "struct infer";
+  stage_short = "struct";
 
-  } else SAYF("\r");
+  /* Length fields. The first pass looks for fields that cover the rest of
+     the input, or all of it; the second for ones describing regions inside
+     it or following a type tag, which are a lot more likely to match by
+     accident. */
 
-  /* Hallelujah! */
+  for (pass = 0; pass < 2; pass++)
+    for (p = 0; p < len; p++)
+      for (i = 0; i < sizeof(widths); i++)
+        for (j = 0; j < 2; j++) {
 
-  fflush(0);
+          u8  w = widths[i], skip;
+          u32 v;
 
-}
+          if (p + w > len || (w == 1 && j) || (pass && w == 1)) continue;
 
+          v = fix_read(buf, p, w, j);
 
-/* Display quick statistics at the end of processing the input directory,
-   plus a bunch of warnings. Some calibration stuff also ended up here,
-   along with several hardcoded constants. Maybe clean up eventually. */
+          memset(&f, 0, sizeof(f));
+          f.type = FIX_LEN;
+          f.pos = p;
+          f.size = v;
+          f.width = w;
+          f.big_endian = j;
 
-static void show_init_stats(void) {
+          for (skip = 0; skip <= 4 * pass; skip += 4) {
 
-  struct queue_entry* q = queue;
-  u32 min_bits = 0, max_bits = 0;
-  u64 min_us = 0, max_us = 0;
-  u64 avg_us = 0;
-  u32 max_len = 0;
+            f.rs = p + w + skip;
+            f.re = f.rs + v;
 
-  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
+            if (v < STRUCT_MIN_REGION || v > len || f.re > len) continue;
 
-  while (q) {
+            if (pass ? (skip || f.re < len) : f.re == len) {
 
-    if (!min_us || q->exec_us < min_us) min_us = q->exec_us;
-    if (q->exec_us > max_us) max_us = q->exec_us;
+              if (!struct_try(argv, buf, tmp, len, found, &cnt, &budget, &f))
+                goto checksums;
 
-    if (!min_bits || q->bitmap_size < min_bits) min_bits = q->bitmap_size;
-    if (q->bitmap_size > max_bits) max_bits = q->bitmap_size;
+              break;
 
-    if (q->len > max_len) max_len = q->len;
+            }
 
-    q = q->next;
+          }
 
-  }
+          if (!pass && v == len && w > 1) {
 
-  SAYF("\n");
+            f.rs = 0;
+            f.re = len;
 
-  if (avg_us > (qemu_mode ? 50000 : 10000)) 
-    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
-          doc_path);
+            if (!struct_try(argv, buf, tmp, len, found, &cnt, &budget, &f))
+              goto checksums;
 
-  /* Let's keep things moving with slow binaries. */
+          }
 
-  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
-  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
-  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
+        }
 
-  if (!resuming_fuzz) {
+checksums:
 
-    if (max_len > 50 * 1024)
-      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
-            DMS(max_len), doc_path);
-    else if (max_len > 10 * 1024)
-      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
-            DMS(max_len), doc_path);
+  orig_cnt = cnt;
 
-    if (useless_at_start && !in_bitmap)
-      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
+  /* Prefix sums of x and i * x, so that byte sums and Adler-32 over any
+     region come out in O(1). */
 
-    if (queued_paths > 100)
-      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
-    else if (queued_paths > 20)
-      WARNF("You have lots of input files; try starting small.");
+  ps  = ck_alloc((len + 1) * sizeof(u64));
+  pis = ck_alloc((len + 1) * sizeof(u64));
 
+  for (p = 0; p < len; p++) {
+    ps[p + 1]  = ps[p] + buf[p];
+    pis[p + 1] = pis[p] + (u64)p * buf[p];
   }
 
-  OKF("Here are some useful stats:\n\n"
+  for (p = 0; p + 2 <= len && budget && cnt < STRUCT_MAX_FIELDS; p++) {
 
-      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
-      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
-      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
-      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
-      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
-      DI(min_us), DI(max_us), DI(avg_us));
+    u32 rs[2 + 2 * STRUCT_MAX_FIELDS], re[2 + 2 * STRUCT_MAX_FIELDS];
+    u32 r, r_cnt = 0;
 
-  if (!timeout_given) {
+    /* Keep a running CRC of everything before p. */
 
-    /* Figure out the appropriate timeout. The basic idea is: 5x average or
-       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
+    crc_run = crc32_update(crc_run, buf + crc_pos, p - crc_pos);
+    crc_pos = p;
 
-       If the program is slow, the multiplier is lowered to 2x or 3x, because
-       random scheduler jitter is less likely to have any impact, and because
-       our patience is wearing thin =) */
+    rs[r_cnt] = 0; re[r_cnt++] = p;
 
-    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
-    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
-    else exec_tmout = avg_us * 5 / 1000;
+    for (i = 0; i < orig_cnt; i++)
+      if (found[i].re == p) {
+        rs[r_cnt] = found[i].pos + found[i].width; re[r_cnt++] = p;
+        if (found[i].rs != rs[r_cnt - 1]) {
+          rs[r_cnt] = found[i].rs; re[r_cnt++] = p;
+        }
+      }
 
-    exec_tmout = MAX(exec_tmout, max_us / 1000);
-    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+    for (i = 0; i < sizeof(types); i++) {
 
-    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
+      u8 w = twidth[i];
 
-    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
-         exec_tmout);
+      if (p + w > len) continue;
 
-    timeout_given = 1;
+      /* Last but not least, the rest of the input after the field. */
 
-  } else if (timeout_given == 3) {
+      rs[r_cnt] = p + w; re[r_cnt] = len;
 
-    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
+      for (r = 0; r <= r_cnt; r++) {
 
-  }
+        u32 s = rs[r], e = re[r], sum;
 
-  /* In dumb mode, re-running every timing out test case with a generous time
-     limit is very expensive, so let's select a more conservative default. */
+        if (e - s < STRUCT_MIN_REGION) continue;
 
-  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
-    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
+        switch (types[i]) {
 
-  OKF("All set and ready to roll!");
+          case FIX_CRC32:
 
-}
+            /* The CRC of the prefix is already there; suffix CRCs cost
+               O(len) each, so only look for those in the header. */
 
+            if (!r) { sum = ~crc_run; break; }
+            if (r == r_cnt && p >= STRUCT_HDR_MAX) continue;
 
-/* Find first power of two greater or equal to val (assuming val under
-   2^31). */
+            sum = fix_checksum(FIX_CRC32, 4, buf + s, e - s);
+            break;
 
-static u32 next_p2(u32 val) {
+          case FIX_ADLER32: {
+              u64 sx = ps[e] - ps[s];
+              u64 b  = (e - s) + e * sx - (pis[e] - pis[s]);
+              sum = ((b % 65521) << 16) | ((1 + sx) % 65521);
+              break;
+            }
 
-  u32 ret = 1;
-  while (val > ret) ret <<= 1;
-  return ret;
+          default:
+            sum = ps[e] - ps[s];
+            if (w < 4) sum &= (1 << (w * 8)) - 1;
 
-} 
+        }
 
+        for (j = 0; j < 2; j++) {
 
-/* Trim all new test cases to save cycles when doing deterministic checks. The
-   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
-   file size, to keep the stage short and sweet. */
+          if (fix_read(buf, p, w, j) != sum) continue;
+          if (types[i] == FIX_SUM && !sum) continue;
 
-static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
+          memset(&f, 0, sizeof(f));
+          f.type = types[i];
+          f.pos = p;
+          f.width = w;
+          f.big_endian = j;
+          f.rs = s;
+          f.re = e;
 
-  static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+          if (!struct_try(argv, buf, tmp, len, found, &cnt, &budget, &f))
+            goto done;
 
-  u8  needs_write = 0, fault = 0;
-  u32 trim_exec = 0;
-  u32 remove_len;
-  u32 len_p2;
+          break;
 
-  /* Although the trimmer will be less useful when variable behavior is
-     detected, it will still work to some extent, so we don't check for
-     this. */
+        }
 
-  if (q->len < 5) return 0;
+      }
 
-  stage_name = tmp;
-  bytes_trim_in += q->len;
+    }
 
-  /* Select initial chunk len, starting with large steps. */
+  }
 
-  len_p2 = next_p2(q->len);
+done:
 
-  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
+  ck_free(ps);
+  ck_free(pis);
+  ck_free(tmp);
 
-  /* Continue until the number of steps gets too high or the stepover
-     gets too small. */
+  if (cnt) {
 
-  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
+    queue_cur->fixups  = ck_alloc(cnt * sizeof(struct fixup));
+    queue_cur->fix_cnt = cnt;
+    memcpy(queue_cur->fixups, found, cnt * sizeof(struct fixup));
 
-    u32 remove_pos = remove_len;
+    struct_fields += cnt;
 
-    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
+  }
 
-    stage_cur = 0;
-    stage_max = q->len / remove_len;
+}
 
-    while (remove_pos < q->len) {
 
-      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
-      u32 cksum;
+/* Start tracking the fields of the current entry for a new havoc exec. */
 
-      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
+static void fix_begin(void) {
 
-      fault = run_target(argv, exec_tmout);
-      trim_execs++;
+  fix_cur_cnt = queue_cur->fix_cnt;
+  memcpy(fix_cur, queue_cur->fixups, fix_cur_cnt * sizeof(struct fixup));
 
-      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
+}
 
-      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+/* Move an offset to account for delta bytes inserted (delta > 0) or deleted
+   (delta < 0) at a given position. Bytes inserted right at the start of a
+   region go into it, so region starts stay put. */
 
-      /* If the deletion had no impact on the trace, make it permanent. This
-         isn't perfect for variable-path inputs, but we're just making a
-         best-effort pass, so it's not a big deal if we end up with false
-         negatives every now and then. */
+static u32 fix_move(u32 x, u32 at, s32 delta, u8 start) {
 
-      if (cksum == q->exec_cksum) {
+  if (delta > 0) return (start ? x > at : x >= at) ? x + delta : x;
 
-        u32 move_tail = q->len - remove_pos - trim_avail;
+  if (x >= at - delta) return x + delta;
 
-        q->len -= trim_avail;
-        len_p2  = next_p2(q->len);
+  return x > at ? at : x;
 
-        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
-                move_tail);
+}
 
-        /* Let's save a clean trace, which will be needed by
-           update_bitmap_score once we're done with the trimming stuff. */
 
-        if (!needs_write) {
+/* Update the tracked fields after havoc inserts or deletes bytes. Fields
+   whose own bytes are hit are dropped for the rest of this exec. Length
+   values follow their region; checksums cover the shifted region. */
 
-          needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+static void fix_shift(u32 at, s32 delta) {
 
-        }
+  u32 i;
 
-      } else remove_pos += remove_len;
+  for (i = 0; i < fix_cur_cnt; i++) {
 
-      /* Since this can be slow, update the screen every now and then. */
+    struct fixup* f = &fix_cur[i];
 
-      if (!(trim_exec++ % stats_update_freq)) show_stats();
-      stage_cur++;
+    if (delta > 0 ? (at > f->pos && at < f->pos + f->width) :
+                    (at < f->pos + f->width && f->pos < at - delta)) {
+
+      fix_cur[i--] = fix_cur[--fix_cur_cnt];
+      continue;
 
     }
 
-    remove_len >>= 1;
+    f->pos = fix_move(f->pos, at, delta, 0);
+    f->rs  = fix_move(f->rs, at, delta, 1);
+    f->re  = fix_move(f->re, at, delta, 0);
 
   }
 
-  /* If we have made changes to in_buf, we also need to update the on-disk
-     version of the test case. */
+}
 
-  if (needs_write) {
 
-    s32 fd;
+/* Patch the tracked fields into the havoc output before it is run. Length
+   fields are only rewritten if their region changed size, so that havoc can
+   still try odd values in them; checksums are always recomputed. */
 
-    unlink(q->fname); /* ignore errors */
+static void fix_apply(u8* buf, u32 len) {
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  u8  changed = 0;
+  u32 i, pass;
 
-    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
+  for (pass = 0; pass < 2; pass++)
+    for (i = 0; i < fix_cur_cnt; i++) {
 
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+      struct fixup* f = &fix_cur[i];
+      u32 val, old;
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
-    update_bitmap_score(q);
+      if ((f->type == FIX_LEN) != !pass) continue;
+      if (f->pos + f->width > len || f->re > len || f->rs > f->re) continue;
 
-  }
+      old = fix_read(buf, f->pos, f->width, f->big_endian);
 
-abort_trimming:
+      if (f->type == FIX_LEN) {
 
-  bytes_trim_out += q->len;
-  return fault;
+        val = f->re - f->rs;
+        if (val == f->size) continue;
+        if (f->width < 4 && val >> (f->width * 8)) continue;
 
-}
+      } else val = fix_checksum(f->type, f->width, buf + f->rs, f->re - f->rs);
 
+      if (val != old) {
+        fix_write(buf, f->pos, f->width, f->big_endian, val);
+        changed = 1;
+      }
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+    }
 
-EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+  if (changed) fix_applied++;
 
-  u8 fault;
+}
 
-  if (post_handler) {
 
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len) return 0;
+/* Pick a splicing partner for the current entry from the favored entries
+   indexed by cull_queue(), preferring one whose trace covers edges the
+   current entry does not reach; splicing two inputs that exercise the same
+   code mostly produces near-duplicates. Most entries that are not favored
+   no longer have a trace_mini, so for these, we run the entry once per
+   fuzz_one() call to get one. Returns NULL if nothing suitable turns up in
+   a few tries. */
 
-  }
+static struct queue_entry* pick_splice_partner(char** argv, u8* buf,
+                                               u32 len) {
 
-  write_to_testcase(out_buf, len);
+  u64* cur_mini = (u64*)queue_cur->trace_mini;
+  u32 i;
 
-  fault = run_target(argv, exec_tmout);
+  if (!splice_pool_cnt) return NULL;
 
-  if (stop_soon) return 1;
+  if (!cur_mini) {
 
-  if (fault == FAULT_TMOUT) {
+    if (!splice_mini_ok) {
 
-    if (subseq_tmouts++ > TMOUT_LIMIT) {
-      cur_skipped_paths++;
-      return 1;
-    }
+      write_to_testcase(buf, len);
+      run_target(argv, exec_tmout);
 
-  } else subseq_tmouts = 0;
+      if (stop_soon) return NULL;
 
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+      memset(splice_mini, 0, sizeof(splice_mini));
+      minimize_bits(splice_mini, trace_bits);
+      splice_mini_ok = 1;
 
-  if (skip_requested) {
+    }
 
-     skip_requested = 0;
-     cur_skipped_paths++;
-     return 1;
+    cur_mini = (u64*)splice_mini;
 
   }
 
-  /* This handles FAULT_ERROR for us: */
+  for (i = 0; i < SPLICE_PICK_TRIES; i++) {
 
-  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+    struct queue_entry* q = splice_pool[UR(splice_pool_cnt)];
+    u64* mini = (u64*)q->trace_mini;
+    u32 j;
 
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+    if (q == queue_cur || q->len < 2) continue;
 
-  return 0;
+    /* trace_mini is dropped for entries that lost all their top_rated[]
+       slots since the last cull. */
+
+    if (!mini) continue;
+
+    for (j = 0; j < (MAP_SIZE >> 6); j++)
+      if (mini[j] & ~cur_mini[j]) return q;
+
+  }
+
+  return NULL;
 
 }
 
@@ -4801,6 +7610,58 @@ static u32 calculate_score(struct queue_entry* q) {
 
   }
 
+  /* Power schedules scale the score down for paths that have been exercised
+     too often, and up again as the entry itself gets fuzzed repeatedly
+     without turning up anything. The default, exploit, keeps the classic
+     score as-is. */
+
+  if (schedule != SCHED_EXPLOIT) {
+
+    u32 raw_hits = n_fuzz[q->exec_cksum & ((1 << N_FUZZ_SIZE_POW2) - 1)];
+    u32 hits = raw_hits ? raw_hits : 1;
+    u32 factor = POWER_MAX_FACTOR;
+
+    switch (schedule) {
+
+      case SCHED_EXPLORE:
+
+        factor = 1;
+        break;
+
+      case SCHED_FAST:
+
+        if (q->fuzz_level < 16) factor = (1 << q->fuzz_level) / hits;
+        else factor = POWER_MAX_FACTOR / hits;
+        break;
+
+      case SCHED_COE: {
+
+          struct queue_entry* qe = queue;
+          u64 hits_total = 0;
+
+          while (qe) {
+            hits_total += n_fuzz[qe->exec_cksum & ((1 << N_FUZZ_SIZE_POW2) - 1)];
+            qe = qe->next;
+          }
+
+          /* Paths exercised more often than average get no energy at all. */
+
+          if (raw_hits > hits_total / (queued_paths - queued_archived))
+            factor = 0;
+          else if (q->fuzz_level < 16) factor = 1 << q->fuzz_level;
+
+        }
+
+        break;
+
+    }
+
+    if (factor > POWER_MAX_FACTOR) factor = POWER_MAX_FACTOR;
+
+    perf_score = (u64)perf_score * factor / POWER_MAX_FACTOR;
+
+  }
+
   /* Make sure that we don't go over limit. */
 
   if (perf_score > HAVOC_MAX_MULT * 100) perf_score = HAVOC_MAX_MULT * 100;
@@ -5005,7 +7866,7 @@ static u8 fuzz_one(char** argv) {
   s32 len, fd, temp_len, i, j;
   u8  *in_buf, *out_buf, *orig_in, *ex_tmp, *eff_map = 0;
   u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
-  u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
+  u32 splice_cycle = 0, perf_score = 100, orig_perf = 100, prev_cksum, eff_cnt = 1;
 
   u8  ret_val = 1, doing_det = 0;
 
@@ -5021,7 +7882,11 @@ static u8 fuzz_one(char** argv) {
 
 #else
 
-  if (pending_favored) {
+  if (weighted_queue) {
+
+    /* The selection weights already account for all of the below. */
+
+  } else if (pending_favored) {
 
     /* If we have any favored, non-fuzzed new arrivals in the queue,
        possibly skip to them at the expense of already-fuzzed or non-favored
@@ -5078,6 +7943,11 @@ static u8 fuzz_one(char** argv) {
 
   subseq_tmouts = 0;
 
+  if (adaptive_det) {
+    memcpy(det_snap_finds, stage_finds, sizeof(stage_finds));
+    memcpy(det_snap_cycles, stage_cycles, sizeof(stage_cycles));
+  }
+
   cur_depth = queue_cur->depth;
 
   /*******************************************
@@ -5110,6 +7980,61 @@ static u8 fuzz_one(char** argv) {
 
   }
 
+  /* With AFL_FAST_PROBES, the entry may have been calibrated with a different
+     set of live probes. Refresh the checksum, so that trimming and the
+     effector map compare like with like. */
+
+  if (queue_cur->probe_gen != probe_gen) {
+
+    u8 res;
+
+    write_to_testcase(in_buf, len);
+    res = run_target(argv, exec_tmout);
+
+    if (stop_soon) goto abandon_entry;
+
+    if (res == crash_mode)
+      queue_cur->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    queue_cur->probe_gen = probe_gen;
+
+  }
+
+  /* Derive the timeout for this entry from its calibrated execution time,
+     so that genuine hangs don't get to run for the full global limit. Only
+     timeouts that look new are re-run with the full limit; see
+     recheck_tmout(). */
+
+  if (entry_tmout) {
+
+    cur_tmout = queue_cur->exec_us * ENTRY_TMOUT_MULT / 1000;
+    cur_tmout = (cur_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+
+    if (cur_tmout < ENTRY_TMOUT_MIN) cur_tmout = ENTRY_TMOUT_MIN;
+    if (cur_tmout > exec_tmout) cur_tmout = exec_tmout;
+
+  }
+
+  /* With a grammar, parse the entry once, before trimming gets a chance to
+     mangle it. Entries that parse are not trimmed at all; the rest simply
+     skip the grammar stage, though their children may still be luckier. */
+
+  if (g_rules && !queue_cur->g_parsed) {
+
+    queue_cur->g_parsed = 1;
+    queue_cur->g_tree   = g_parse(in_buf, len);
+
+    if (queue_cur->g_tree) {
+
+      g_trees = ck_realloc(g_trees, (g_tree_cnt + 1) * sizeof(struct g_tree*));
+      g_trees[g_tree_cnt++] = queue_cur->g_tree;
+
+      queue_cur->trim_done = 1;
+
+    }
+
+  }
+
   /************
    * TRIMMING *
    ************/
@@ -5134,29 +8059,53 @@ static u8 fuzz_one(char** argv) {
 
   }
 
+  /*************************
+   * STRUCTURE INFERENCE   *
+   *************************/
+
+  if (struct_fixups && !dumb_mode && !queue_cur->fix_done) {
+
+    infer_structure(argv, in_buf, len);
+
+    if (stop_soon) {
+      cur_skipped_paths++;
+      goto abandon_entry;
+    }
+
+  }
+
   memcpy(out_buf, in_buf, len);
 
+  if (post_handler_v2) post_set_reference(in_buf, len);
+
   /*********************
    * PERFORMANCE SCORE *
    *********************/
 
   orig_perf = perf_score = calculate_score(queue_cur);
 
+  /* Under the coe schedule, a zero score means that the path is too common
+     to be worth fuzzing for now. */
+
+  if (!perf_score && schedule == SCHED_COE) goto abandon_entry;
+
   /* Skip right away if -d is given, if we have done deterministic fuzzing on
      this entry ourselves (was_fuzzed), or if it has gone through deterministic
      testing in earlier, resumed runs (passed_det). */
 
   if (skip_deterministic || queue_cur->was_fuzzed || queue_cur->passed_det)
-    goto havoc_stage;
+    goto custom_stage;
 
   /* Skip deterministic fuzzing if exec path checksum puts this out of scope
      for this master instance. */
 
   if (master_max && (queue_cur->exec_cksum % master_max) != master_id - 1)
-    goto havoc_stage;
+    goto custom_stage;
 
   doing_det = 1;
 
+  new_hit_cnt = queued_paths + unique_crashes;
+
   /*********************************************
    * SIMPLE BITFLIP (+dictionary construction) *
    *********************************************/
@@ -5169,6 +8118,8 @@ static u8 fuzz_one(char** argv) {
 
   /* Single walking bit. */
 
+  if (det_skip(STAGE_FLIP1, len)) goto skip_flip1;
+
   stage_short = "flip1";
   stage_max   = len << 3;
   stage_name  = "bitflip 1/1";
@@ -5179,6 +8130,11 @@ static u8 fuzz_one(char** argv) {
 
   prev_cksum = queue_cur->exec_cksum;
 
+  /* This stage and flip8 look at trace_bits after every exec, so with
+     AFL_DEDUP_EXECS, repeats are only recorded, never skipped. */
+
+  dedup_no_skip = 1;
+
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
     stage_cur_byte = stage_cur >> 3;
@@ -5258,13 +8214,19 @@ static u8 fuzz_one(char** argv) {
 
   }
 
+  dedup_no_skip = 0;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP1]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP1] += stage_max;
 
+skip_flip1:
+
   /* Two walking bits. */
 
+  if (det_skip(STAGE_FLIP2, len)) goto skip_flip2;
+
   stage_name  = "bitflip 2/1";
   stage_short = "flip2";
   stage_max   = (len << 3) - 1;
@@ -5290,8 +8252,12 @@ static u8 fuzz_one(char** argv) {
   stage_finds[STAGE_FLIP2]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP2] += stage_max;
 
+skip_flip2:
+
   /* Four walking bits. */
 
+  if (det_skip(STAGE_FLIP4, len)) goto skip_flip4;
+
   stage_name  = "bitflip 4/1";
   stage_short = "flip4";
   stage_max   = (len << 3) - 3;
@@ -5321,6 +8287,8 @@ static u8 fuzz_one(char** argv) {
   stage_finds[STAGE_FLIP4]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP4] += stage_max;
 
+skip_flip4:
+
   /* Effector map setup. These macros calculate:
 
      EFF_APOS      - position of a particular file offset in the map.
@@ -5345,6 +8313,15 @@ static u8 fuzz_one(char** argv) {
     eff_cnt++;
   }
 
+  /* With AFL_ADAPTIVE_DET, the stages that do worse than havoc on inputs of
+     this size are mostly skipped (see det_skip()). Without the walking byte,
+     there is no effector map, so all bytes are considered. */
+
+  if (det_skip(STAGE_FLIP8, len)) {
+    memset(eff_map, 1, EFF_ALEN(len));
+    goto skip_flip8;
+  }
+
   /* Walking byte. */
 
   stage_name  = "bitflip 8/8";
@@ -5353,6 +8330,8 @@ static u8 fuzz_one(char** argv) {
 
   orig_hit_cnt = new_hit_cnt;
 
+  dedup_no_skip = 1;
+
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
     stage_cur_byte = stage_cur;
@@ -5408,15 +8387,21 @@ static u8 fuzz_one(char** argv) {
 
   blocks_eff_total += EFF_ALEN(len);
 
+  dedup_no_skip = 0;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP8]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP8] += stage_max;
 
+skip_flip8:
+
   /* Two walking bytes. */
 
   if (len < 2) goto skip_bitflip;
 
+  if (det_skip(STAGE_FLIP16, len)) goto skip_flip16;
+
   stage_name  = "bitflip 16/8";
   stage_short = "flip16";
   stage_cur   = 0;
@@ -5450,10 +8435,14 @@ static u8 fuzz_one(char** argv) {
   stage_finds[STAGE_FLIP16]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_FLIP16] += stage_max;
 
+skip_flip16:
+
   if (len < 4) goto skip_bitflip;
 
   /* Four walking bytes. */
 
+  if (det_skip(STAGE_FLIP32, len)) goto skip_bitflip;
+
   stage_name  = "bitflip 32/8";
   stage_short = "flip32";
   stage_cur   = 0;
@@ -5496,6 +8485,8 @@ skip_bitflip:
 
   /* 8-bit arithmetics. */
 
+  if (det_skip(STAGE_ARITH8, len)) goto skip_arith8;
+
   stage_name  = "arith 8/8";
   stage_short = "arith8";
   stage_cur   = 0;
@@ -5558,10 +8549,14 @@ skip_bitflip:
   stage_finds[STAGE_ARITH8]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_ARITH8] += stage_max;
 
+skip_arith8:
+
   /* 16-bit arithmetics, both endians. */
 
   if (len < 2) goto skip_arith;
 
+  if (det_skip(STAGE_ARITH16, len)) goto skip_arith16;
+
   stage_name  = "arith 16/8";
   stage_short = "arith16";
   stage_cur   = 0;
@@ -5652,10 +8647,14 @@ skip_bitflip:
   stage_finds[STAGE_ARITH16]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_ARITH16] += stage_max;
 
+skip_arith16:
+
   /* 32-bit arithmetics, both endians. */
 
   if (len < 4) goto skip_arith;
 
+  if (det_skip(STAGE_ARITH32, len)) goto skip_arith;
+
   stage_name  = "arith 32/8";
   stage_short = "arith32";
   stage_cur   = 0;
@@ -5750,6 +8749,8 @@ skip_arith:
    * INTERESTING VALUES *
    **********************/
 
+  if (det_skip(STAGE_INTEREST8, len)) goto skip_int8;
+
   stage_name  = "interest 8/8";
   stage_short = "int8";
   stage_cur   = 0;
@@ -5801,10 +8802,14 @@ skip_arith:
   stage_finds[STAGE_INTEREST8]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_INTEREST8] += stage_max;
 
+skip_int8:
+
   /* Setting 16-bit integers, both endians. */
 
   if (no_arith || len < 2) goto skip_interest;
 
+  if (det_skip(STAGE_INTEREST16, len)) goto skip_int16;
+
   stage_name  = "interest 16/8";
   stage_short = "int16";
   stage_cur   = 0;
@@ -5869,10 +8874,14 @@ skip_arith:
   stage_finds[STAGE_INTEREST16]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_INTEREST16] += stage_max;
 
+skip_int16:
+
   if (len < 4) goto skip_interest;
 
   /* Setting 32-bit integers, both endians. */
 
+  if (det_skip(STAGE_INTEREST32, len)) goto skip_interest;
+
   stage_name  = "interest 32/8";
   stage_short = "int32";
   stage_cur   = 0;
@@ -5948,6 +8957,8 @@ skip_interest:
 
   /* Overwrite with user-supplied extras. */
 
+  if (det_skip(STAGE_EXTRAS_UO, len)) goto skip_ext_UO;
+
   stage_name  = "user extras (over)";
   stage_short = "ext_UO";
   stage_cur   = 0;
@@ -5988,8 +8999,12 @@ skip_interest:
       last_len = extras[j].len;
       memcpy(out_buf + i, extras[j].data, last_len);
 
+      track_extra(&extras[j]);
+
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
 
+      credit_extras();
+
       stage_cur++;
 
     }
@@ -6004,8 +9019,12 @@ skip_interest:
   stage_finds[STAGE_EXTRAS_UO]  += new_hit_cnt - orig_hit_cnt;
   stage_cycles[STAGE_EXTRAS_UO] += stage_max;
 
+skip_ext_UO:
+
   /* Insertion of user-supplied extras. */
 
+  if (det_skip(STAGE_EXTRAS_UI, len)) goto skip_user_extras;
+
   stage_name  = "user extras (insert)";
   stage_short = "ext_UI";
   stage_cur   = 0;
@@ -6032,11 +9051,15 @@ skip_interest:
       /* Copy tail */
       memcpy(ex_tmp + i + extras[j].len, out_buf + i, len - i);
 
+      track_extra(&extras[j]);
+
       if (common_fuzz_stuff(argv, ex_tmp, len + extras[j].len)) {
         ck_free(ex_tmp);
         goto abandon_entry;
       }
 
+      credit_extras();
+
       stage_cur++;
 
     }
@@ -6057,6 +9080,8 @@ skip_user_extras:
 
   if (!a_extras_cnt) goto skip_extras;
 
+  if (det_skip(STAGE_EXTRAS_AO, len)) goto skip_extras;
+
   stage_name  = "auto extras (over)";
   stage_short = "ext_AO";
   stage_cur   = 0;
@@ -6088,8 +9113,12 @@ skip_user_extras:
       last_len = a_extras[j].len;
       memcpy(out_buf + i, a_extras[j].data, last_len);
 
+      track_extra(&a_extras[j]);
+
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
 
+      credit_extras();
+
       stage_cur++;
 
     }
@@ -6112,6 +9141,115 @@ skip_extras:
 
   if (!queue_cur->passed_det) mark_as_det_done(queue_cur);
 
+  /******************
+   * CUSTOM MUTATOR *
+   ******************/
+
+custom_stage:
+
+  post_in_place = 1;
+
+  if (!custom_fuzz) goto grammar_stage;
+
+  stage_name  = "custom";
+  stage_short = "custom";
+  stage_max   = CUSTOM_CYCLES * perf_score / havoc_div / 100;
+
+  if (stage_max < HAVOC_MIN) stage_max = HAVOC_MIN;
+
+  stage_cur_byte = -1;
+  stage_cur_val  = 0;
+  stage_val_type = STAGE_VAL_NONE;
+
+  orig_hit_cnt = queued_paths + unique_crashes;
+
+  /* The library fills up to CUSTOM_BATCH buffers per call; each output is
+     then run just like a havoc mutation. Stop early if it runs dry. */
+
+  stage_cur = 0;
+
+  while (stage_cur < stage_max) {
+
+    u32 cnt = custom_fuzz(custom_data, in_buf, len, custom_bufs, custom_lens,
+                          MIN(CUSTOM_BATCH, stage_max - stage_cur), MAX_FILE);
+
+    if (!cnt) break;
+    if (cnt > CUSTOM_BATCH) cnt = CUSTOM_BATCH;
+
+    for (i = 0; i < cnt; i++) {
+
+      stage_cur++;
+
+      if (!custom_lens[i] || custom_lens[i] > MAX_FILE) continue;
+
+      if (common_fuzz_stuff(argv, custom_bufs[i], custom_lens[i]))
+        goto abandon_entry;
+
+    }
+
+  }
+
+  new_hit_cnt = queued_paths + unique_crashes;
+
+  stage_finds[STAGE_CUSTOM]  += new_hit_cnt - orig_hit_cnt;
+  stage_cycles[STAGE_CUSTOM] += stage_cur;
+
+  /*********************
+   * GRAMMAR MUTATIONS *
+   *********************/
+
+grammar_stage:
+
+  if (!g_rules) goto havoc_stage;
+
+  if (!queue_cur->g_tree) goto havoc_stage;
+
+  stage_name  = "grammar";
+  stage_short = "grammar";
+  stage_max   = GRAMMAR_CYCLES * perf_score / havoc_div / 100;
+
+  if (stage_max < HAVOC_MIN) stage_max = HAVOC_MIN;
+
+  stage_cur_byte = -1;
+  stage_val_type = STAGE_VAL_NONE;
+
+  orig_hit_cnt = queued_paths + unique_crashes;
+
+  /* Much like havoc, stack a couple of subtree replacements per exec. */
+
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+
+    struct g_node* cur = queue_cur->g_tree->n;
+    u32 cnt = queue_cur->g_tree->cnt, use_stacking, g_len = 0, g_pos = 0;
+
+    use_stacking  = 1 << UR(GRAMMAR_STACK_POW2);
+    stage_cur_val = use_stacking;
+
+    for (i = 0; i < use_stacking; i++) {
+
+      u32 new_cnt = g_mutate(cur, cnt, g_work[i & 1]);
+
+      if (!new_cnt) break;
+
+      cur = g_work[i & 1];
+      cnt = new_cnt;
+
+    }
+
+    if (cur == queue_cur->g_tree->n) continue;
+
+    if (!g_unparse(cur, &g_pos, g_out_buf, &g_len) || !g_len) continue;
+
+    if (common_fuzz_stuff(argv, g_out_buf, g_len))
+      goto abandon_entry;
+
+  }
+
+  new_hit_cnt = queued_paths + unique_crashes;
+
+  stage_finds[STAGE_GRAMMAR]  += new_hit_cnt - orig_hit_cnt;
+  stage_cycles[STAGE_GRAMMAR] += stage_max;
+
   /****************
    * RANDOM HAVOC *
    ****************/
@@ -6159,6 +9297,10 @@ havoc_stage:
     u32 use_stacking = 1 << (1 + UR(HAVOC_STACK_POW2));
 
     stage_cur_val = use_stacking;
+
+    /* Fields are only known for the entry itself, not for splices. */
+
+    if (splice_cycle) fix_cur_cnt = 0; else fix_begin();
  
     for (i = 0; i < use_stacking; i++) {
 
@@ -6358,6 +9500,8 @@ havoc_stage:
 
             temp_len -= del_len;
 
+            if (fix_cur_cnt) fix_shift(del_from, -(s32)del_len);
+
             break;
 
           }
@@ -6408,6 +9552,8 @@ havoc_stage:
             out_buf = new_buf;
             temp_len += clone_len;
 
+            if (fix_cur_cnt) fix_shift(clone_to, clone_len);
+
           }
 
           break;
@@ -6450,7 +9596,7 @@ havoc_stage:
               /* No user-specified extras or odds in our favor. Let's use an
                  auto-detected one. */
 
-              u32 use_extra = UR(a_extras_cnt);
+              u32 use_extra = pick_extra(1);
               u32 extra_len = a_extras[use_extra].len;
               u32 insert_at;
 
@@ -6458,12 +9604,13 @@ havoc_stage:
 
               insert_at = UR(temp_len - extra_len + 1);
               memcpy(out_buf + insert_at, a_extras[use_extra].data, extra_len);
+              track_extra(&a_extras[use_extra]);
 
             } else {
 
               /* No auto extras or odds in our favor. Use the dictionary. */
 
-              u32 use_extra = UR(extras_cnt);
+              u32 use_extra = pick_extra(0);
               u32 extra_len = extras[use_extra].len;
               u32 insert_at;
 
@@ -6471,6 +9618,7 @@ havoc_stage:
 
               insert_at = UR(temp_len - extra_len + 1);
               memcpy(out_buf + insert_at, extras[use_extra].data, extra_len);
+              track_extra(&extras[use_extra]);
 
             }
 
@@ -6488,11 +9636,13 @@ havoc_stage:
 
             if (!extras_cnt || (a_extras_cnt && UR(2))) {
 
-              use_extra = UR(a_extras_cnt);
+              use_extra = pick_extra(1);
               extra_len = a_extras[use_extra].len;
 
               if (temp_len + extra_len >= MAX_FILE) break;
 
+              track_extra(&a_extras[use_extra]);
+
               new_buf = ck_alloc_nozero(temp_len + extra_len);
 
               /* Head */
@@ -6503,11 +9653,13 @@ havoc_stage:
 
             } else {
 
-              use_extra = UR(extras_cnt);
+              use_extra = pick_extra(0);
               extra_len = extras[use_extra].len;
 
               if (temp_len + extra_len >= MAX_FILE) break;
 
+              track_extra(&extras[use_extra]);
+
               new_buf = ck_alloc_nozero(temp_len + extra_len);
 
               /* Head */
@@ -6526,6 +9678,8 @@ havoc_stage:
             out_buf   = new_buf;
             temp_len += extra_len;
 
+            if (fix_cur_cnt) fix_shift(insert_at, extra_len);
+
             break;
 
           }
@@ -6534,9 +9688,13 @@ havoc_stage:
 
     }
 
+    if (fix_cur_cnt) fix_apply(out_buf, temp_len);
+
     if (common_fuzz_stuff(argv, out_buf, temp_len))
       goto abandon_entry;
 
+    credit_extras();
+
     /* out_buf might have been mangled a bit, so let's restore it to its
        original size and shape. */
 
@@ -6584,7 +9742,7 @@ havoc_stage:
 retry_splicing:
 
   if (use_splicing && splice_cycle++ < SPLICE_CYCLES &&
-      queued_paths > 1 && queue_cur->len > 1) {
+      queued_paths - queued_archived > 1 && queue_cur->len > 1) {
 
     struct queue_entry* target;
     u32 tid, split_at;
@@ -6600,24 +9758,35 @@ retry_splicing:
       len = queue_cur->len;
     }
 
-    /* Pick a random queue entry and seek to it. Don't splice with yourself. */
+    /* Try to find a partner that brings in coverage we do not have. Failing
+       that, pick a random queue entry and seek to it. Don't splice with
+       yourself. */
+
+    target = pick_splice_partner(argv, in_buf, len);
+
+    if (stop_soon) goto abandon_entry;
+
+    if (!target) {
+
+      do {
+        tid = UR(queued_paths - queued_archived);
+      } while (tid == current_entry);
 
-    do { tid = UR(queued_paths); } while (tid == current_entry);
+      target = queue;
 
-    splicing_with = tid;
-    target = queue;
+      while (tid >= 100) { target = target->next_100; tid -= 100; }
+      while (tid--) target = target->next;
 
-    while (tid >= 100) { target = target->next_100; tid -= 100; }
-    while (tid--) target = target->next;
+      /* Make sure that the target has a reasonable length. */
 
-    /* Make sure that the target has a reasonable length. */
+      while (target && (target->len < 2 || target == queue_cur))
+        target = target->next;
+
+      if (!target) goto retry_splicing;
 
-    while (target && (target->len < 2 || target == queue_cur)) {
-      target = target->next;
-      splicing_with++;
     }
 
-    if (!target) goto retry_splicing;
+    splicing_with = target->id;
 
     /* Read the testcase into a new buffer. */
 
@@ -6652,6 +9821,8 @@ retry_splicing:
     memcpy(new_buf, in_buf, split_at);
     in_buf = new_buf;
 
+    post_set_reference(NULL, 0);
+
     ck_free(out_buf);
     out_buf = ck_alloc_nozero(len);
     memcpy(out_buf, in_buf, len);
@@ -6666,12 +9837,30 @@ retry_splicing:
 
 abandon_entry:
 
-  splicing_with = -1;
+  splicing_with  = -1;
+  splice_mini_ok = 0;
+  dedup_no_skip  = 0;
+  ex_used_cnt    = 0;
+
+  post_in_place = 0;
+  post_ref_buf  = NULL;
+
+  cur_tmout = exec_tmout;
+
+  if (adaptive_det) update_det_yield(len);
+
+  queue_cur->fuzz_level++;
+
+  /* Both fuzz_level and was_fuzzed go into queue_weight(). One O(n) rebuild
+     per fuzz_one() call is cheap next to the execs it took. */
+
+  alias_dirty = 1;
 
   /* Update pending_not_fuzzed count if we made it through the calibration
      cycle and have not seen this entry before. */
 
-  if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed) {
+  if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed &&
+      (orig_perf || schedule != SCHED_COE)) {
     queue_cur->was_fuzzed = 1;
     pending_not_fuzzed--;
     if (queue_cur->favored) pending_favored--;
@@ -7102,7 +10291,8 @@ static void check_term_size(void) {
   if (ioctl(1, TIOCGWINSZ, &ws)) return;
 
   if (ws.ws_row == 0 && ws.ws_col == 0) return;
-  if (ws.ws_row < 25 || ws.ws_col < 80) term_too_small = 1;
+  if (ws.ws_row < 25 + (custom_fuzz || g_rules) || ws.ws_col < 80)
+    term_too_small = 1;
 
 }
 
@@ -7130,13 +10320,17 @@ static void usage(u8* argv0) {
 
        "  -d            - quick & dirty mode (skips deterministic steps)\n"
        "  -n            - fuzz without instrumentation (dumb mode)\n"
-       "  -x dir        - optional fuzzer dictionary (see README)\n\n"
+       "  -x dir        - optional fuzzer dictionary (see README)\n"
+       "  -g file       - optional grammar for structured inputs (see README)\n"
+       "  -p schedule   - power schedule: exploit (default), explore, fast,\n"
+       "                  or coe (see README)\n\n"
 
        "Other stuff:\n\n"
 
        "  -T text       - text banner to show on the screen\n"
        "  -M / -S id    - distributed mode (see parallel_fuzzing.txt)\n"
        "  -C            - crash exploration mode (the peruvian rabbit thing)\n"
+       "  -s seed       - use a fixed random seed, for reproducible runs\n"
        "  -V            - show version number and exit\n\n"
        "  -b cpu_id     - bind the fuzzing process to the specified CPU core\n\n"
 
@@ -7779,23 +10973,18 @@ int main(int argc, char** argv) {
 
   s32 opt;
   u64 prev_queued = 0;
+  u32 weighted_picks = 0, weighted_cycle_len = 0;
   u32 sync_interval_cnt = 0, seek_to;
   u8  *extras_dir = 0;
   u8  mem_limit_given = 0;
   u8  exit_1 = !!getenv("AFL_BENCH_JUST_ONE");
   char** use_argv;
 
-  struct timeval tv;
-  struct timezone tz;
-
   SAYF(cCYA "afl-fuzz " cBRI VERSION cRST " by <lcamtuf@google.com>\n");
 
   doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
 
-  gettimeofday(&tv, &tz);
-  srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
-
-  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QV")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:g:p:s:QV")) > 0)
 
     switch (opt) {
 
@@ -7855,6 +11044,28 @@ int main(int argc, char** argv) {
         extras_dir = optarg;
         break;
 
+      case 's': { /* random seed */
+
+          unsigned long long seed;
+
+          if (fixed_seed) FATAL("Multiple -s options not supported");
+
+          if (sscanf(optarg, "%llu", &seed) < 1 || optarg[0] == '-')
+            FATAL("Bad syntax used for -s");
+
+          seed_rng(seed);
+          fixed_seed = 1;
+
+        }
+
+        break;
+
+      case 'g': /* grammar */
+
+        if (grammar_file) FATAL("Multiple -g options not supported");
+        grammar_file = optarg;
+        break;
+
       case 't': { /* timeout */
 
           u8 suffix = 0;
@@ -7975,6 +11186,21 @@ int main(int argc, char** argv) {
 
         break;
 
+      case 'p': { /* power schedule */
+
+          u8 i;
+
+          for (i = 0; i < sizeof(schedule_names) / sizeof(u8*); i++)
+            if (!strcmp(optarg, schedule_names[i])) break;
+
+          if (i == sizeof(schedule_names) / sizeof(u8*))
+            FATAL("Unknown power schedule '%s'", optarg);
+
+          schedule = i;
+          break;
+
+        }
+
       case 'V': /* Show version number */
 
         /* Version number has been printed already, just quit. */
@@ -8000,6 +11226,7 @@ int main(int argc, char** argv) {
 
     if (crash_mode) FATAL("-C and -n are mutually exclusive");
     if (qemu_mode)  FATAL("-Q and -n are mutually exclusive");
+    if (schedule)   FATAL("-p and -n are mutually exclusive");
 
   }
 
@@ -8008,6 +11235,14 @@ int main(int argc, char** argv) {
   if (getenv("AFL_NO_ARITH"))      no_arith         = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
   if (getenv("AFL_FAST_CAL"))      fast_cal         = 1;
+  if (getenv("AFL_NO_UNSTABLE_MASK")) no_unstable_mask = 1;
+  if (getenv("AFL_QUEUE_COMPACT")) queue_compact    = 1;
+  if (getenv("AFL_WEIGHTED_QUEUE")) weighted_queue  = 1;
+  if (getenv("AFL_ENTRY_TMOUT"))   entry_tmout      = 1;
+  if (getenv("AFL_DEDUP_EXECS"))   dedup_execs      = 1;
+  if (getenv("AFL_ADAPTIVE_DET"))  adaptive_det     = 1;
+  if (getenv("AFL_WEIGHTED_EXTRAS")) weighted_extras = 1;
+  if (getenv("AFL_STRUCT_FIXUPS")) struct_fixups    = 1;
 
   if (getenv("AFL_HANG_TMOUT")) {
     hang_tmout = atoi(getenv("AFL_HANG_TMOUT"));
@@ -8017,6 +11252,24 @@ int main(int argc, char** argv) {
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
+  /* Prefork is a hint to afl-llvm-rt.o; the protocol itself is unchanged, so
+     targets that do not know about it simply ignore the variable. */
+
+  if (getenv("AFL_PREFORK") && !dumb_mode && !no_forkserver && !qemu_mode) {
+    setenv(PREFORK_ENV_VAR, "1", 1);
+    prefork_mode = 1;
+  }
+
+  if (getenv("AFL_FAST_PROBES") && !dumb_mode && !qemu_mode && !crash_mode) {
+    setenv(PROBE_ENV_VAR, "1", 1);
+    fast_probes = 1;
+  }
+
+  if (getenv("AFL_CRASH_BUCKETS") && !dumb_mode && !qemu_mode && !crash_mode) {
+    setenv(STACK_HASH_ENV_VAR, "1", 1);
+    crash_buckets = 1;
+  }
+
   if (getenv("AFL_PRELOAD")) {
     setenv("LD_PRELOAD", getenv("AFL_PRELOAD"), 1);
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
@@ -8042,16 +11295,23 @@ int main(int argc, char** argv) {
 
   setup_post();
   setup_shm();
+
+  if (schedule != SCHED_EXPLOIT)
+    n_fuzz = ck_alloc(sizeof(u32) << N_FUZZ_SIZE_POW2);
   init_count_class16();
 
   setup_dirs_fds();
+  setup_custom_mutator();
   read_testcases();
   load_auto();
+  load_unstable();
 
   pivot_inputs();
 
   if (extras_dir) load_extras(extras_dir);
 
+  if (grammar_file) load_grammar(grammar_file);
+
   if (!timeout_given) find_timeout();
 
   detect_file_args(argv + optind + 1);
@@ -8097,6 +11357,10 @@ int main(int argc, char** argv) {
     if (!queue_cur) {
 
       queue_cycle++;
+
+      if (queue_compact) compact_queue();
+      if (fast_probes) update_probe_mask();
+
       current_entry     = 0;
       cur_skipped_paths = 0;
       queue_cur         = queue;
@@ -8124,12 +11388,23 @@ int main(int argc, char** argv) {
       } else cycles_wo_finds = 0;
 
       prev_queued = queued_paths;
+      weighted_cycle_len = queued_paths - queued_archived;
 
       if (sync_id && queue_cycle == 1 && getenv("AFL_IMPORT_FIRST"))
         sync_fuzzers(use_argv);
 
     }
 
+    /* In weighted mode, a "cycle" is simply as many picks as there were
+       active (not archived) entries in the queue when it began. */
+
+    if (weighted_queue) {
+
+      current_entry = select_next_queue_entry();
+      queue_cur     = queue_buf[current_entry];
+
+    }
+
     skipped_fuzz = fuzz_one(use_argv);
 
     if (!stop_soon && sync_id && !skipped_fuzz) {
@@ -8143,8 +11418,19 @@ int main(int argc, char** argv) {
 
     if (stop_soon) break;
 
-    queue_cur = queue_cur->next;
-    current_entry++;
+    if (weighted_queue) {
+
+      if (++weighted_picks >= weighted_cycle_len) {
+        weighted_picks = 0;
+        queue_cur = NULL;
+      }
+
+    } else {
+
+      queue_cur = queue_cur->next;
+      current_entry++;
+
+    }
 
   }
 
@@ -8164,6 +11450,8 @@ int main(int argc, char** argv) {
   write_bitmap();
   write_stats_file(0, 0, 0);
   save_auto();
+  save_unstable();
+  save_extras_yield();
 
 stop_fuzzing:
 
@@ -8183,6 +11471,13 @@ stop_fuzzing:
   fclose(plot_file);
   destroy_queue();
   destroy_extras();
+  destroy_custom_mutator();
+  destroy_grammar();
+  ck_free(n_fuzz);
+  ck_free(queue_buf);
+  ck_free(splice_pool);
+  ck_free(alias_table);
+  ck_free(alias_prob);
   ck_free(target_path);
   ck_free(sync_id);
 
@@ -0,0 +1,863 @@
+/*
+  Copyright 2015 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - parallel instance launcher
+   -----------------------------------------------
+
+   This tool starts and looks after a set of synchronized afl-fuzz instances
+   on a single machine (see docs/parallel_fuzzing.txt):
+
+     - it measures which CPU cores are actually free, the same way afl-gotcpu
+       does, and starts one instance per free core (one -M, the rest -S),
+       pinning each of them with -b,
+
+     - it restarts instances that die or stop updating their stats, using
+       -i- so that they pick up where they left off,
+
+     - it keeps an eye on the number of runnable processes, like the check
+       in afl-fuzz's show_init_stats(), and stops instances when the box is
+       oversubscribed - or starts more when cores free up.
+
+   Instances log to <sync_dir>/.afl-launch/<name>.log.
+*/
+
+#define AFL_MAIN
+#include "android-ashmem.h"
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#  define HAVE_AFFINITY 1
+#endif /* __linux__ */
+
+
+/* A single afl-fuzz instance, running or not. */
+
+struct instance {
+
+  u8* name;                           /* Instance name (-M / -S)          */
+  s32 pid;                            /* PID, or 0 if not running         */
+  s32 cpu;                            /* Core to bind to, or -1           */
+  u64 start_ms;                       /* Time of the last (re)start       */
+  u32 fails;                          /* Consecutive early deaths         */
+
+  u8  parked,                         /* Stopped to free up the CPU?      */
+      given_up;                       /* Keeps dying, not restarted?      */
+
+};
+
+static struct instance inst[LAUNCH_MAX_INST];
+
+static u32 inst_cnt,                  /* Slots used so far                */
+           max_inst;                  /* Maximum number of instances      */
+
+static u8 *in_dir,                    /* Input directory                  */
+          *sync_dir,                  /* Sync directory                   */
+          *log_dir,                   /* Directory for instance logs      */
+          *name_prefix = "fuzzer",    /* Instance name prefix             */
+          *afl_fuzz = "afl-fuzz";     /* Path to afl-fuzz                 */
+
+static char** fuzz_args;              /* Extra afl-fuzz options, target   */
+
+static s32 cpu_cnt;                   /* Number of CPU cores              */
+
+static pid_t launcher_pid;            /* Our own PID, not a child's       */
+
+static volatile u8 stop_soon;         /* Ctrl-C pressed?                  */
+
+
+/* Get unix time in milliseconds. */
+
+static u64 get_cur_time(void) {
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+}
+
+
+/* Get unix time in microseconds. */
+
+static u64 get_cur_time_us(void) {
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+
+  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+
+}
+
+
+/* Get CPU usage in microseconds. */
+
+static u64 get_cpu_usage_us(void) {
+
+  struct rusage u;
+
+  getrusage(RUSAGE_SELF, &u);
+
+  return (u.ru_utime.tv_sec * 1000000ULL) + u.ru_utime.tv_usec +
+         (u.ru_stime.tv_sec * 1000000ULL) + u.ru_stime.tv_usec;
+
+}
+
+
+/* Measure preemption rate. This is the afl-gotcpu measurement. */
+
+static u32 measure_preemption(u32 target_ms) {
+
+  static volatile u32 v1, v2;
+
+  u64 st_t, en_t, st_c, en_c, real_delta, slice_delta;
+
+  st_t = get_cur_time_us();
+  st_c = get_cpu_usage_us();
+
+  do {
+
+    v1 = CTEST_BUSY_CYCLES;
+
+    while (v1--) v2++;
+    sched_yield();
+
+    en_t = get_cur_time_us();
+
+  } while (en_t - st_t < target_ms * 1000);
+
+  en_c = get_cpu_usage_us();
+
+  real_delta  = (en_t - st_t) / 1000;
+  slice_delta = (en_c - st_c) / 1000;
+
+  return real_delta * 100 / slice_delta;
+
+}
+
+
+/* Get the number of runnable processes, with some simple smoothing. This
+   mirrors the afl-fuzz function of the same name. */
+
+static double get_runnable_processes(void) {
+
+  static double res;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+
+  if (getloadavg(&res, 1) != 1) return 0;
+
+#else
+
+  FILE* f = fopen("/proc/stat", "r");
+  u8 tmp[1024];
+  u32 val = 0;
+
+  if (!f) return 0;
+
+  while (fgets(tmp, sizeof(tmp), f)) {
+
+    if (!strncmp(tmp, "procs_running ", 14) ||
+        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+
+  }
+
+  fclose(f);
+
+  if (!res) {
+
+    res = val;
+
+  } else {
+
+    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
+          ((double)val) * (1.0 / AVG_SMOOTHING);
+
+  }
+
+#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+
+  return res;
+
+}
+
+
+/* Find the cores that are free, skipping the ones our instances are bound
+   to. Fills avail[] with the core IDs and returns their count. Cores that
+   afl-gotcpu would call CAUTION are only used if nothing better is found. */
+
+static u32 find_free_cores(s32* avail, u32 max) {
+
+#ifdef HAVE_AFFINITY
+
+  s32* pids  = ck_alloc(cpu_cnt * sizeof(s32));
+  u8*  state = ck_alloc(cpu_cnt);
+  u32  i, j, cnt = 0;
+
+  ACTF("Measuring preemption rate on free cores (%0.02f sec)...",
+       ((double)CTEST_CORE_TRG_MS) / 1000);
+
+  for (i = 0; i < cpu_cnt; i++) {
+
+    state[i] = 3;
+
+    for (j = 0; j < inst_cnt; j++)
+      if (inst[j].pid && inst[j].cpu == i) break;
+
+    if (j < inst_cnt) continue;
+
+    pids[i] = fork();
+
+    if (pids[i] < 0) PFATAL("fork() failed");
+
+    if (!pids[i]) {
+
+      cpu_set_t c;
+      u32 util_perc;
+
+      CPU_ZERO(&c);
+      CPU_SET(i, &c);
+
+      if (sched_setaffinity(0, sizeof(c), &c)) exit(2);
+
+      util_perc = measure_preemption(CTEST_CORE_TRG_MS);
+
+      exit((util_perc >= 110) + (util_perc >= 250));
+
+    }
+
+  }
+
+  /* Only wait for our own children; the instances are ours, too. */
+
+  for (i = 0; i < cpu_cnt; i++) {
+
+    int ret;
+
+    if (!pids[i]) continue;
+
+    while (waitpid(pids[i], &ret, 0) < 0)
+      if (errno != EINTR) PFATAL("waitpid() failed");
+
+    state[i] = WIFEXITED(ret) ? WEXITSTATUS(ret) : 2;
+
+  }
+
+  for (i = 0; i < cpu_cnt && cnt < max; i++)
+    if (!state[i]) avail[cnt++] = i;
+
+  for (i = 0; !cnt && i < cpu_cnt && cnt < max; i++)
+    if (state[i] == 1) avail[cnt++] = i;
+
+  ck_free(pids);
+  ck_free(state);
+
+  return cnt;
+
+#else
+
+  /* Without affinity, there is no point in checking cores one by one. */
+
+  u32 util_perc, cnt = 0;
+
+  ACTF("Measuring gross preemption rate (%0.02f sec)...",
+       ((double)CTEST_TARGET_MS) / 1000);
+
+  util_perc = measure_preemption(CTEST_TARGET_MS);
+
+  if (util_perc < 105 && max) avail[cnt++] = -1;
+
+  return cnt;
+
+#endif /* ^HAVE_AFFINITY */
+
+}
+
+
+/* Read a numeric field from the fuzzer_stats file of an instance. Returns 0
+   if the file or the field is not there. */
+
+static double read_stat(struct instance* in, u8* field) {
+
+  u8  tmp[4096];
+  u8* fn = alloc_printf("%s/%s/fuzzer_stats", sync_dir, in->name);
+  u8* off;
+  s32 fd, len;
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return 0;
+
+  len = read(fd, tmp, sizeof(tmp) - 1);
+  close(fd);
+
+  if (len <= 0) return 0;
+  tmp[len] = 0;
+
+  off = strstr(tmp, field);
+  if (!off) return 0;
+
+  off = strchr(off, ':');
+  if (!off) return 0;
+
+  return atof(off + 1);
+
+}
+
+
+/* Start (or restart) an instance. If its output directory already exists,
+   we ask afl-fuzz to resume the session with -i-. */
+
+static void start_instance(struct instance* in) {
+
+  u8*    fn = alloc_printf("%s/%s/queue", sync_dir, in->name);
+  u8     resume = !access(fn, F_OK);
+  u8     cpu_str[16];
+  char** argv;
+  u32    i = 0, n = 0;
+
+  ck_free(fn);
+
+  while (fuzz_args[n]) n++;
+
+  argv = ck_alloc((n + 12) * sizeof(char*));
+
+  argv[i++] = afl_fuzz;
+  argv[i++] = "-i";
+  argv[i++] = resume ? (u8*)"-" : in_dir;
+  argv[i++] = "-o";
+  argv[i++] = sync_dir;
+  argv[i++] = (in == inst) ? "-M" : "-S";
+  argv[i++] = in->name;
+
+  if (in->cpu >= 0) {
+    sprintf(cpu_str, "%d", in->cpu);
+    argv[i++] = "-b";
+    argv[i++] = cpu_str;
+  }
+
+  memcpy(argv + i, fuzz_args, (n + 1) * sizeof(char*));
+
+  in->pid = fork();
+
+  if (in->pid < 0) PFATAL("fork() failed");
+
+  if (!in->pid) {
+
+    s32 fd;
+
+    /* Own process group, so that Ctrl-C reaches the instances only through
+       us, after we stop restarting them. */
+
+    setpgid(0, 0);
+
+    fn = alloc_printf("%s/%s.log", log_dir, in->name);
+    fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+
+    fd = open("/dev/null", O_RDONLY);
+    if (fd >= 0) { dup2(fd, 0); close(fd); }
+
+    setenv("AFL_NO_UI", "1", 1);
+
+    execvp(argv[0], argv);
+
+    PFATAL("Unable to execute '%s'", argv[0]);
+
+  }
+
+  ck_free(argv);
+
+  in->start_ms = get_cur_time();
+  in->parked   = 0;
+
+  if (in->cpu >= 0)
+    OKF("Started %s%s on core #%d (PID %d).", in->name,
+        resume ? " (resuming)" : "", in->cpu, in->pid);
+  else
+    OKF("Started %s%s (PID %d).", in->name, resume ? " (resuming)" : "",
+        in->pid);
+
+}
+
+
+/* Set up a new instance slot. */
+
+static struct instance* new_instance(void) {
+
+  struct instance* in;
+
+  if (inst_cnt == LAUNCH_MAX_INST) return NULL;
+
+  in = &inst[inst_cnt];
+  in->name = alloc_printf("%s%02u", name_prefix, inst_cnt);
+  in->cpu  = -1;
+
+  inst_cnt++;
+
+  return in;
+
+}
+
+
+/* Count the running instances. */
+
+static u32 running_instances(void) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < inst_cnt; i++) if (inst[i].pid) ret++;
+
+  return ret;
+
+}
+
+
+/* Reap the instances that exited, and kill the ones that stopped updating
+   their stats; they will get reaped on the next pass. */
+
+static void check_instances(void) {
+
+  u64 cur_ms = get_cur_time();
+  u32 i;
+
+  for (i = 0; i < inst_cnt; i++) {
+
+    struct instance* in = &inst[i];
+    int status;
+    u64 last_update;
+
+    if (!in->pid) continue;
+
+    if (waitpid(in->pid, &status, WNOHANG) == in->pid) {
+
+      in->pid = 0;
+
+      if (in->parked || stop_soon) continue;
+
+      if (cur_ms - in->start_ms < LAUNCH_MIN_UPTIME * 1000) {
+
+        if (++in->fails >= LAUNCH_MAX_FAILS) {
+
+          WARNF("%s keeps dying early, giving up (see %s/%s.log).", in->name,
+                log_dir, in->name);
+          in->given_up = 1;
+          continue;
+
+        }
+
+      } else in->fails = 0;
+
+      if (WIFSIGNALED(status))
+        WARNF("%s was killed by signal %d, restarting.", in->name,
+              WTERMSIG(status));
+      else
+        WARNF("%s exited with status %d, restarting.", in->name,
+              WEXITSTATUS(status));
+
+      start_instance(in);
+      continue;
+
+    }
+
+    /* Stats written before the last restart do not count. */
+
+    last_update = read_stat(in, "last_update       :") * 1000;
+
+    if (last_update > in->start_ms &&
+        cur_ms - last_update > LAUNCH_STALL_SEC * 1000) {
+
+      WARNF("%s has not updated its stats in %llu sec, killing it.", in->name,
+            (cur_ms - last_update) / 1000);
+
+      kill(in->pid, SIGKILL);
+
+    }
+
+  }
+
+}
+
+
+/* Scale down if the box is oversubscribed, using the same threshold as the
+   "system load" check in afl-fuzz, or up if cores stayed free for a while.
+   N instances on N cores hover right around N runnable processes, so the
+   gap between the two thresholds keeps us from parking and restarting an
+   instance on every check. We move by one instance at a time, so that the
+   smoothed runnable process count has a chance to catch up before the next
+   decision. */
+
+static void scale_instances(double runnable) {
+
+  static u32 idle_checks;
+
+  u32 running = running_instances(), i;
+
+  if (runnable + 1 <= cpu_cnt) idle_checks++; else idle_checks = 0;
+
+  if (runnable > cpu_cnt * 1.5 && running > 1) {
+
+    /* Park the most recent secondary instance; SIGINT makes it save its
+       state. The master stays. */
+
+    for (i = inst_cnt - 1; i > 0; i--)
+      if (inst[i].pid) break;
+
+    if (!i) return;
+
+    WARNF("Oversubscribed (%0.02f runnable / %u cores), stopping %s.",
+          runnable, cpu_cnt, inst[i].name);
+
+    inst[i].parked = 1;
+    kill(inst[i].pid, SIGINT);
+
+    return;
+
+  }
+
+  if (idle_checks >= LAUNCH_IDLE_CHECKS && running < max_inst) {
+
+    struct instance* in = NULL;
+    s32 cpu;
+
+    idle_checks = 0;
+
+    if (!find_free_cores(&cpu, 1)) return;
+
+    /* Prefer bringing back a parked instance. */
+
+    for (i = 0; i < inst_cnt; i++)
+      if (!inst[i].pid && inst[i].parked && !inst[i].given_up) {
+        in = &inst[i];
+        break;
+      }
+
+    if (!in) in = new_instance();
+    if (!in) return;
+
+    in->cpu = cpu;
+    start_instance(in);
+
+  }
+
+}
+
+
+/* Show a one-line summary. */
+
+static void show_status(double runnable) {
+
+  double eps = 0, paths = 0, crashes = 0;
+  u32 i;
+
+  for (i = 0; i < inst_cnt; i++) {
+
+    if (!inst[i].pid) continue;
+
+    eps     += read_stat(&inst[i], "execs_per_sec     :");
+    paths   += read_stat(&inst[i], "paths_total       :");
+    crashes += read_stat(&inst[i], "unique_crashes    :");
+
+  }
+
+  ACTF("%u instance%s running, %0.00f execs/sec, %0.00f paths, %0.00f crashes "
+       "(load: %0.02f / %u cores).", running_instances(),
+       running_instances() == 1 ? "" : "s", eps, paths, crashes, runnable,
+       cpu_cnt);
+
+}
+
+
+/* Handle Ctrl-C and the like. */
+
+static void handle_stop_sig(int sig) {
+
+  stop_soon = 1;
+
+}
+
+
+/* Stop all instances, giving them some time to write out their state. */
+
+static void stop_instances(void) {
+
+  u64 deadline = get_cur_time() + LAUNCH_STOP_SEC * 1000;
+  u32 i;
+
+  ACTF("Stopping %u instance%s...", running_instances(),
+       running_instances() == 1 ? "" : "s");
+
+  for (i = 0; i < inst_cnt; i++)
+    if (inst[i].pid) kill(inst[i].pid, SIGINT);
+
+  while (running_instances()) {
+
+    for (i = 0; i < inst_cnt; i++)
+      if (inst[i].pid && waitpid(inst[i].pid, NULL, WNOHANG) == inst[i].pid)
+        inst[i].pid = 0;
+
+    if (get_cur_time() > deadline) {
+
+      for (i = 0; i < inst_cnt; i++)
+        if (inst[i].pid) {
+          kill(inst[i].pid, SIGKILL);
+          waitpid(inst[i].pid, NULL, 0);
+          inst[i].pid = 0;
+        }
+
+    }
+
+    usleep(100000);
+
+  }
+
+}
+
+
+/* Make sure that no exit path, FATAL() included, leaves the instances
+   running without us. Children that exit before exec() must not do this. */
+
+static void stop_at_exit(void) {
+
+  if (getpid() != launcher_pid || !running_instances()) return;
+
+  stop_instances();
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] -- [ afl-fuzz options ] /path/to/fuzzed_app [ ... ]\n\n"
+
+       "Required parameters:\n\n"
+
+       "  -i dir        - input directory with test cases\n"
+       "  -o dir        - sync directory shared by all instances\n\n"
+
+       "Launch settings:\n\n"
+
+       "  -n count      - maximum number of instances (default: one per core)\n"
+       "  -N prefix     - instance name prefix (default: 'fuzzer')\n"
+       "  -F path       - afl-fuzz binary to use\n\n"
+
+       "Everything after '--' is passed to afl-fuzz after -i, -o, -M / -S and -b.\n"
+       "For additional tips, please consult %s/parallel_fuzzing.txt.\n\n",
+
+       argv0, DOC_PATH);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  struct sigaction sa;
+  s32* cores;
+  s32  opt;
+  u32  i, cnt;
+  u64  last_scale;
+  char* slash;
+
+  SAYF(cCYA "afl-launch " cBRI VERSION cRST " by <lcamtuf@google.com>\n");
+
+  while ((opt = getopt(argc, argv, "+i:o:n:N:F:")) > 0)
+
+    switch (opt) {
+
+      case 'i':
+
+        if (in_dir) FATAL("Multiple -i options not supported");
+        in_dir = optarg;
+        break;
+
+      case 'o':
+
+        if (sync_dir) FATAL("Multiple -o options not supported");
+        sync_dir = optarg;
+        break;
+
+      case 'n':
+
+        if (sscanf(optarg, "%u", &max_inst) < 1 || !max_inst ||
+            optarg[0] == '-') FATAL("Bad syntax used for -n");
+
+        if (max_inst > LAUNCH_MAX_INST)
+          FATAL("Too many instances (max %u)", LAUNCH_MAX_INST);
+
+        break;
+
+      case 'N':
+
+        name_prefix = optarg;
+        break;
+
+      case 'F':
+
+        afl_fuzz = optarg;
+        break;
+
+      default:
+
+        usage(argv[0]);
+
+    }
+
+  if (optind == argc || !in_dir || !sync_dir) usage(argv[0]);
+
+  fuzz_args = argv + optind;
+
+  /* By default, use the afl-fuzz that sits next to us, if there is one. */
+
+  slash = strrchr(argv[0], '/');
+
+  if (afl_fuzz == (u8*)"afl-fuzz" && slash) {
+
+    u8* fn = alloc_printf("%.*s/afl-fuzz", (int)(slash - argv[0]), argv[0]);
+
+    if (!access(fn, X_OK)) afl_fuzz = fn; else ck_free(fn);
+
+  }
+
+  cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpu_cnt < 1) cpu_cnt = 1;
+
+  if (!max_inst) max_inst = MIN(cpu_cnt, LAUNCH_MAX_INST);
+
+  if (mkdir(sync_dir, 0700) && errno != EEXIST)
+    PFATAL("Unable to create '%s'", sync_dir);
+
+  log_dir = alloc_printf("%s/.afl-launch", sync_dir);
+
+  if (mkdir(log_dir, 0700) && errno != EEXIST)
+    PFATAL("Unable to create '%s'", log_dir);
+
+  launcher_pid = getpid();
+  atexit(stop_at_exit);
+
+  sa.sa_handler = handle_stop_sig;
+  sa.sa_flags   = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+
+  /* Initial launch: one instance per free core, master first. */
+
+  cores = ck_alloc(max_inst * sizeof(s32));
+  cnt   = find_free_cores(cores, max_inst);
+
+  if (!cnt) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "None of the %u CPU cores seem to be free. Starting fuzzers on this\n"
+         "    machine right now would slow everything else down.\n", cpu_cnt);
+
+    FATAL("No free CPU cores");
+
+  }
+
+  OKF("Found %u free core%s, starting %u instance%s.", cnt, cnt > 1 ? "s" : "",
+      cnt, cnt > 1 ? "s" : "");
+
+  for (i = 0; i < cnt && !stop_soon; i++) {
+
+    struct instance* in = new_instance();
+
+    in->cpu = cores[i];
+    start_instance(in);
+
+  }
+
+  ck_free(cores);
+
+  last_scale = get_cur_time();
+
+  while (!stop_soon) {
+
+    double runnable;
+
+    sleep(LAUNCH_CHECK_SEC);
+
+    if (stop_soon) break;
+
+    check_instances();
+
+    runnable = get_runnable_processes();
+
+    if (get_cur_time() - last_scale >= LAUNCH_SCALE_SEC * 1000) {
+
+      last_scale = get_cur_time();
+
+      show_status(runnable);
+      scale_instances(runnable);
+
+    }
+
+    if (!running_instances() && !inst[0].parked) {
+
+      for (i = 0; i < inst_cnt; i++) if (!inst[i].given_up) break;
+
+      if (i == inst_cnt) FATAL("All instances failed to start");
+
+    }
+
+  }
+
+  SAYF("\n");
+
+  stop_instances();
+
+  OKF("All done, see %s for the results.", sync_dir);
+
+  exit(0);
+
+}
@@ -77,6 +77,14 @@
 #define CAL_CYCLES          8
 #define CAL_CYCLES_LONG     40
 
+/* Unstable bitmap bytes: the counter increment for every calibration in which
+   a byte changes (every calibration in which it is hit, but does not change,
+   takes one point off), and the counter value at which the byte is masked.
+   Masked bytes are unmasked when the counter drops back to zero. */
+
+#define UNSTABLE_VAR_PTS    4
+#define UNSTABLE_MASK_ON    8
+
 /* Number of subsequent timeouts before abandoning an input file: */
 
 #define TMOUT_LIMIT         250
@@ -86,6 +94,36 @@
 #define KEEP_UNIQUE_HANG    500
 #define KEEP_UNIQUE_CRASH   5000
 
+/* With AFL_CRASH_BUCKETS, the maximum number of crashes to keep for any
+   single stack hash, and the number of stack frames that go into the hash: */
+
+#define CRASH_BUCKET_KEEP   3
+#define STACK_HASH_DEPTH    5
+
+/* With AFL_QUEUE_COMPACT, the number of queue cycles an entry must stay
+   redundant before it gets archived: */
+
+#define QUEUE_ARCHIVE_CYCLES 4
+
+/* With AFL_DEDUP_EXECS, the size of the Bloom filter of executed inputs (in
+   bits, must be a power of 2), the number of bits set per input, and the
+   fill ratio (1/n) at which the filter is cleared. With the defaults, the
+   filter takes 8 MB, remembers roughly the last 2M inputs, and has a false
+   positive rate of well under 0.1%: */
+
+#define DEDUP_BLOOM_SIZE    (1 << 26)
+#define DEDUP_BLOOM_HASHES  4
+#define DEDUP_BLOOM_FILL    8
+
+/* With AFL_ADAPTIVE_DET, the number of execs after which per-stage yield
+   counters are halved, the minimum number of execs (for both the stage and
+   havoc) before a stage may be skipped, and how often (1/n entries) a
+   low-yield stage still runs, to keep its numbers current: */
+
+#define DET_YIELD_WINDOW    (5 * 1000 * 1000)
+#define DET_YIELD_MIN_EXECS 50000
+#define DET_YIELD_SAMPLE    8
+
 /* Baseline number of random tweaks during a single 'havoc' stage: */
 
 #define HAVOC_CYCLES        256
@@ -100,6 +138,13 @@
 
 #define HAVOC_MIN           16
 
+/* Power schedules (-p): maximum energy factor assigned to a path relative to
+   the baseline score, and the size of the path frequency table (2^n u32
+   counters, indexed by trace checksum): */
+
+#define POWER_MAX_FACTOR    32
+#define N_FUZZ_SIZE_POW2    20
+
 /* Maximum stacking for havoc-stage tweaks. The actual value is calculated
    like this: 
 
@@ -138,6 +183,51 @@
 
 #define SPLICE_HAVOC        32
 
+/* Number of favored entries to try when looking for a splicing partner that
+   covers edges the current entry does not, before falling back to a random
+   pick: */
+
+#define SPLICE_PICK_TRIES   8
+
+/* With AFL_STRUCT_FIXUPS, the exec budget for structure inference on every
+   queue entry, the maximum number of fields kept per entry, the largest
+   input inferred on, the smallest region a field may describe or cover, and
+   how far into the input to look for CRCs over the rest of it: */
+
+#define STRUCT_INFER_EXECS  256
+#define STRUCT_MAX_FIELDS   16
+#define STRUCT_MAX_LEN      (64 * 1024)
+#define STRUCT_MIN_REGION   4
+#define STRUCT_HDR_MAX      64
+
+/* Custom mutator stage (AFL_CUSTOM_MUTATOR_LIBRARY): baseline number of
+   executions per queue entry (scaled like havoc), the number of outputs the
+   library is asked for in a single call, and the cap on custom trimming
+   attempts per entry: */
+
+#define CUSTOM_CYCLES       1024
+#define CUSTOM_BATCH        16
+#define CUSTOM_TRIM_MAX     1024
+
+/* Grammar stage (-g): baseline number of executions per queue entry (scaled
+   like havoc), maximum stacking of subtree replacements (power of two),
+   depth budget for freshly generated subtrees, the largest input we try to
+   parse, the Earley item budget per parse, and limits on the depth and node
+   count of derivation trees: */
+
+#define GRAMMAR_CYCLES      1024
+#define GRAMMAR_STACK_POW2  3
+#define GRAMMAR_GEN_DEPTH   8
+#define GRAMMAR_MAX_PARSE   8192
+#define GRAMMAR_MAX_ITEMS   (1 << 18)
+#define GRAMMAR_MAX_DEPTH   1024
+#define GRAMMAR_MAX_NODES   65536
+
+/* Maximum number of byte ranges a v2 postprocessor can declare through
+   afl_postprocess_ranges(): */
+
+#define POST_MAX_RANGES     64
+
 /* Maximum offset for integer addition / subtraction stages: */
 
 #define ARITH_MAX           35
@@ -157,6 +247,11 @@
 
 #define TMIN_MAX_FILE       (10 * 1024 * 1024)
 
+/* Test cases at least this large are not rewritten in full when only some
+   of the bytes changed since the previous exec (and the length did not): */
+
+#define DIFF_WRITE_MIN      (64 * 1024)
+
 /* Block normalization steps for afl-tmin: */
 
 #define TMIN_SET_MIN_SIZE   4
@@ -184,6 +279,18 @@
 #define USE_AUTO_EXTRAS     50
 #define MAX_AUTO_EXTRAS     (USE_AUTO_EXTRAS * 10)
 
+/* With AFL_WEIGHTED_EXTRAS, the havoc sampling weight of a token that has
+   not found anything yet, the cap for productive tokens (each find adds
+   EXTRA_WEIGHT_NEW), the weight of a dead token, and the number of execs
+   without a find after which a token is considered dead. EXTRA_TRACK_MAX is
+   the number of tokens per exec that get credit for a find: */
+
+#define EXTRA_WEIGHT_NEW    8
+#define EXTRA_WEIGHT_MAX    64
+#define EXTRA_WEIGHT_DEAD   1
+#define EXTRA_DEAD_USES     10000
+#define EXTRA_TRACK_MAX     16
+
 /* Scaling factor for the effector map used to skip some of the more
    expensive deterministic steps. The actual divisor is set to
    2^EFF_MAP_SCALE2 bytes: */
@@ -265,10 +372,18 @@
  *                                                         *
  ***********************************************************/
 
-/* Call count interval between reseeding the libc PRNG from /dev/urandom: */
+/* Call count interval between reseeding the PRNG from /dev/urandom (unless
+   a fixed seed is given with -s): */
 
 #define RESEED_RNG          10000
 
+/* Size of the probe control area that follows the bitmap and the crash
+   stack hash in the SHM region (see AFL_FAST_PROBES): a generation counter,
+   followed by a bitmap of map bytes whose trace-pc-guard probes should be
+   turned off. */
+
+#define PROBE_CTL_SIZE      (sizeof(u32) + (MAP_SIZE >> 3))
+
 /* Maximum line length passed from GCC to 'as' and used for parsing
    configuration files: */
 
@@ -284,6 +399,9 @@
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define PREFORK_ENV_VAR     "__AFL_PREFORK"
+#define STACK_HASH_ENV_VAR  "__AFL_STACK_HASH"
+#define PROBE_ENV_VAR       "__AFL_FAST_PROBES"
 
 /* In-code signatures for deferred and persistent mode. */
 
@@ -315,6 +433,13 @@
 #define CAL_TMOUT_PERC      125
 #define CAL_TMOUT_ADD       50
 
+/* Per-entry timeouts (AFL_ENTRY_TMOUT): multiple of the calibrated execution
+   time of the queue entry being fuzzed, never below the minimum (ms) and
+   never above the global timeout: */
+
+#define ENTRY_TMOUT_MULT    5
+#define ENTRY_TMOUT_MIN     20
+
 /* Number of chances to calibrate a case before giving up: */
 
 #define CAL_CHANCES         3
@@ -328,6 +453,11 @@
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Maximum history length for N-gram coverage in LLVM mode
+   (AFL_LLVM_NGRAM_SIZE): */
+
+#define NGRAM_SIZE_MAX      16
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
@@ -342,6 +472,23 @@
 #define  CTEST_CORE_TRG_MS  1000
 #define  CTEST_BUSY_CYCLES  (10 * 1000 * 1000)
 
+/* afl-launch: how often to check on the instances, how often to reconsider
+   their number (seconds), for how many of the latter checks in a row a core
+   must be free before starting another instance, when to consider an
+   instance stuck, how long an instance must live for its death not to count
+   as a failed start, how many failed starts in a row to tolerate, how long
+   to wait for the instances to exit on shutdown, and the maximum number of
+   instances: */
+
+#define LAUNCH_CHECK_SEC    5
+#define LAUNCH_SCALE_SEC    60
+#define LAUNCH_IDLE_CHECKS  3
+#define LAUNCH_STALL_SEC    (STATS_UPDATE_SEC * 10)
+#define LAUNCH_MIN_UPTIME   30
+#define LAUNCH_MAX_FAILS    3
+#define LAUNCH_STOP_SEC     10
+#define LAUNCH_MAX_INST     256
+
 /* Uncomment this to use inferior block-coverage-based instrumentation. Note
    that you need to recompile the target binary for this to have any effect: */
 
@@ -353,6 +500,18 @@
 
 // #define SKIP_COUNTS
 
+/* Uncomment one of these to change what happens when a hit count wraps
+   around. By default, a tuple hit exactly 256 times looks as if it was never
+   hit at all; NEVER_ZERO_COUNTS adds the carry back, so that the counter
+   goes from 255 to 1, while SATURATED_COUNTS keeps it stuck at 255. Both
+   cost one extra instruction per location. As with the settings above, the
+   target binary needs to be recompiled. In llvm_mode, the same choice is made
+   without editing this file, by setting AFL_LLVM_NOT_ZERO or
+   AFL_LLVM_SATURATED when compiling with afl-clang-fast: */
+
+// #define NEVER_ZERO_COUNTS
+// #define SATURATED_COUNTS
+
 /* Uncomment this to use instrumentation data to record newly discovered paths,
    but do not use them as seeds for fuzzing. This is useful for conveniently
    measuring coverage that could be attained by a "dumb" fuzzing algorithm: */
@@ -0,0 +1,217 @@
+/*
+  Copyright 2015 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - custom mutator library example
+   ---------------------------------------------------
+
+   Custom mutator libraries let you plug format-aware mutations directly into
+   afl-fuzz. They run as a separate stage of the fuzzing loop, right before
+   havoc, and benefit from the same scheduling and feedback as the built-in
+   strategies. The library is passed to afl-fuzz via
+   AFL_CUSTOM_MUTATOR_LIBRARY and must be compiled with:
+
+     gcc -shared -fPIC -Wall -O3 custom_mutator.so.c -o custom_mutator.so
+
+   The only mandatory function is afl_custom_fuzz(). It receives the current
+   queue entry and an array of cnt buffers, each max_len bytes long, and
+   should write up to cnt mutated variants there, storing their lengths in
+   out_lens[]. The return value is the number of variants produced; returning
+   0 ends the stage early for this entry. Zero-length outputs are skipped.
+
+   Optionally, the library may also export:
+
+     - afl_custom_init(seed), called once at startup; whatever it returns is
+       passed as 'data' to all other calls,
+
+     - afl_custom_trim(data, buf, len, out_buf, step), which replaces the
+       built-in trimmer. It is called with step = 0, 1, 2... and should write
+       a smaller variant of buf to out_buf and return its length, or return 0
+       when it runs out of ideas. Variants that do not change the execution
+       path replace buf, so the next call sees the shortened input,
+
+     - afl_custom_queue_new_entry(data, fname, buf, len), called whenever a
+       new test case is added to the queue,
+
+     - afl_custom_deinit(data), called on exit.
+
+   As with postprocessors, do not modify 'buf' and be very careful about
+   malformed data: a crash in the library takes afl-fuzz down with it.
+
+   The example below treats inputs as text and mutates them line by line:
+   lines are duplicated, dropped, or swapped, which is something the
+   byte-oriented havoc stage is not particularly good at.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Maximum number of lines we bother indexing: */
+
+#define MAX_LINES 1024
+
+struct state {
+  unsigned int rand;
+  unsigned int line_off[MAX_LINES + 1];
+};
+
+static unsigned int rand_below(struct state* s, unsigned int limit) {
+
+  /* Simple LCG; good enough for picking lines. */
+
+  s->rand = s->rand * 1103515245 + 12345;
+  return (s->rand >> 8) % limit;
+
+}
+
+/* Split buf into lines, recording the offset of each line start and the end
+   of the buffer as a sentinel. Returns the number of lines. */
+
+static unsigned int index_lines(struct state* s, const unsigned char* buf,
+                                unsigned int len) {
+
+  unsigned int cnt = 0, i;
+
+  s->line_off[cnt++] = 0;
+
+  for (i = 0; i < len && cnt < MAX_LINES; i++)
+    if (buf[i] == '\n' && i + 1 < len) s->line_off[cnt++] = i + 1;
+
+  s->line_off[cnt] = len;
+  return cnt;
+
+}
+
+void* afl_custom_init(unsigned int seed) {
+
+  struct state* s = calloc(1, sizeof(struct state));
+  if (s) s->rand = seed;
+  return s;
+
+}
+
+unsigned int afl_custom_fuzz(void* data, const unsigned char* buf,
+                             unsigned int len, unsigned char** out_bufs,
+                             unsigned int* out_lens, unsigned int cnt,
+                             unsigned int max_len) {
+
+  struct state* s = data;
+  unsigned int lines, i;
+
+  if (!s || !len) return 0;
+
+  lines = index_lines(s, buf, len);
+
+  for (i = 0; i < cnt; i++) {
+
+    unsigned char* out = out_bufs[i];
+    unsigned int a = rand_below(s, lines), b = rand_below(s, lines);
+    unsigned int a_len = s->line_off[a + 1] - s->line_off[a];
+    unsigned int b_len = s->line_off[b + 1] - s->line_off[b];
+    unsigned int o = 0;
+
+    switch (rand_below(s, 3)) {
+
+      case 0:
+
+        /* Duplicate line a. */
+
+        if (len + a_len > max_len) { out_lens[i] = 0; continue; }
+
+        memcpy(out, buf, s->line_off[a + 1]);
+        o = s->line_off[a + 1];
+        memcpy(out + o, buf + s->line_off[a], len - s->line_off[a]);
+        o += len - s->line_off[a];
+        break;
+
+      case 1:
+
+        /* Drop line a. */
+
+        memcpy(out, buf, s->line_off[a]);
+        o = s->line_off[a];
+        memcpy(out + o, buf + s->line_off[a + 1], len - s->line_off[a + 1]);
+        o += len - s->line_off[a + 1];
+        break;
+
+      default:
+
+        /* Swap lines a and b. */
+
+        if (a > b) { unsigned int t = a; a = b; b = t;
+                     t = a_len; a_len = b_len; b_len = t; }
+
+        memcpy(out, buf, len);
+
+        if (a != b) {
+
+          o = s->line_off[a];
+          memcpy(out + o, buf + s->line_off[b], b_len);
+          o += b_len;
+          memcpy(out + o, buf + s->line_off[a + 1],
+                 s->line_off[b] - s->line_off[a + 1]);
+          o += s->line_off[b] - s->line_off[a + 1];
+          memcpy(out + o, buf + s->line_off[a], a_len);
+
+        }
+
+        o = len;
+        break;
+
+    }
+
+    out_lens[i] = o;
+
+  }
+
+  return cnt;
+
+}
+
+/* Trimming: try dropping one line at a time, starting from the end. */
+
+unsigned int afl_custom_trim(void* data, const unsigned char* buf,
+                             unsigned int len, unsigned char* out_buf,
+                             unsigned int step) {
+
+  struct state* s = data;
+  unsigned int lines, drop;
+
+  if (!s) return 0;
+
+  lines = index_lines(s, buf, len);
+
+  if (lines < 2 || step >= lines) return 0;
+
+  /* Successful trims shorten buf, so 'step' is only a rough cursor. */
+
+  drop = lines - 1 - (step % lines);
+
+  memcpy(out_buf, buf, s->line_off[drop]);
+  memcpy(out_buf + s->line_off[drop], buf + s->line_off[drop + 1],
+         len - s->line_off[drop + 1]);
+
+  return len - (s->line_off[drop + 1] - s->line_off[drop]);
+
+}
+
+void afl_custom_deinit(void* data) {
+
+  free(data);
+
+}
@@ -66,6 +66,29 @@
 
       *** DO NOT MODIFY THE ORIGINAL 'in_buf' BUFFER. ***
 
+   Newer versions of afl-fuzz also support a zero-copy interface, preferred
+   whenever the library exports it:
+
+     unsigned int afl_postprocess_v2(unsigned char* buf, unsigned int len);
+
+   Here, you modify 'buf' directly (without changing its length) and return
+   1 to run the test case or 0 to skip it. The optional companion function:
+
+     unsigned int afl_postprocess_ranges(const unsigned char* buf,
+                                         unsigned int len,
+                                         unsigned int* ranges,
+                                         unsigned int max_ranges);
+
+   ...is called once for every queue entry and should store up to max_ranges
+   start / end offset pairs in ranges[], covering all the bytes that may
+   require fixing up when modified, and return the number of pairs (or a
+   number greater than max_ranges if it's impossible to tell). Mutations that
+   leave all these bytes alone then skip afl_postprocess_v2() altogether.
+   Until the next call, the buffers passed to afl_postprocess_v2() are mostly
+   mutations of this one, so a library can also keep a copy of it to tell
+   which parts of the input actually need to be fixed up. See
+   post_library_png.so.c for an example of both.
+
     Aight. The example below shows a simple postprocessor that tries to make
     sure that all input files start with "GIF89a".
 
@@ -0,0 +1,664 @@
+/*
+  Copyright 2016 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+
+   american fuzzy lop - deferred init point discovery
+   --------------------------------------------------
+
+   This Linux-only companion library watches a single run of the target,
+   records the call stacks at which the input file is first opened and first
+   read, and suggests the latest function entry at which the forkserver can
+   be safely started. See README.deferinit for more info.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include <execinfo.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../types.h"
+#include "../config.h"
+
+#ifndef __linux__
+#  error "Sorry, this library is Linux-specific for now!"
+#endif /* !__linux__ */
+
+
+/* Maximum stack depth recorded, and the number of input fds tracked. */
+
+#define MAX_FRAMES  64
+#define MAX_FDS     16
+
+struct stack {
+  void* addr[MAX_FRAMES];
+  u32   cnt;
+};
+
+static struct stack __deferinit_open,      /* Stack at first open of input */
+                    __deferinit_read;      /* Stack at first read of input */
+
+static u8   __deferinit_opened,            /* Input opened by name?        */
+            __deferinit_done,              /* Report written?              */
+            __deferinit_busy;              /* Inside our own code?         */
+
+static u32  __deferinit_threads;           /* pthread_create() calls so far */
+
+static s32  __deferinit_fds[MAX_FDS];      /* Descriptors of the input     */
+static u32  __deferinit_fd_cnt;
+
+static dev_t __deferinit_dev;              /* Input file identity          */
+static ino_t __deferinit_ino;
+
+static FILE* __deferinit_out_file;
+
+/* Main program: load bias, mapped range, and the symbol table. */
+
+static u8*  __deferinit_exe_base;
+static u8*  __deferinit_exe_start;
+static u8*  __deferinit_exe_end;
+static u8*  __deferinit_exe_name;
+
+static ElfW(Sym)* __deferinit_syms;
+static u32        __deferinit_sym_cnt;
+static char*      __deferinit_strs;
+
+
+/* Find the main program, which dl_iterate_phdr() always lists first. */
+
+static int __deferinit_find_exe(struct dl_phdr_info* info, size_t size,
+                                void* data) {
+
+  u32 i;
+
+  __deferinit_exe_base  = (u8*)info->dlpi_addr;
+  __deferinit_exe_start = (u8*)-1;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+
+    const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+    u8* st = __deferinit_exe_base + ph->p_vaddr;
+
+    if (ph->p_type != PT_LOAD) continue;
+
+    if (st < __deferinit_exe_start) __deferinit_exe_start = st;
+    if (st + ph->p_memsz > __deferinit_exe_end)
+      __deferinit_exe_end = st + ph->p_memsz;
+
+  }
+
+  return 1;
+
+}
+
+
+/* Map /proc/self/exe and locate its symbol table. Static functions are only
+   listed in .symtab, so we prefer that over .dynsym. */
+
+static void __deferinit_load_syms(void) {
+
+  struct stat st;
+  ElfW(Ehdr)* eh;
+  ElfW(Shdr)* sh;
+  u8* img;
+  u32 i;
+  s32 fd = open("/proc/self/exe", O_RDONLY);
+
+  if (fd < 0) return;
+
+  if (fstat(fd, &st) || st.st_size < sizeof(ElfW(Ehdr))) { close(fd); return; }
+
+  img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (img == MAP_FAILED) return;
+
+  eh = (ElfW(Ehdr)*)img;
+
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+      eh->e_shoff + eh->e_shnum * sizeof(ElfW(Shdr)) > st.st_size) return;
+
+  sh = (ElfW(Shdr)*)(img + eh->e_shoff);
+
+  for (i = 0; i < eh->e_shnum; i++) {
+
+    if (sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM) continue;
+    if (__deferinit_syms && sh[i].sh_type == SHT_DYNSYM) continue;
+    if (sh[i].sh_link >= eh->e_shnum) continue;
+
+    __deferinit_syms    = (ElfW(Sym)*)(img + sh[i].sh_offset);
+    __deferinit_sym_cnt = sh[i].sh_size / sizeof(ElfW(Sym));
+    __deferinit_strs    = (char*)(img + sh[sh[i].sh_link].sh_offset);
+
+  }
+
+}
+
+
+/* Resolve a code address to the name and start of the enclosing function.
+   Returns NULL if unknown. */
+
+static const char* __deferinit_symbolize(void* addr, u8** start) {
+
+  u8* a = addr;
+  u32 i;
+  Dl_info di;
+
+  if (a >= __deferinit_exe_start && a < __deferinit_exe_end) {
+
+    u64 off = a - __deferinit_exe_base;
+
+    for (i = 0; i < __deferinit_sym_cnt; i++) {
+
+      ElfW(Sym)* s = &__deferinit_syms[i];
+
+      if (ELF64_ST_TYPE(s->st_info) != STT_FUNC || !s->st_value) continue;
+
+      if (off >= s->st_value && off < s->st_value + s->st_size) {
+        *start = __deferinit_exe_base + s->st_value;
+        return __deferinit_strs + s->st_name;
+      }
+
+    }
+
+    return NULL;
+
+  }
+
+  if (dladdr(addr, &di) && di.dli_sname) {
+    *start = di.dli_saddr;
+    return di.dli_sname;
+  }
+
+  return NULL;
+
+}
+
+
+/* Record the current call stack, minus our own frames. Return addresses
+   point past the call, so we step back by one byte to stay within the
+   calling function. */
+
+static void __deferinit_capture(struct stack* s) {
+
+  void* raw[MAX_FRAMES];
+  Dl_info self, di;
+  s32 cnt = backtrace(raw, MAX_FRAMES), i;
+
+  dladdr((void*)__deferinit_capture, &self);
+
+  s->cnt = 0;
+
+  for (i = 0; i < cnt; i++) {
+
+    if (dladdr(raw[i], &di) && di.dli_fbase == self.dli_fbase) continue;
+    s->addr[s->cnt++] = (u8*)raw[i] - 1;
+
+  }
+
+}
+
+
+static void __deferinit_dump(const char* what, struct stack* s) {
+
+  u32 i;
+
+  fprintf(__deferinit_out_file, "[deferinit] %s:\n", what);
+
+  for (i = 0; i < s->cnt; i++) {
+
+    u8* start = NULL;
+    const char* name = __deferinit_symbolize(s->addr[i], &start);
+    Dl_info di;
+
+    if ((u8*)s->addr[i] >= __deferinit_exe_start &&
+        (u8*)s->addr[i] < __deferinit_exe_end)
+      fprintf(__deferinit_out_file, "    #%-2u %s+0x%llx", i,
+              __deferinit_exe_name,
+              (u64)((u8*)s->addr[i] - __deferinit_exe_base));
+    else if (dladdr(s->addr[i], &di) && di.dli_fname)
+      fprintf(__deferinit_out_file, "    #%-2u %s+0x%llx", i, di.dli_fname,
+              (u64)((u8*)s->addr[i] - (u8*)di.dli_fbase));
+    else
+      fprintf(__deferinit_out_file, "    #%-2u %p", i, s->addr[i]);
+
+    if (name) fprintf(__deferinit_out_file, " in %s()", name);
+    fprintf(__deferinit_out_file, "\n");
+
+  }
+
+}
+
+
+/* Pick the deepest function in the main program whose single invocation
+   covers both the open and the first read of the input, and write the
+   report. Frames are matched from the outermost one inwards. */
+
+static void __deferinit_report(void) {
+
+  struct stack* r = &__deferinit_read;
+  s32 pick = 0;
+
+  __deferinit_done = 1;
+
+  if (__deferinit_opened) {
+
+    struct stack* o = &__deferinit_open;
+    u32 same = 0;
+
+    while (same < r->cnt && same < o->cnt &&
+           r->addr[r->cnt - same - 1] == o->addr[o->cnt - same - 1]) same++;
+
+    /* The first differing frame is in the function called from the last
+       common call site. */
+
+    pick = r->cnt - same - 1;
+    if (pick < 0) pick = 0;
+
+    __deferinit_dump("Input file first opened at", o);
+
+  }
+
+  __deferinit_dump("Input first read at", r);
+
+  /* Walk outwards until we get to code in the main program that we know
+     the name of. */
+
+  while (pick < r->cnt) {
+
+    u8* start = NULL;
+    const char* name = __deferinit_symbolize(r->addr[pick], &start);
+
+    if (name && (u8*)r->addr[pick] >= __deferinit_exe_start &&
+        (u8*)r->addr[pick] < __deferinit_exe_end) {
+
+      fprintf(__deferinit_out_file,
+              "[deferinit] Latest safe init point: entry of %s() (%s+0x%llx).\n"
+              "[deferinit] Build with AFL_LLVM_DEFER_FUNC=%s to start the "
+              "forkserver there,\n"
+              "            or put __AFL_INIT() at the beginning of that "
+              "function.\n", name, __deferinit_exe_name,
+              (u64)(start - __deferinit_exe_base), name);
+
+      if (!strcmp(name, "main"))
+        fprintf(__deferinit_out_file,
+                "[deferinit] Note that this is no better than the default.\n");
+
+      break;
+
+    }
+
+    pick++;
+
+  }
+
+  if (pick == r->cnt)
+    fprintf(__deferinit_out_file,
+            "[deferinit] No named function found in the main program; it may "
+            "be stripped.\n");
+
+  if (__deferinit_threads)
+    fprintf(__deferinit_out_file,
+            "[deferinit] WARNING: %u thread(s) were started before that point. "
+            "The forkserver\n"
+            "            does not preserve them, so unless they are gone by "
+            "then, deferred\n"
+            "            init there is unsafe.\n", __deferinit_threads);
+
+  fflush(__deferinit_out_file);
+
+}
+
+
+/* Check if an fd refers to the input. */
+
+static u8 __deferinit_is_input(s32 fd) {
+
+  u32 i;
+
+  for (i = 0; i < __deferinit_fd_cnt; i++)
+    if (__deferinit_fds[i] == fd) return 1;
+
+  return 0;
+
+}
+
+
+/* Called after an open: if it's the input, start tracking the fd. */
+
+static void __deferinit_opened_fd(s32 fd) {
+
+  struct stat st;
+
+  if (fd < 0 || __deferinit_done || __deferinit_busy || !__deferinit_ino)
+    return;
+
+  if (fstat(fd, &st) || st.st_dev != __deferinit_dev ||
+      st.st_ino != __deferinit_ino) return;
+
+  __deferinit_busy = 1;
+
+  if (!__deferinit_opened) {
+    __deferinit_capture(&__deferinit_open);
+    __deferinit_opened = 1;
+  }
+
+  if (__deferinit_fd_cnt < MAX_FDS) __deferinit_fds[__deferinit_fd_cnt++] = fd;
+
+  __deferinit_busy = 0;
+
+}
+
+
+/* Called before reading from an fd. */
+
+static void __deferinit_reading(s32 fd) {
+
+  if (__deferinit_done || __deferinit_busy || !__deferinit_is_input(fd))
+    return;
+
+  __deferinit_busy = 1;
+  __deferinit_capture(&__deferinit_read);
+  __deferinit_report();
+  __deferinit_busy = 0;
+
+}
+
+
+/* Replacements for libc calls. The originals are looked up lazily. */
+
+#define ORIG(_name, _ret, ...) \
+  static _ret (*_o)(__VA_ARGS__); \
+  if (!_o) _o = dlsym(RTLD_NEXT, _name)
+
+#define GET_MODE(_flags) \
+  mode_t mode = 0; \
+  if ((_flags) & (O_CREAT | O_TMPFILE)) { \
+    va_list ap; \
+    va_start(ap, _flags); \
+    mode = va_arg(ap, int); \
+    va_end(ap); \
+  }
+
+int open(const char* path, int flags, ...) {
+
+  s32 fd;
+  GET_MODE(flags);
+  ORIG("open", int, const char*, int, ...);
+
+  fd = _o(path, flags, mode);
+  __deferinit_opened_fd(fd);
+  return fd;
+
+}
+
+
+int open64(const char* path, int flags, ...) {
+
+  s32 fd;
+  GET_MODE(flags);
+  ORIG("open64", int, const char*, int, ...);
+
+  fd = _o(path, flags, mode);
+  __deferinit_opened_fd(fd);
+  return fd;
+
+}
+
+
+int openat(int dirfd, const char* path, int flags, ...) {
+
+  s32 fd;
+  GET_MODE(flags);
+  ORIG("openat", int, int, const char*, int, ...);
+
+  fd = _o(dirfd, path, flags, mode);
+  __deferinit_opened_fd(fd);
+  return fd;
+
+}
+
+
+FILE* fopen(const char* path, const char* mode) {
+
+  FILE* f;
+  ORIG("fopen", FILE*, const char*, const char*);
+
+  f = _o(path, mode);
+  if (f) __deferinit_opened_fd(fileno(f));
+  return f;
+
+}
+
+
+FILE* fopen64(const char* path, const char* mode) {
+
+  FILE* f;
+  ORIG("fopen64", FILE*, const char*, const char*);
+
+  f = _o(path, mode);
+  if (f) __deferinit_opened_fd(fileno(f));
+  return f;
+
+}
+
+
+int close(int fd) {
+
+  u32 i;
+  ORIG("close", int, int);
+
+  for (i = 0; i < __deferinit_fd_cnt; i++)
+    if (__deferinit_fds[i] == fd)
+      __deferinit_fds[i] = __deferinit_fds[--__deferinit_fd_cnt];
+
+  return _o(fd);
+
+}
+
+
+ssize_t read(int fd, void* buf, size_t len) {
+
+  ORIG("read", ssize_t, int, void*, size_t);
+  __deferinit_reading(fd);
+  return _o(fd, buf, len);
+
+}
+
+
+ssize_t pread(int fd, void* buf, size_t len, off_t off) {
+
+  ORIG("pread", ssize_t, int, void*, size_t, off_t);
+  __deferinit_reading(fd);
+  return _o(fd, buf, len, off);
+
+}
+
+
+ssize_t pread64(int fd, void* buf, size_t len, off64_t off) {
+
+  ORIG("pread64", ssize_t, int, void*, size_t, off64_t);
+  __deferinit_reading(fd);
+  return _o(fd, buf, len, off);
+
+}
+
+
+ssize_t readv(int fd, const struct iovec* iov, int cnt) {
+
+  ORIG("readv", ssize_t, int, const struct iovec*, int);
+  __deferinit_reading(fd);
+  return _o(fd, iov, cnt);
+
+}
+
+
+void* mmap(void* addr, size_t len, int prot, int flags, int fd, off_t off) {
+
+  ORIG("mmap", void*, void*, size_t, int, int, int, off_t);
+  if (!(flags & MAP_ANONYMOUS)) __deferinit_reading(fd);
+  return _o(addr, len, prot, flags, fd, off);
+
+}
+
+
+void* mmap64(void* addr, size_t len, int prot, int flags, int fd,
+             off64_t off) {
+
+  ORIG("mmap64", void*, void*, size_t, int, int, int, off64_t);
+  if (!(flags & MAP_ANONYMOUS)) __deferinit_reading(fd);
+  return _o(addr, len, prot, flags, fd, off);
+
+}
+
+
+/* Buffered I/O does not go through the read() above, since libc calls its
+   internal version directly. */
+
+size_t fread(void* buf, size_t size, size_t n, FILE* f) {
+
+  ORIG("fread", size_t, void*, size_t, size_t, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(buf, size, n, f);
+
+}
+
+
+char* fgets(char* buf, int len, FILE* f) {
+
+  ORIG("fgets", char*, char*, int, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(buf, len, f);
+
+}
+
+
+int fgetc(FILE* f) {
+
+  ORIG("fgetc", int, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(f);
+
+}
+
+
+#undef getc
+
+int getc(FILE* f) {
+
+  ORIG("getc", int, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(f);
+
+}
+
+
+#undef getchar
+
+int getchar(void) {
+
+  ORIG("getchar", int, void);
+  __deferinit_reading(0);
+  return _o();
+
+}
+
+
+ssize_t getdelim(char** line, size_t* len, int delim, FILE* f) {
+
+  ORIG("getdelim", ssize_t, char**, size_t*, int, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(line, len, delim, f);
+
+}
+
+
+ssize_t getline(char** line, size_t* len, FILE* f) {
+
+  ORIG("getline", ssize_t, char**, size_t*, FILE*);
+  __deferinit_reading(fileno(f));
+  return _o(line, len, f);
+
+}
+
+
+/* Threads started before the init point are lost in the forked children. */
+
+int pthread_create(pthread_t* t, const pthread_attr_t* attr,
+                   void* (*fn)(void*), void* arg) {
+
+  ORIG("pthread_create", int, pthread_t*, const pthread_attr_t*,
+       void* (*)(void*), void*);
+
+  if (!__deferinit_done) __deferinit_threads++;
+  return _o(t, attr, fn, arg);
+
+}
+
+
+/* Init code: figure out what the input is, open the output file (or default
+   to stderr), and warm up backtrace(), which may need to load libgcc_s. */
+
+__attribute__((constructor)) void __deferinit_init(void) {
+
+  u8* fn = getenv("AFL_DEFER_INPUT");
+  u8* out = getenv("AFL_DEFER_REPORT");
+  void* dummy[1];
+  struct stat st;
+
+  __deferinit_busy = 1;
+
+  if (out) __deferinit_out_file = fopen(out, "a");
+  if (!__deferinit_out_file) __deferinit_out_file = stderr;
+
+  backtrace(dummy, 1);
+
+  dl_iterate_phdr(__deferinit_find_exe, NULL);
+  __deferinit_load_syms();
+
+  __deferinit_exe_name = realpath("/proc/self/exe", NULL);
+  if (!__deferinit_exe_name) __deferinit_exe_name = "<main>";
+
+  /* With no input file given, we watch stdin. */
+
+  if (fn) {
+
+    if (stat(fn, &st)) {
+      fprintf(__deferinit_out_file, "[deferinit] Unable to stat '%s'.\n", fn);
+      __deferinit_done = 1;
+    } else {
+      __deferinit_dev = st.st_dev;
+      __deferinit_ino = st.st_ino;
+    }
+
+  } else __deferinit_fds[__deferinit_fd_cnt++] = 0;
+
+  __deferinit_busy = 0;
+
+}
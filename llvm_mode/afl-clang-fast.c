@@ -133,6 +133,17 @@ static void edit_params(u32 argc, char** argv) {
   cc_params[cc_par_cnt++] = "-sanitizer-coverage-block-threshold=0";
 #endif
 #else
+
+  /* The comparison splitting pass must be loaded first, so that it gets to
+     run ahead of the instrumentation. */
+
+  if (getenv("AFL_LLVM_SPLIT_COMPARES")) {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-split-pass.so", obj_path);
+  }
+
   cc_params[cc_par_cnt++] = "-Xclang";
   cc_params[cc_par_cnt++] = "-load";
   cc_params[cc_par_cnt++] = "-Xclang";
@@ -204,6 +215,18 @@ static void edit_params(u32 argc, char** argv) {
   if (getenv("AFL_INST_RATIO"))
     FATAL("AFL_INST_RATIO not available at compile time with 'trace-pc'.");
 
+  if (getenv("AFL_LLVM_CTX") || getenv("AFL_LLVM_NGRAM_SIZE"))
+    FATAL("AFL_LLVM_CTX and AFL_LLVM_NGRAM_SIZE not available with 'trace-pc'.");
+
+  if (getenv("AFL_LLVM_SPLIT_COMPARES"))
+    FATAL("AFL_LLVM_SPLIT_COMPARES not available with 'trace-pc'.");
+
+  if (getenv("AFL_LLVM_NOT_ZERO") || getenv("AFL_LLVM_SATURATED"))
+    FATAL("AFL_LLVM_NOT_ZERO and AFL_LLVM_SATURATED not available with 'trace-pc'.");
+
+  if (getenv("AFL_LLVM_DEFER_FUNC"))
+    FATAL("AFL_LLVM_DEFER_FUNC not available with 'trace-pc'.");
+
 #endif /* USE_TRACE_PC */
 
   if (!getenv("AFL_DONT_OPTIMIZE")) {
@@ -0,0 +1,159 @@
+/*
+  Copyright 2015 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - LLVMFuzzerTestOneInput() driver
+   ----------------------------------------------------
+
+   This file provides main() for libFuzzer-style harnesses, so that they can
+   be fuzzed in persistent mode without writing any glue code. Link it with
+   the harness like so:
+
+     ../afl-clang-fast -c harness.c -o harness.o
+     ../afl-clang-fast harness.o ../afl-llvm-driver.o -o harness
+
+   The driver reads the test case from stdin or, if a file name is given on
+   the command line (e.g., @@), from that file, and hands it over to
+   LLVMFuzzerTestOneInput(). LLVMFuzzerInitialize() is called just once, if
+   the harness provides it.
+
+   The driver embeds both the persistent and the deferred forkserver
+   signatures. By default, the forkserver is started right away; setting
+   AFL_DRIVER_DEFER moves that point past LLVMFuzzerInitialize(), which is
+   worth it when the harness performs expensive one-time setup.
+*/
+
+#include "../config.h"
+#include "../types.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+/* Number of iterations before the process is recycled. Can be overridden
+   with AFL_DRIVER_LOOP. */
+
+#define DRIVER_LOOP_CNT 1000
+
+/* Harness entry points. LLVMFuzzerInitialize() is optional. */
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+__attribute__((weak)) int LLVMFuzzerInitialize(int* argc, char*** argv);
+
+/* Provided by afl-llvm-rt.o. */
+
+int  __afl_persistent_loop(unsigned int max_cnt);
+void __afl_manual_init(void);
+
+/* Signatures picked up by afl-fuzz; see the notes in afl-clang-fast.c about
+   keeping them alive through the optimizer and the linker. */
+
+static volatile char* persist_sig __attribute__((used));
+static volatile char* defer_sig __attribute__((used));
+
+
+/* Read the whole input into a reusable buffer, returning the number of bytes
+   read. Data beyond MAX_FILE is silently dropped. */
+
+static size_t read_input(int fd, u8* buf) {
+
+  size_t len = 0;
+  ssize_t res;
+
+  while (len < MAX_FILE) {
+
+    res = read(fd, buf + len, MAX_FILE - len);
+    if (res <= 0) break;
+    len += res;
+
+  }
+
+  return len;
+
+}
+
+
+/* Main entry point. */
+
+int main(int argc, char** argv) {
+
+  u8* in_file = NULL;
+  u8* x;
+  u8* buf;
+  u32 loop_cnt = DRIVER_LOOP_CNT;
+  u8  defer = !!getenv("AFL_DRIVER_DEFER");
+
+  /* Options meant for libFuzzer (-runs=N etc) are ignored. */
+
+  if (argc > 1 && argv[argc - 1][0] != '-') in_file = (u8*)argv[argc - 1];
+
+  persist_sig = PERSIST_SIG;
+  defer_sig   = DEFER_SIG;
+
+  x = getenv("AFL_DRIVER_LOOP");
+  if (x) loop_cnt = atoi(x);
+
+  if (!loop_cnt) {
+    fprintf(stderr, "[-] ERROR: Invalid AFL_DRIVER_LOOP.\n");
+    abort();
+  }
+
+  /* Because of the embedded DEFER_SIG, afl-fuzz always asks the runtime not
+     to start the forkserver on its own; it is our job to do it here. */
+
+  if (!defer) __afl_manual_init();
+
+  if (LLVMFuzzerInitialize) LLVMFuzzerInitialize(&argc, &argv);
+
+  if (defer) __afl_manual_init();
+
+  /* The buffer is allocated once and reused for all iterations. */
+
+  buf = malloc(MAX_FILE);
+  if (!buf) abort();
+
+  while (__afl_persistent_loop(loop_cnt)) {
+
+    int    fd = 0;
+    size_t len;
+
+    if (in_file) {
+
+      fd = open((char*)in_file, O_RDONLY);
+
+      if (fd < 0) {
+        fprintf(stderr, "[-] ERROR: Unable to open '%s'.\n", in_file);
+        abort();
+      }
+
+    }
+
+    len = read_input(fd, buf);
+
+    if (in_file) close(fd);
+
+    LLVMFuzzerTestOneInput(buf, len);
+
+  }
+
+  free(buf);
+
+  return 0;
+
+}
@@ -37,11 +37,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <map>
 #include <set>
 #include <vector>
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
@@ -104,6 +107,34 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   }
 
+  /* Optional coverage metrics: AFL_LLVM_CTX mixes a hash of the calling
+     context into every edge ID, while AFL_LLVM_NGRAM_SIZE=n derives the ID
+     from the last n - 1 block IDs rather than just the previous one. Either
+     way, the IDs stay within MAP_SIZE. */
+
+  char ctx_mode = !!getenv("AFL_LLVM_CTX");
+  char* ngram_size_str = getenv("AFL_LLVM_NGRAM_SIZE");
+  unsigned int ngram_size = 0;
+
+  if (ngram_size_str) {
+
+    if (sscanf(ngram_size_str, "%u", &ngram_size) != 1 || ngram_size < 2 ||
+        ngram_size > NGRAM_SIZE_MAX)
+      FATAL("Bad value of AFL_LLVM_NGRAM_SIZE (must be between 2 and %u)",
+            NGRAM_SIZE_MAX);
+
+  }
+
+  /* Hit count semantics on overflow: AFL_LLVM_NOT_ZERO makes the counter
+     skip zero on wrap-around (255 -> 1), AFL_LLVM_SATURATED makes it stick
+     at 255. The default is plain modulo-256 arithmetic. */
+
+  char not_zero  = !!getenv("AFL_LLVM_NOT_ZERO");
+  char saturated = !!getenv("AFL_LLVM_SATURATED");
+
+  if (not_zero && saturated)
+    FATAL("AFL_LLVM_NOT_ZERO and AFL_LLVM_SATURATED are mutually exclusive");
+
   /* Get globals for the SHM region and the previous location. Note that
      __afl_prev_loc is thread-local. */
 
@@ -119,11 +150,66 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
+  GlobalVariable *AFLPrevCtx = NULL, *AFLPrevNgram = NULL;
+  Type *NgramTy = NULL;
+
+  if (ctx_mode)
+    AFLPrevCtx = new GlobalVariable(
+        M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_ctx",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+
+  if (ngram_size) {
+
+    AFLPrevNgram = new GlobalVariable(
+        M, ArrayType::get(Int32Ty, NGRAM_SIZE_MAX), false,
+        GlobalValue::ExternalLinkage, 0, "__afl_prev_ngram", 0,
+        GlobalVariable::GeneralDynamicTLSModel, 0, false);
+
+#if LLVM_VERSION_MAJOR >= 11
+    NgramTy = FixedVectorType::get(Int32Ty, ngram_size - 1);
+#else
+    NgramTy = VectorType::get(Int32Ty, ngram_size - 1);
+#endif /* ^LLVM_VERSION_MAJOR >= 11 */
+
+  }
+
+  /* Emit code that yields the previous location, i.e. prev_loc in the
+     regular mode or the XOR of the history vector in N-gram mode. In the
+     latter case, the loaded vector is also handed back via NgramVec. */
+
+  auto LoadPrevLoc = [&](IRBuilder<> &IRB, LoadInst **NgramVec) -> Value* {
+
+    if (ngram_size) {
+
+      Value *NgramPtr =
+          IRB.CreateBitCast(AFLPrevNgram, PointerType::get(NgramTy, 0));
+
+      LoadInst *Vec = IRB.CreateLoad(NgramPtr);
+      Vec->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      if (NgramVec) *NgramVec = Vec;
+      return IRB.CreateXorReduce(Vec);
+
+    }
+
+    LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
+    PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    return IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+
+  };
+
+  /* Calling context of every instrumented function, loaded on entry. */
+
+  std::map<Function*, Value*> FuncCtx;
+
   /* Instrument all the things! */
 
   int inst_blocks = 0;
 
-  for (auto &F : M)
+  for (auto &F : M) {
+
+    Value *PrevCtx = NULL;
+
     for (auto &BB : F) {
 
       BasicBlock::iterator IP = BB.getFirstInsertionPt();
@@ -131,6 +217,17 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       if (AFL_R(100) >= inst_ratio) break;
 
+      /* The entry block comes first; grab the calling context there, so
+         that it dominates all the other blocks. */
+
+      if (ctx_mode && !PrevCtx) {
+
+        LoadInst *Ctx = IRB.CreateLoad(AFLPrevCtx);
+        Ctx->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        PrevCtx = FuncCtx[&F] = Ctx;
+
+      }
+
       /* Make up cur_loc */
 
       unsigned int cur_loc = AFL_R(MAP_SIZE);
@@ -139,35 +236,110 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       /* Load prev_loc */
 
-      LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-      PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+      LoadInst *PrevNgram = NULL;
+      Value *PrevLocCasted = LoadPrevLoc(IRB, &PrevNgram);
 
       /* Load SHM pointer */
 
       LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
       MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *MapPtrIdx =
-          IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+
+      /* Note that the xor with cur_loc must remain the first one in the
+         block; the uncovered branch logic below looks for it. */
+
+      Value *EdgeId = IRB.CreateXor(PrevLocCasted, CurLoc);
+      if (PrevCtx) EdgeId = IRB.CreateXor(EdgeId, PrevCtx);
+
+      Value *MapPtrIdx = IRB.CreateGEP(MapPtr, EdgeId);
 
       /* Update bitmap */
 
       LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
       Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+      Value *Incr;
+
+      if (saturated) {
+
+        Value *NotMax =
+            IRB.CreateICmpNE(Counter, ConstantInt::get(Int8Ty, 255));
+        Incr = IRB.CreateAdd(Counter, IRB.CreateZExt(NotMax, Int8Ty));
+
+      } else {
+
+        Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+
+        if (not_zero) {
+          Value *Wrapped = IRB.CreateICmpEQ(Incr, ConstantInt::get(Int8Ty, 0));
+          Incr = IRB.CreateAdd(Incr, IRB.CreateZExt(Wrapped, Int8Ty));
+        }
+
+      }
+
       IRB.CreateStore(Incr, MapPtrIdx)
           ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
-      /* Set prev_loc to cur_loc >> 1 */
+      /* Set prev_loc to cur_loc >> 1; in N-gram mode, shift it into the
+         history vector instead, dropping the oldest entry. */
+
+      if (ngram_size) {
+
+        unsigned int len = ngram_size - 1;
+        SmallVector<Constant*, NGRAM_SIZE_MAX> NewLoc, Mask;
+
+        for (unsigned int i = 0; i < len; i++) {
+          NewLoc.push_back(ConstantInt::get(Int32Ty, cur_loc >> 1));
+          Mask.push_back(ConstantInt::get(Int32Ty, i ? i - 1 : len));
+        }
+
+        Value *Shifted = IRB.CreateShuffleVector(
+            PrevNgram, ConstantVector::get(NewLoc), ConstantVector::get(Mask));
 
-      StoreInst *Store =
-          IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
-      Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        IRB.CreateStore(Shifted, PrevNgram->getPointerOperand())
+            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      } else {
+
+        StoreInst *Store =
+            IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
+        Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      }
 
       inst_blocks++;
 
     }
 
+    /* In context-sensitive mode, every call site publishes its own context
+       for the callee, and restores the caller's context when it returns. */
+
+    if (PrevCtx) {
+
+      std::vector<CallInst*> Calls;
+
+      for (auto &BB : F)
+        for (auto &Inst : BB)
+          if (CallInst *Call = dyn_cast<CallInst>(&Inst))
+            if (!isa<IntrinsicInst>(Call) && !Call->isInlineAsm())
+              Calls.push_back(Call);
+
+      for (auto Call : Calls) {
+
+        IRBuilder<> Pre(Call);
+        Value *CallCtx =
+            Pre.CreateXor(PrevCtx, ConstantInt::get(Int32Ty, AFL_R(MAP_SIZE)));
+        Pre.CreateStore(CallCtx, AFLPrevCtx)
+            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+        IRBuilder<> Post(Call->getNextNode());
+        Post.CreateStore(PrevCtx, AFLPrevCtx)
+            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      }
+
+    }
+
+  }
+
   /*
    * This is added to store xor distance
    * of covered and uncovered branches
@@ -277,9 +449,9 @@ bool AFLCoverage::runOnModule(Module &M) {
             // A block can jump to another block and jump back through call instruction.
             // Thefore, we load AFLPrevLoc instead of using CurId
             if (PrevLocCasted == NULL) {
-              LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-              PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-              PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+              PrevLocCasted = LoadPrevLoc(IRB, NULL);
+              if (FuncCtx.count(&F))
+                PrevLocCasted = IRB.CreateXor(PrevLocCasted, FuncCtx[&F]);
             }
             auto CurLoc = IRB.CreateXor(PrevLocCasted, ConstantInt::get(Int32Ty, NextId));
             if (UCPtr == NULL) {
@@ -287,22 +459,55 @@ bool AFLCoverage::runOnModule(Module &M) {
               UCPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
             }
             Value *UCPtrIdx = IRB.CreateGEP(UCPtr, CurLoc);
-            IRB.CreateStore(XorDists[Idx], UCPtrIdx)
+            /* The slots are 32-bit, whatever the width of the compare (the
+               split compares pass produces 8-bit ones, for instance). */
+            Value *XorDist = IRB.CreateZExtOrTrunc(XorDists[Idx], Int32Ty);
+            IRB.CreateStore(XorDist, UCPtrIdx)
               ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
           }
         }
       }
     }
 
+  /* Optional deferred init point, as suggested by libdeferinit: call
+     __afl_manual_init() on entry to the function named in AFL_LLVM_DEFER_FUNC
+     and embed the signature that __AFL_INIT() would. The signature is weak,
+     since static functions of the same name may live in several modules. */
+
+  char* defer_func = getenv("AFL_LLVM_DEFER_FUNC");
+
+  if (defer_func) {
+
+    Function *DF = M.getFunction(defer_func);
+
+    if (DF && !DF->isDeclaration()) {
+
+      auto Init = M.getOrInsertFunction("__afl_manual_init", Type::getVoidTy(C));
+
+      IRBuilder<> IRB(&*DF->getEntryBlock().getFirstInsertionPt());
+      IRB.CreateCall(Init);
+
+      Constant *Sig = ConstantDataArray::getString(C, DEFER_SIG);
+
+      new GlobalVariable(M, Sig->getType(), true, GlobalValue::WeakAnyLinkage,
+                         Sig, "__afl_defer_sig");
+
+      if (!be_quiet) OKF("Deferred init point placed in %s().", defer_func);
+
+    }
+
+  }
+
   /* Say something nice. */
 
   if (!be_quiet) {
 
     if (!inst_blocks) WARNF("No instrumentation targets found.");
-    else OKF("Instrumented %u locations (%s mode, ratio %u%%).",
+    else OKF("Instrumented %u locations (%s mode, ratio %u%%%s%s).",
              inst_blocks, getenv("AFL_HARDEN") ? "hardened" :
              ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN")) ?
-              "ASAN/MSAN" : "non-hardened"), inst_ratio);
+              "ASAN/MSAN" : "non-hardened"), inst_ratio,
+             ctx_mode ? ", ctx" : "", ngram_size ? ", ngram" : "");
 
   }
 
@@ -26,9 +26,14 @@
    This code is the rewrite of afl-as.h's main_payload.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "../android-ashmem.h"
 #include "../config.h"
 #include "../types.h"
+#include "../hash.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,12 +41,22 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif /* __linux__ */
+
+#ifdef __GLIBC__
+#  include <execinfo.h>
+#  include <link.h>
+#endif /* __GLIBC__ */
+
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
    the LLVM-generated runtime initialization pass, not before. */
@@ -65,12 +80,231 @@ u32* __afl_uc_ptr = __afl_uc_initial;
 
 __thread u32 __afl_prev_loc;
 
+/* State for the optional context-sensitive (AFL_LLVM_CTX) and N-gram
+   (AFL_LLVM_NGRAM_SIZE) coverage modes. The history is loaded as a vector,
+   hence the alignment. */
+
+__thread u32 __afl_prev_ctx;
+__thread u32 __afl_prev_ngram[NGRAM_SIZE_MAX] __attribute__((aligned(64)));
+
 
 /* Running in persistent mode? */
 
 static u8 is_persistent;
 
 
+/* Forking the next child ahead of time (AFL_PREFORK)? */
+
+static u8 is_prefork;
+
+
+/* Restoring writable memory between persistent mode iterations? */
+
+static u8 is_restore;
+
+
+/* Probe control for AFL_FAST_PROBES in 'trace-pc-guard' mode. We remember
+   every guard section along with the original guard values, so that probes
+   can be turned back on as easily as they are turned off. */
+
+#define MAX_GUARD_SECTIONS 64
+
+static struct {
+  u32 *start, *stop, *orig;
+} __afl_guards[MAX_GUARD_SECTIONS];
+
+static u32  __afl_guard_cnt,
+            __afl_probe_gen;
+
+static u32* __afl_probe_ctl;
+
+
+/* Crash stack hashing (AFL_CRASH_BUCKETS). When afl-fuzz asks for it, we hook
+   the fatal signals that nobody else is handling, as well as the sanitizer
+   death callback, and store a hash of the top STACK_HASH_DEPTH frames of the
+   crashing stack in a u32 slot that follows the bitmap in the SHM region.
+   afl-fuzz uses the hash to group crashes into buckets.
+
+   Frames are hashed as offsets within their modules, so that the hash does
+   not depend on ASLR. Module ranges are collected once, before the fork
+   server starts, which keeps the signal handler away from the loader. */
+
+#ifdef __GLIBC__
+
+#define MAX_HASH_MODULES 64
+
+static u32* __afl_stack_hash_ptr;
+
+static struct {
+  uintptr_t base, lo, hi;
+} __afl_mods[MAX_HASH_MODULES];
+
+static u32 __afl_mod_cnt,
+           __afl_libc_mod = (u32)-1;
+
+static u8 __afl_sig_stack[64 * 1024] __attribute__((aligned(16)));
+
+void  __sanitizer_set_death_callback(void (*)(void)) __attribute__((weak));
+void* __asan_get_report_pc(void) __attribute__((weak));
+
+
+static int __afl_add_module(struct dl_phdr_info* info, size_t size,
+                            void* data) {
+
+  uintptr_t lo = (uintptr_t)-1, hi = 0;
+  u32 i;
+
+  if (__afl_mod_cnt == MAX_HASH_MODULES) return 1;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+
+    const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+
+    if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+
+    if (info->dlpi_addr + ph->p_vaddr < lo)
+      lo = info->dlpi_addr + ph->p_vaddr;
+
+    if (info->dlpi_addr + ph->p_vaddr + ph->p_memsz > hi)
+      hi = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+
+  }
+
+  if (lo < hi) {
+
+    u8* name = (u8*)strrchr(info->dlpi_name, '/');
+
+    name = name ? name + 1 : (u8*)info->dlpi_name;
+
+    if (!strncmp((char*)name, "libc.so", 7) ||
+        !strncmp((char*)name, "libc-", 5))
+      __afl_libc_mod = __afl_mod_cnt;
+
+    __afl_mods[__afl_mod_cnt].base = info->dlpi_addr;
+    __afl_mods[__afl_mod_cnt].lo   = lo;
+    __afl_mods[__afl_mod_cnt].hi   = hi;
+    __afl_mod_cnt++;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Hash the current stack and store the result, unless an earlier hook has
+   beaten us to it - ASAN, for one, calls the death callback and then abort()s.
+
+   The first two frames are always ours. Leading frames in libc (the signal
+   trampoline, raise(), abort(), assert() and so on) are the same for every
+   crash and get skipped. If ASAN can tell us where the bad access happened,
+   everything above that point - the reporting machinery - is skipped, too. */
+
+static void __attribute__((noinline)) __afl_hash_stack(void) {
+
+  void* frames[64];
+  u32   offs[STACK_HASH_DEPTH * 2];
+  u32   cnt, i, j, n = 0;
+  s32   start = 2;
+  u32   h;
+
+  if (*__afl_stack_hash_ptr) return;
+
+  cnt = backtrace(frames, 64);
+
+  if (__asan_get_report_pc) {
+
+    void* pc = __asan_get_report_pc();
+
+    for (i = start; pc && i < cnt; i++)
+      if (frames[i] == pc) { start = i; break; }
+
+  }
+
+  for (i = start; i < cnt && n < STACK_HASH_DEPTH * 2; i++) {
+
+    uintptr_t addr = (uintptr_t)frames[i];
+
+    for (j = 0; j < __afl_mod_cnt; j++)
+      if (addr >= __afl_mods[j].lo && addr < __afl_mods[j].hi) break;
+
+    if (j == __afl_mod_cnt || (!n && j == __afl_libc_mod)) continue;
+
+    offs[n++] = j;
+    offs[n++] = addr - __afl_mods[j].base;
+
+  }
+
+  if (!n) return;
+
+  h = hash32(offs, n * sizeof(u32), HASH_CONST);
+  *__afl_stack_hash_ptr = h ? h : 1;
+
+}
+
+
+static void __afl_crash_handler(int sig) {
+
+  __afl_hash_stack();
+
+  /* SA_RESETHAND restored the default action; die the usual way. */
+
+  raise(sig);
+
+}
+
+
+static void __afl_setup_stack_hash(void) {
+
+  static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+  struct sigaction sa, old;
+  stack_t ss;
+  void* tmp;
+  u32 i;
+
+  __afl_stack_hash_ptr = (u32*)(__afl_area_ptr + MAP_SIZE);
+
+  dl_iterate_phdr(__afl_add_module, NULL);
+
+  /* backtrace() loads libgcc_s on first use; get that out of the way. */
+
+  backtrace(&tmp, 1);
+
+  if (__sanitizer_set_death_callback)
+    __sanitizer_set_death_callback(__afl_hash_stack);
+
+  /* Without an alternate stack, stack exhaustion would go unnoticed. */
+
+  if (!sigaltstack(NULL, &ss) && (ss.ss_flags & SS_DISABLE)) {
+
+    ss.ss_sp    = __afl_sig_stack;
+    ss.ss_size  = sizeof(__afl_sig_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __afl_crash_handler;
+  sa.sa_flags   = SA_ONSTACK | SA_RESETHAND;
+  sigemptyset(&sa.sa_mask);
+
+  for (i = 0; i < sizeof(sigs) / sizeof(int); i++) {
+
+    /* Leave the signals claimed by sanitizers and the like alone. */
+
+    if (sigaction(sigs[i], NULL, &old) || old.sa_handler != SIG_DFL) continue;
+
+    sigaction(sigs[i], &sa, NULL);
+
+  }
+
+}
+
+#endif /* __GLIBC__ */
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
@@ -99,6 +333,50 @@ static void __afl_map_shm(void) {
     }
     __afl_area_ptr[0] = 1;
 
+#ifdef __GLIBC__
+    if (getenv(STACK_HASH_ENV_VAR)) __afl_setup_stack_hash();
+#endif /* __GLIBC__ */
+
+    if (getenv(PROBE_ENV_VAR))
+      __afl_probe_ctl = (u32*)(__afl_area_ptr + MAP_SIZE + sizeof(u32));
+
+  }
+
+}
+
+
+/* Sync the trace-pc-guard probes with the control area written by afl-fuzz.
+   This happens in the forkserver, before the next child is created, so the
+   children never see the guards change under their feet. Guards of bytes
+   that are marked in the mask are set to 0, which disables them; everything
+   else gets its original value back. */
+
+static void __afl_apply_probe_mask(void) {
+
+  u8* mask;
+  u32 gen, i;
+
+  if (!__afl_probe_ctl || !__afl_guard_cnt) return;
+
+  gen = *__afl_probe_ctl;
+  if (gen == __afl_probe_gen) return;
+
+  __afl_probe_gen = gen;
+  MEM_BARRIER();
+
+  mask = (u8*)(__afl_probe_ctl + 1);
+
+  for (i = 0; i < __afl_guard_cnt; i++) {
+
+    u32 *g = __afl_guards[i].start, *o = __afl_guards[i].orig;
+
+    while (g < __afl_guards[i].stop) {
+
+      *g = (mask[*o >> 3] & (1 << (*o & 7))) ? 0 : *o;
+      g++; o++;
+
+    }
+
   }
 
 }
@@ -113,6 +391,14 @@ static void __afl_start_forkserver(void) {
 
   u8  child_stopped = 0;
 
+  /* In prefork mode, the next child is forked right after the previous one
+     is reaped, and then waits on its own pipe until afl-fuzz asks for a run.
+     This moves fork() off the critical path. Closing the pipe without a
+     write, or the forkserver going away, makes the parked child exit. */
+
+  s32 parked_pid = -1;
+  int park_fd[2];
+
   /* Phone home and tell the parent that we're OK. If parent isn't there,
      assume we're not running in forkserver mode and just execute program. */
 
@@ -123,6 +409,34 @@ static void __afl_start_forkserver(void) {
     u32 was_killed;
     int status;
 
+    /* Park a fresh child while afl-fuzz is busy with the previous result.
+       A stopped persistent mode child will be resumed instead, so there is
+       no point in having one around. */
+
+    if (is_prefork && !child_stopped && parked_pid < 0) {
+
+      __afl_apply_probe_mask();
+
+      if (pipe(park_fd)) _exit(1);
+
+      parked_pid = fork();
+      if (parked_pid < 0) _exit(1);
+
+      if (!parked_pid) {
+
+        close(FORKSRV_FD);
+        close(FORKSRV_FD + 1);
+        close(park_fd[1]);
+
+        if (read(park_fd[0], tmp, 1) != 1) _exit(0);
+
+        close(park_fd[0]);
+        return;
+
+      }
+
+    }
+
     /* Wait for parent by reading from the pipe. Abort if read fails. */
 
     if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
@@ -136,10 +450,26 @@ static void __afl_start_forkserver(void) {
       if (waitpid(child_pid, &status, 0) < 0) _exit(1);
     }
 
-    if (!child_stopped) {
+    if (!child_stopped && parked_pid > 0) {
+
+      /* Release the parked child. We keep the read end open until now, so
+         that if the child died in the meantime, the write still succeeds
+         and afl-fuzz gets to see the status. */
+
+      child_pid  = parked_pid;
+      parked_pid = -1;
+
+      if (write(park_fd[1], tmp, 1) != 1) _exit(1);
+
+      close(park_fd[0]);
+      close(park_fd[1]);
+
+    } else if (!child_stopped) {
 
       /* Once woken up, create a clone of our process. */
 
+      __afl_apply_probe_mask();
+
       child_pid = fork();
       if (child_pid < 0) _exit(1);
 
@@ -185,12 +515,411 @@ static void __afl_start_forkserver(void) {
 }
 
 
+/* Snapshot-restore for persistent mode (AFL_PERSISTENT_RESTORE). At the start
+   of the loop, we copy every private writable mapping except for the stack.
+   After each iteration, pages written since the last run are put back, using
+   the soft-dirty bits in /proc/self/pagemap (or a plain comparison if the
+   kernel does not track them). Pages that were not populated at snapshot
+   time are simply dropped, heap growth is undone, and anonymous mappings
+   created in the meantime are unmapped. Kernel-side state, such as file
+   descriptors and their offsets, is not covered. */
+
+#ifdef __linux__
+
+#define PM_PRESENT    (1ULL << 63)
+#define PM_SWAPPED    (1ULL << 62)
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+/* Number of pagemap entries read at once, and the maximum number of stray
+   mappings unmapped per iteration. */
+
+#define SNAP_BATCH    4096
+#define SNAP_UNMAP    64
+
+struct snap_region {
+
+  u8* start;                          /* Start address                    */
+  u8* end;                            /* End address                      */
+  u8* copy;                           /* Contents at snapshot time        */
+  u8* present;                        /* Pages populated at snapshot time */
+  u8  seen;                           /* Still mapped as rw-p?            */
+
+};
+
+static struct {
+
+  struct snap_region* reg;            /* Regions, sorted by address       */
+  u32 reg_cnt;                        /* Number of regions                */
+
+  u64 total;                          /* Total size of the regions        */
+  u32 psize;                          /* Page size                        */
+
+  u8* brk;                            /* Program break at snapshot time   */
+
+  u8* store;                          /* All of the above lives here      */
+  u64 store_len;                      /* Size of the store                */
+
+  u64* pm;                            /* Buffer for pagemap entries       */
+
+  u8*  unmap[SNAP_UNMAP][2];          /* Stray mappings to remove         */
+  u32  unmap_cnt;                     /* Number of stray mappings         */
+
+  s32 pagemap_fd;                     /* /proc/self/pagemap               */
+  s32 clear_fd;                       /* /proc/self/clear_refs            */
+
+  u8  soft_dirty;                     /* Kernel tracks soft-dirty bits?   */
+
+} __afl_snap;
+
+
+static void __afl_snap_fatal(char* msg) {
+
+  fprintf(stderr, "[-] ERROR: AFL_PERSISTENT_RESTORE: %s.\n", msg);
+  abort();
+
+}
+
+
+/* Walk /proc/self/maps, calling cb() for every private writable mapping
+   other than the stack. We stay away from stdio and malloc() here, since
+   the heap is part of the state being restored. */
+
+static void __afl_walk_maps(void (*cb)(u8*, u8*, u8)) {
+
+  u8  buf[8192];
+  u32 len = 0;
+  s32 fd = open("/proc/self/maps", O_RDONLY);
+
+  if (fd < 0) __afl_snap_fatal("unable to open /proc/self/maps");
+
+  while (1) {
+
+    ssize_t res = read(fd, buf + len, sizeof(buf) - len - 1);
+    u8 *line = buf, *nl;
+
+    if (res <= 0) break;
+
+    len += res;
+    buf[len] = 0;
+
+    while ((nl = (u8*)strchr((char*)line, '\n'))) {
+
+      u8 *start, *end, *p;
+      u32 i;
+
+      *nl = 0;
+
+      start = (u8*)strtoul((char*)line, (char**)&p, 16);
+      end   = (u8*)strtoul((char*)p + 1, (char**)&p, 16);
+
+      /* Skip permissions, offset, device and inode to get to the path. */
+
+      if (p[1] == 'r' && p[2] == 'w' && p[4] == 'p') {
+
+        p++;
+
+        for (i = 0; i < 4; i++) {
+          while (*p == ' ') p++;
+          while (*p && *p != ' ') p++;
+        }
+
+        while (*p == ' ') p++;
+
+        if (strncmp((char*)p, "[stack", 6)) cb(start, end, !*p);
+
+      }
+
+      line = nl + 1;
+
+    }
+
+    len = buf + len - line;
+
+    /* A line longer than the buffer is not something we expect to see. */
+
+    if (len == sizeof(buf) - 1) len = 0;
+
+    memmove(buf, line, len);
+
+  }
+
+  close(fd);
+
+}
+
+
+/* Read the pagemap entries for n pages, starting at addr. */
+
+static void __afl_read_pagemap(u8* addr, u32 n) {
+
+  u64 off = (u64)(uintptr_t)addr / __afl_snap.psize * 8;
+
+  if (pread(__afl_snap.pagemap_fd, __afl_snap.pm, n * 8, off) != n * 8)
+    __afl_snap_fatal("unable to read /proc/self/pagemap");
+
+}
+
+
+/* Callbacks for the first pass (sizing) and the second pass (recording) of
+   the snapshot. The store may have been merged with a neighboring mapping
+   by the time of the second pass, so we cut it out. */
+
+static void __afl_snap_count(u8* start, u8* end, u8 anon) {
+
+  __afl_snap.reg_cnt++;
+  __afl_snap.total += end - start;
+
+}
+
+
+static void __afl_snap_add(u8* start, u8* end, u8 anon) {
+
+  u8* s_start = __afl_snap.store;
+  u8* s_end   = s_start + __afl_snap.store_len;
+
+  if (end > s_start && start < s_end) {
+
+    if (start < s_start) __afl_snap_add(start, s_start, anon);
+    if (end > s_end) __afl_snap_add(s_end, end, anon);
+    return;
+
+  }
+
+  __afl_snap.reg[__afl_snap.reg_cnt].start = start;
+  __afl_snap.reg[__afl_snap.reg_cnt].end   = end;
+  __afl_snap.reg_cnt++;
+
+}
+
+
+/* Callback used during restore: marks snapshot regions that are still
+   around and notes anonymous mappings that were not there before. */
+
+static void __afl_snap_check(u8* start, u8* end, u8 anon) {
+
+  u8* s_start = __afl_snap.store;
+  u8* s_end   = s_start + __afl_snap.store_len;
+  u8* cur     = start;
+  u32 i;
+
+  if (end > s_start && start < s_end) {
+
+    if (start < s_start) __afl_snap_check(start, s_start, anon);
+    if (end > s_end) __afl_snap_check(s_end, end, anon);
+    return;
+
+  }
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) {
+
+    struct snap_region* r = &__afl_snap.reg[i];
+
+    if (r->end <= start || r->start >= end) continue;
+
+    if (r->start >= start && r->end <= end) r->seen = 1;
+
+    if (anon && r->start > cur && __afl_snap.unmap_cnt < SNAP_UNMAP) {
+      __afl_snap.unmap[__afl_snap.unmap_cnt][0] = cur;
+      __afl_snap.unmap[__afl_snap.unmap_cnt][1] = r->start;
+      __afl_snap.unmap_cnt++;
+    }
+
+    if (r->end > cur) cur = r->end;
+
+  }
+
+  if (anon && cur < end && __afl_snap.unmap_cnt < SNAP_UNMAP) {
+    __afl_snap.unmap[__afl_snap.unmap_cnt][0] = cur;
+    __afl_snap.unmap[__afl_snap.unmap_cnt][1] = end;
+    __afl_snap.unmap_cnt++;
+  }
+
+}
+
+
+/* Take the snapshot. Called once per process, at the start of the loop. */
+
+static void __afl_snapshot(void) {
+
+  u64 table_len, bits_len, off;
+  u32 i, j;
+
+  __afl_snap.psize = sysconf(_SC_PAGESIZE);
+  __afl_snap.brk   = (u8*)syscall(SYS_brk, 0);
+
+  __afl_snap.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  __afl_snap.clear_fd   = open("/proc/self/clear_refs", O_WRONLY);
+
+  if (__afl_snap.pagemap_fd < 0)
+    __afl_snap_fatal("unable to open /proc/self/pagemap");
+
+  __afl_walk_maps(__afl_snap_count);
+
+  /* Cutting the store out may split one region into two. */
+
+  table_len = (__afl_snap.reg_cnt + 2) * sizeof(struct snap_region);
+  bits_len  = __afl_snap.total / __afl_snap.psize / 8 +
+              __afl_snap.reg_cnt + 2;
+
+  __afl_snap.store_len = table_len + bits_len + SNAP_BATCH * 8 +
+                         __afl_snap.total + __afl_snap.psize * 3;
+
+  __afl_snap.store = mmap(NULL, __afl_snap.store_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (__afl_snap.store == MAP_FAILED)
+    __afl_snap_fatal("unable to allocate memory for the snapshot");
+
+  __afl_snap.reg     = (struct snap_region*)__afl_snap.store;
+  __afl_snap.pm      = (u64*)(__afl_snap.store + table_len);
+  __afl_snap.reg_cnt = 0;
+
+  /* See if soft-dirty bits work by touching a page of our own. */
+
+  if (__afl_snap.clear_fd >= 0 && write(__afl_snap.clear_fd, "4", 1) == 1) {
+
+    *(volatile u64*)__afl_snap.pm = 0;
+    __afl_read_pagemap((u8*)__afl_snap.pm, 1);
+    __afl_snap.soft_dirty = !!(__afl_snap.pm[0] & PM_SOFT_DIRTY);
+
+  }
+
+  __afl_walk_maps(__afl_snap_add);
+
+  /* Hand out the bitmaps and the page-aligned copies. */
+
+  off = table_len + SNAP_BATCH * 8;
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) {
+
+    struct snap_region* r = &__afl_snap.reg[i];
+
+    r->present = __afl_snap.store + off;
+    off += (r->end - r->start) / __afl_snap.psize / 8 + 1;
+
+  }
+
+  off = (off + __afl_snap.psize - 1) & ~(u64)(__afl_snap.psize - 1);
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) {
+
+    struct snap_region* r = &__afl_snap.reg[i];
+
+    r->copy = __afl_snap.store + off;
+    off += r->end - r->start;
+
+  }
+
+  /* Copy everything that is populated. From now on, the contents of the
+     regions must stay the same until the baseline is set. */
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) {
+
+    struct snap_region* r = &__afl_snap.reg[i];
+    u32 pages = (r->end - r->start) / __afl_snap.psize;
+
+    for (j = 0; j < pages; j++) {
+
+      u8* addr = r->start + (u64)j * __afl_snap.psize;
+
+      if (!(j % SNAP_BATCH))
+        __afl_read_pagemap(addr, MIN(SNAP_BATCH, pages - j));
+
+      if (__afl_snap.pm[j % SNAP_BATCH] & (PM_PRESENT | PM_SWAPPED)) {
+        memcpy(r->copy + (u64)j * __afl_snap.psize, addr, __afl_snap.psize);
+        r->present[j / 8] |= 1 << (j % 8);
+      }
+
+    }
+
+  }
+
+  if (__afl_snap.soft_dirty && write(__afl_snap.clear_fd, "4", 1) != 1)
+    __afl_snap_fatal("unable to write /proc/self/clear_refs");
+
+}
+
+
+/* Bring the writable memory back to the snapshot. */
+
+static void __afl_restore(void) {
+
+  u32 i, j;
+
+  /* Undo heap growth (or shrinkage) first, so that the walk below sees the
+     same [heap] region as the snapshot. */
+
+  if ((u8*)syscall(SYS_brk, 0) != __afl_snap.brk)
+    syscall(SYS_brk, __afl_snap.brk);
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) __afl_snap.reg[i].seen = 0;
+  __afl_snap.unmap_cnt = 0;
+
+  __afl_walk_maps(__afl_snap_check);
+
+  for (i = 0; i < __afl_snap.unmap_cnt; i++)
+    munmap(__afl_snap.unmap[i][0],
+           __afl_snap.unmap[i][1] - __afl_snap.unmap[i][0]);
+
+  for (i = 0; i < __afl_snap.reg_cnt; i++) {
+
+    struct snap_region* r = &__afl_snap.reg[i];
+    u32 pages = (r->end - r->start) / __afl_snap.psize;
+
+    /* Regions that went away or lost write access are mapped again. The
+       fresh pages are not populated, so they get fully rewritten below. */
+
+    if (!r->seen &&
+        mmap(r->start, r->end - r->start, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      __afl_snap_fatal("unable to map a lost region");
+
+    for (j = 0; j < pages; j++) {
+
+      u8* addr = r->start + (u64)j * __afl_snap.psize;
+      u8* copy = r->copy + (u64)j * __afl_snap.psize;
+      u64 ent;
+
+      if (!(j % SNAP_BATCH))
+        __afl_read_pagemap(addr, MIN(SNAP_BATCH, pages - j));
+
+      ent = __afl_snap.pm[j % SNAP_BATCH];
+
+      if (!(r->present[j / 8] & (1 << (j % 8)))) {
+
+        /* Not populated at snapshot time: dropping the page gives us zeros
+           or the original file contents, whichever applies. */
+
+        if (ent & (PM_PRESENT | PM_SWAPPED))
+          madvise(addr, __afl_snap.psize, MADV_DONTNEED);
+
+        continue;
+
+      }
+
+      if (!(ent & (PM_PRESENT | PM_SWAPPED)) ||
+          (__afl_snap.soft_dirty ? (ent & PM_SOFT_DIRTY) :
+           memcmp(addr, copy, __afl_snap.psize)))
+        memcpy(addr, copy, __afl_snap.psize);
+
+    }
+
+  }
+
+  if (__afl_snap.soft_dirty && write(__afl_snap.clear_fd, "4", 1) != 1)
+    __afl_snap_fatal("unable to write /proc/self/clear_refs");
+
+}
+
+#endif /* __linux__ */
+
+
 /* A simplified persistent mode handler, used as explained in README.llvm. */
 
 int __afl_persistent_loop(unsigned int max_cnt) {
 
   static u8  first_pass = 1;
-  static u32 cycle_cnt;
+  static volatile u32 cycle_cnt; /* Volatile because of __afl_restore() */
 
   if (first_pass) {
 
@@ -204,10 +933,17 @@ int __afl_persistent_loop(unsigned int max_cnt) {
       memset(__afl_area_ptr, 0, MAP_SIZE);
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
+      __afl_prev_ctx = 0;
+      memset(__afl_prev_ngram, 0, sizeof(__afl_prev_ngram));
     }
 
     cycle_cnt  = max_cnt;
     first_pass = 0;
+
+#ifdef __linux__
+    if (is_persistent && is_restore) __afl_snapshot();
+#endif /* __linux__ */
+
     return 1;
 
   }
@@ -216,10 +952,26 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (--cycle_cnt) {
 
+#ifdef __linux__
+
+      /* The counter lives in memory that is about to be rolled back. */
+
+      if (is_restore) {
+
+        u32 cnt = cycle_cnt;
+        __afl_restore();
+        cycle_cnt = cnt;
+
+      }
+
+#endif /* __linux__ */
+
       raise(SIGSTOP);
 
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
+      __afl_prev_ctx = 0;
+      memset(__afl_prev_ngram, 0, sizeof(__afl_prev_ngram));
 
       return 1;
 
@@ -263,6 +1015,8 @@ void __afl_manual_init(void) {
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
   is_persistent = !!getenv(PERSIST_ENV_VAR);
+  is_prefork    = !!getenv(PREFORK_ENV_VAR);
+  is_restore    = !!getenv("AFL_PERSISTENT_RESTORE");
 
   if (getenv(DEFER_ENV_VAR)) return;
 
@@ -279,17 +1033,19 @@ __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
    edge (as opposed to every basic block). */
 
 void __sanitizer_cov_trace_pc_guard(uint32_t* guard) {
-  __afl_area_ptr[*guard]++;
+  u32 idx = *guard;
+  if (idx) __afl_area_ptr[idx]++;
 }
 
 
 /* Init callback. Populates instrumentation IDs. Note that we're using
-   ID of 0 as a special value to indicate non-instrumented bits. That may
-   still touch the bitmap, but in a fairly harmless way. */
+   ID of 0 as a special value to indicate non-instrumented bits, as well as
+   probes turned off with AFL_FAST_PROBES. */
 
 void __sanitizer_cov_trace_pc_guard_init(uint32_t* start, uint32_t* stop) {
 
   u32 inst_ratio = 100;
+  u32* first = start;
   u8* x;
 
   if (start == stop || *start) return;
@@ -317,4 +1073,21 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t* start, uint32_t* stop) {
 
   }
 
+  /* Keep a copy of the IDs if afl-fuzz may want to turn probes off. */
+
+  if (getenv(PROBE_ENV_VAR) && __afl_guard_cnt < MAX_GUARD_SECTIONS) {
+
+    u32 n = stop - first;
+
+    __afl_guards[__afl_guard_cnt].start = first;
+    __afl_guards[__afl_guard_cnt].stop  = stop;
+    __afl_guards[__afl_guard_cnt].orig  = malloc(n * sizeof(u32));
+
+    if (__afl_guards[__afl_guard_cnt].orig) {
+      memcpy(__afl_guards[__afl_guard_cnt].orig, first, n * sizeof(u32));
+      __afl_guard_cnt++;
+    }
+
+  }
+
 }
@@ -0,0 +1,430 @@
+/*
+  Copyright 2015 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - LLVM-mode comparison splitting pass
+   --------------------------------------------------------
+
+   This transform runs ahead of afl-llvm-pass.so when AFL_LLVM_SPLIT_COMPARES
+   is set. It rewrites operations that afl-fuzz would otherwise see as a single
+   all-or-nothing edge into chains of single-byte comparisons, so that every
+   matching byte of a magic value shows up as new coverage:
+
+     - calls to strcmp(), strncmp(), memcmp() and bcmp() with a constant
+       string argument are expanded inline,
+
+     - switch statements on values wider than 8 bits are lowered into chains
+       of equality comparisons,
+
+     - equality comparisons of 16- to 64-bit integers against constants
+       (including the ones produced above) are split into byte comparisons,
+       most significant byte first.
+
+   The approach follows the laf-intel work by Dominik Maier et al.
+*/
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <set>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+using namespace llvm;
+
+/* Longest constant string or buffer that we are willing to expand inline,
+   and the largest switch that gets lowered into a comparison chain. */
+
+#define MAX_CMP_EXPAND    64
+#define MAX_SWITCH_CASES  256
+
+namespace {
+
+  class AFLSplitCompares : public ModulePass {
+
+    public:
+
+      static char ID;
+      AFLSplitCompares() : ModulePass(ID) { }
+
+      bool runOnModule(Module &M) override;
+
+    private:
+
+      unsigned int expandStringCompares(Module &M);
+      unsigned int lowerSwitches(Module &M);
+      unsigned int splitIntCompares(Module &M);
+
+  };
+
+}
+
+
+char AFLSplitCompares::ID = 0;
+
+
+/* Expand strcmp() and friends with one constant argument into a chain of
+   byte comparisons. The result is the difference of the first mismatching
+   bytes, or zero, which matches what libc returns closely enough. */
+
+unsigned int AFLSplitCompares::expandStringCompares(Module &M) {
+
+  LLVMContext &C = M.getContext();
+
+  IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+
+  std::vector<CallInst*> Calls;
+  unsigned int cnt = 0;
+
+  for (auto &F : M)
+    for (auto &BB : F)
+      for (auto &Inst : BB) {
+
+        CallInst *Call = dyn_cast<CallInst>(&Inst);
+        if (!Call) continue;
+
+        Function *Callee = Call->getCalledFunction();
+        if (!Callee || !Callee->getReturnType()->isIntegerTy(32)) continue;
+
+        StringRef Name = Callee->getName();
+
+        if ((Name == "strcmp" && Call->arg_size() == 2) ||
+            ((Name == "strncmp" || Name == "memcmp" || Name == "bcmp") &&
+             Call->arg_size() == 3))
+          Calls.push_back(Call);
+
+      }
+
+  for (auto Call : Calls) {
+
+    StringRef Name = Call->getCalledFunction()->getName();
+    StringRef Str;
+    bool is_mem = (Name == "memcmp" || Name == "bcmp");
+    bool const_first;
+    uint64_t len;
+    Value *Var;
+
+    /* Figure out which side is constant. For memcmp(), embedded NULs are
+       fine; for the string functions, we include the terminator. */
+
+    if (getConstantStringInfo(Call->getArgOperand(1), Str, 0, !is_mem)) {
+      const_first = false;
+      Var = Call->getArgOperand(0);
+    } else if (getConstantStringInfo(Call->getArgOperand(0), Str, 0, !is_mem)) {
+      const_first = true;
+      Var = Call->getArgOperand(1);
+    } else continue;
+
+    len = Str.size() + !is_mem;
+
+    if (Name != "strcmp") {
+
+      ConstantInt *Len = dyn_cast<ConstantInt>(Call->getArgOperand(2));
+      if (!Len) continue;
+
+      /* memcmp() past the end of the constant is not something we can
+         expand; strncmp() simply stops at the terminator. */
+
+      if (Len->getZExtValue() <= len) len = Len->getZExtValue();
+      else if (is_mem) continue;
+
+    }
+
+    if (!len || len > MAX_CMP_EXPAND) continue;
+
+    /* Split the block right before the call; the call itself gets replaced
+       with a PHI collecting the results of the comparison chain. */
+
+    BasicBlock *Head = Call->getParent();
+    Function   *F    = Head->getParent();
+    BasicBlock *End  = Head->splitBasicBlock(BasicBlock::iterator(Call),
+                                             "cmp_end");
+
+    Head->getTerminator()->eraseFromParent();
+
+    PHINode *PN = PHINode::Create(Int32Ty, len, "cmp_res", Call);
+
+    IRBuilder<> IRB(Head);
+    Value *VarPtr = IRB.CreateBitCast(Var, PointerType::get(Int8Ty, 0));
+    BasicBlock *Cur = Head;
+
+    for (uint64_t i = 0; i < len; i++) {
+
+      u8 cval = i < Str.size() ? Str[i] : 0;
+
+      IRB.SetInsertPoint(Cur);
+
+      Value *Byte = IRB.CreateLoad(IRB.CreateGEP(VarPtr, IRB.getInt64(i)));
+      Value *Wide = IRB.CreateZExt(Byte, Int32Ty);
+      Value *Diff = const_first ?
+                    IRB.CreateSub(ConstantInt::get(Int32Ty, cval), Wide) :
+                    IRB.CreateSub(Wide, ConstantInt::get(Int32Ty, cval));
+
+      PN->addIncoming(Diff, Cur);
+
+      if (i == len - 1) {
+        IRB.CreateBr(End);
+        break;
+      }
+
+      BasicBlock *Next = BasicBlock::Create(C, "cmp_byte", F, End);
+
+      IRB.CreateCondBr(IRB.CreateICmpNE(Byte, ConstantInt::get(Int8Ty, cval)),
+                       End, Next);
+
+      Cur = Next;
+
+    }
+
+    Call->replaceAllUsesWith(PN);
+    Call->eraseFromParent();
+
+    cnt++;
+
+  }
+
+  return cnt;
+
+}
+
+
+/* Lower switches on wide values into if-else chains of equality compares,
+   to be split further by splitIntCompares(). */
+
+unsigned int AFLSplitCompares::lowerSwitches(Module &M) {
+
+  LLVMContext &C = M.getContext();
+
+  std::vector<SwitchInst*> Switches;
+  unsigned int cnt = 0;
+
+  for (auto &F : M)
+    for (auto &BB : F)
+      if (SwitchInst *SI = dyn_cast<SwitchInst>(BB.getTerminator()))
+        if (SI->getCondition()->getType()->getIntegerBitWidth() > 8 &&
+            SI->getNumCases() && SI->getNumCases() <= MAX_SWITCH_CASES)
+          Switches.push_back(SI);
+
+  for (auto SI : Switches) {
+
+    BasicBlock *Head = SI->getParent();
+    Function   *F    = Head->getParent();
+    Value      *Cond = SI->getCondition();
+    BasicBlock *Cur  = Head;
+
+    std::vector<std::pair<BasicBlock*, BasicBlock*> > Edges;
+    std::set<BasicBlock*> Succs;
+
+    for (unsigned int i = 0; i < SI->getNumSuccessors(); i++)
+      Succs.insert(SI->getSuccessor(i));
+
+    /* Build the chain; the first comparison goes into the original block. */
+
+    unsigned int left = SI->getNumCases();
+
+    for (auto Case : SI->cases()) {
+
+      BasicBlock *Next = --left ?
+                         BasicBlock::Create(C, "switch_case", F) :
+                         SI->getDefaultDest();
+
+      IRBuilder<> IRB(Cur);
+
+      if (Cur == Head) IRB.SetInsertPoint(SI);
+
+      IRB.CreateCondBr(IRB.CreateICmpEQ(Cond, Case.getCaseValue()),
+                       Case.getCaseSuccessor(), Next);
+
+      Edges.push_back(std::make_pair(Cur, Case.getCaseSuccessor()));
+      if (!left) Edges.push_back(std::make_pair(Cur, Next));
+
+      Cur = Next;
+
+    }
+
+    /* Fix up PHI nodes in all successors: the edges from the original block
+       are replaced with the new ones, carrying the same values. */
+
+    for (auto Succ : Succs) {
+
+      for (auto &Inst : *Succ) {
+
+        PHINode *PN = dyn_cast<PHINode>(&Inst);
+        if (!PN) break;
+
+        int idx = PN->getBasicBlockIndex(Head);
+        if (idx < 0) continue;
+
+        Value *Val = PN->getIncomingValue(idx);
+
+        while (PN->getBasicBlockIndex(Head) >= 0)
+          PN->removeIncomingValue(Head, false);
+
+        for (auto &E : Edges)
+          if (E.second == Succ) PN->addIncoming(Val, E.first);
+
+      }
+
+    }
+
+    SI->eraseFromParent();
+    cnt++;
+
+  }
+
+  return cnt;
+
+}
+
+
+/* Split wide equality compares against constants into a chain of byte
+   compares, starting with the most significant byte. */
+
+unsigned int AFLSplitCompares::splitIntCompares(Module &M) {
+
+  LLVMContext &C = M.getContext();
+
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+
+  std::vector<ICmpInst*> Cmps;
+  unsigned int cnt = 0;
+
+  for (auto &F : M)
+    for (auto &BB : F)
+      for (auto &Inst : BB) {
+
+        ICmpInst *Cmp = dyn_cast<ICmpInst>(&Inst);
+        if (!Cmp || !Cmp->isEquality()) continue;
+
+        IntegerType *Ty = dyn_cast<IntegerType>(Cmp->getOperand(0)->getType());
+        if (!Ty) continue;
+
+        unsigned int width = Ty->getBitWidth();
+        if (width <= 8 || width > 64 || (width & 7)) continue;
+
+        /* Comparisons against zero have nothing to offer. */
+
+        ConstantInt *Const = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+        if (!Const) Const = dyn_cast<ConstantInt>(Cmp->getOperand(0));
+
+        if (!Const || Const->isZero()) continue;
+
+        Cmps.push_back(Cmp);
+
+      }
+
+  for (auto Cmp : Cmps) {
+
+    BasicBlock *Head = Cmp->getParent();
+    Function   *F    = Head->getParent();
+    BasicBlock *End  = Head->splitBasicBlock(BasicBlock::iterator(Cmp),
+                                             "split_end");
+
+    bool is_eq = Cmp->getPredicate() == CmpInst::ICMP_EQ;
+    unsigned int bytes = Cmp->getOperand(0)->getType()->getIntegerBitWidth() / 8;
+
+    Head->getTerminator()->eraseFromParent();
+
+    PHINode *PN = PHINode::Create(Cmp->getType(), bytes, "split_res", Cmp);
+
+    BasicBlock *Cur = Head;
+
+    while (bytes--) {
+
+      IRBuilder<> IRB(Cur);
+
+      Value *A = IRB.CreateTrunc(IRB.CreateLShr(Cmp->getOperand(0), bytes * 8),
+                                 Int8Ty);
+      Value *B = IRB.CreateTrunc(IRB.CreateLShr(Cmp->getOperand(1), bytes * 8),
+                                 Int8Ty);
+      Value *Eq = IRB.CreateICmpEQ(A, B);
+
+      if (!bytes) {
+        PN->addIncoming(is_eq ? Eq : IRB.CreateNot(Eq), Cur);
+        IRB.CreateBr(End);
+        break;
+      }
+
+      BasicBlock *Next = BasicBlock::Create(C, "split_byte", F, End);
+
+      PN->addIncoming(ConstantInt::get(Cmp->getType(), !is_eq), Cur);
+      IRB.CreateCondBr(Eq, Next, End);
+
+      Cur = Next;
+
+    }
+
+    Cmp->replaceAllUsesWith(PN);
+    Cmp->eraseFromParent();
+
+    cnt++;
+
+  }
+
+  return cnt;
+
+}
+
+
+bool AFLSplitCompares::runOnModule(Module &M) {
+
+  unsigned int str_cnt, sw_cnt, cmp_cnt;
+
+  /* Order matters: the first two steps produce compares for the third. */
+
+  str_cnt = expandStringCompares(M);
+  sw_cnt  = lowerSwitches(M);
+  cmp_cnt = splitIntCompares(M);
+
+  if (isatty(2) && !getenv("AFL_QUIET"))
+    OKF("Split %u string compares, %u switches, %u integer compares.",
+        str_cnt, sw_cnt, cmp_cnt);
+
+  return str_cnt || sw_cnt || cmp_cnt;
+
+}
+
+
+static void registerSplitPass(const PassManagerBuilder &,
+                              legacy::PassManagerBase &PM) {
+
+  PM.add(new AFLSplitCompares());
+
+}
+
+
+/* afl-clang-fast loads this plugin ahead of afl-llvm-pass.so, so that the
+   transform runs first at both extension points. */
+
+static RegisterStandardPasses RegisterSplitPass(
+    PassManagerBuilder::EP_ModuleOptimizerEarly, registerSplitPass);
+
+static RegisterStandardPasses RegisterSplitPass0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerSplitPass);